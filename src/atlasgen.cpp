@@ -0,0 +1,3542 @@
+#include "atlasgen.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <climits>
+#include <cstring>
+#include <cmath>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <optional>
+#include <filesystem>
+#include <unordered_map>
+#include <unordered_set>
+#include <map>
+#include <memory>
+#include <fstream>
+#include <sstream>
+#include <iterator>
+#include <atomic>
+#include <algorithm>
+
+#include <freetype/ftbitmap.h>
+#include <freetype/ftlcdfil.h>
+#include <freetype/ftmm.h>
+#include <freetype/ftmodapi.h>
+#include <freetype/ftoutln.h>
+#include <freetype/ftsizes.h>
+#include "blit.hpp"
+#include "defer.hpp"
+#include "hash.hpp"
+#include "json.hpp"
+#include "kerning.hpp"
+#include "mapped_file.hpp"
+#include "msdf.hpp"
+#include "parallel.hpp"
+
+#define STB_RECT_PACK_IMPLEMENTATION
+#include <stb_rect_pack.h>
+
+const char* AtlasFormatName(AtlasFormat format) {
+    switch (format) {
+    case AtlasFormat::GA8: return "ga8";
+    case AtlasFormat::A8: return "a8";
+    case AtlasFormat::A1: return "a1";
+    case AtlasFormat::RGB8: return "rgb8";
+    case AtlasFormat::RGBA8: return "rgba8";
+    }
+    return "";
+}
+
+size_t AtlasPitch(AtlasFormat format, int width) {
+    switch (format) {
+    case AtlasFormat::GA8: return (size_t)width * 2;
+    case AtlasFormat::A8: return (size_t)width;
+    case AtlasFormat::A1: return ((size_t)width + 7) / 8;
+    case AtlasFormat::RGB8: return (size_t)width * 3;
+    case AtlasFormat::RGBA8: return (size_t)width * 4;
+    }
+    return 0;
+}
+
+const char* DistanceFieldName(DistanceField field) {
+    switch (field) {
+    case DistanceField::None: return "none";
+    case DistanceField::Sdf: return "sdf";
+    case DistanceField::Msdf: return "msdf";
+    }
+    return "";
+}
+
+const char* AtlasStatusName(AtlasStatus status) {
+    switch (status) {
+    case AtlasStatus::Ok: return "ok";
+    case AtlasStatus::InvalidOptions: return "invalid options";
+    case AtlasStatus::InvalidFont: return "invalid font";
+    case AtlasStatus::RenderFailed: return "render failed";
+    case AtlasStatus::PackFailed: return "pack failed";
+    case AtlasStatus::BlitFailed: return "blit failed";
+    case AtlasStatus::OutputFailed: return "output failed";
+    }
+    return "";
+}
+
+const char* MapFieldName(MapField field) {
+    switch (field) {
+    case MapField::Width: return "width";
+    case MapField::Height: return "height";
+    case MapField::LeftBearing: return "leftBearing";
+    case MapField::TopBearing: return "topBearing";
+    case MapField::Advance: return "advance";
+    case MapField::X: return "x";
+    case MapField::Y: return "y";
+    case MapField::Page: return "page";
+    }
+    return "";
+}
+
+namespace {
+
+// Prints FreeType errors. The library never exits, callers turn false into an AtlasStatus.
+bool FtOk(FT_Error err) {
+    if (err != FT_Err_Ok) {
+        printf("FT_Error %d (%s)\n", err, FT_Error_String(err));
+        return false;
+    }
+    return true;
+}
+
+// The glyphs of one job, sorted by glyph index. A glyph's position is its id in the map
+// files, or with subpixel phases its record, see SplitPhases. Kept as columns because every
+// pass only touches a few of them, and the map writers walk them column by column.
+struct GlyphTable {
+    std::vector<FT_UInt> glyphIndex;
+    std::vector<unsigned int> width;
+    std::vector<unsigned int> height;
+    std::vector<FT_Int> leftBearing;
+    std::vector<FT_Int> topBearing;
+    std::vector<FT_Pos> advance;
+    // Position in the atlas without padding. Zero for glyphs with nothing to draw.
+    std::vector<int> x;
+    std::vector<int> y;
+    std::vector<int> page;
+    // Only used with --single-pass. Location of the rendered bitmap in the glyph arenas.
+    std::vector<size_t> bitmapArena;
+    std::vector<size_t> bitmapOffset;
+    std::vector<int> bitmapPitch;
+    std::vector<unsigned char> pixelMode;
+    // Subpixel phase the glyph is rendered at, see AtlasOptions::subpixel.
+    std::vector<unsigned char> phase;
+
+    size_t Size() const {
+        return glyphIndex.size();
+    }
+
+    void Resize(size_t count) {
+        glyphIndex.resize(count);
+        width.resize(count);
+        height.resize(count);
+        leftBearing.resize(count);
+        topBearing.resize(count);
+        advance.resize(count);
+        x.resize(count);
+        y.resize(count);
+        page.resize(count);
+        bitmapArena.resize(count);
+        bitmapOffset.resize(count);
+        bitmapPitch.resize(count);
+        pixelMode.resize(count);
+        phase.resize(count);
+    }
+};
+
+// Value every atlas byte starts out with.
+uint8_t AtlasBackground(AtlasFormat format) {
+    return format == AtlasFormat::GA8 ? 0xFF : 0x00;
+}
+
+// Copies a rendered glyph bitmap into the atlas at the (unpadded) rect position.
+bool BlitGlyph(const FT_Bitmap& bitmap, const stbrp_rect& rect, uint8_t* atlasBmp, AtlasFormat format, size_t atlasPitch) {
+    const BlitKernels& kernels = GetBlitKernels();
+    const unsigned char* buffer = bitmap.buffer;
+    int src_pitch = abs(bitmap.pitch);
+    const size_t width = bitmap.width;
+    // RGBA atlases only hold color bitmaps, and those only go into RGBA atlases. LCD bitmaps
+    // need an RGB atlas, which also takes gray and mono bitmaps as equal subpixels.
+    const bool lcd = bitmap.pixel_mode == FT_PIXEL_MODE_LCD || bitmap.pixel_mode == FT_PIXEL_MODE_LCD_V;
+    if ((format == AtlasFormat::RGBA8) != (bitmap.pixel_mode == FT_PIXEL_MODE_BGRA) ||
+        (lcd && format != AtlasFormat::RGB8)) {
+        printf("FT_Pixel_Mode %d can't be written to a %s atlas\n", bitmap.pixel_mode, AtlasFormatName(format));
+        return false;
+    }
+    switch (bitmap.pixel_mode) {
+    case FT_PIXEL_MODE_GRAY: {
+        std::vector<uint8_t> bits(format == AtlasFormat::A1 ? (width + 7) / 8 : 0);
+        for (unsigned int y = 0; y < bitmap.rows; ++y) {
+            const uint8_t* srcRow = &buffer[y*src_pitch];
+            uint8_t* dstRow = &atlasBmp[(y+rect.y)*atlasPitch];
+            switch (format) {
+            case AtlasFormat::GA8:
+                kernels.grayToGA(&dstRow[rect.x*2], srcRow, width);
+                break;
+            case AtlasFormat::A8:
+                memcpy(&dstRow[rect.x], srcRow, width);
+                break;
+            case AtlasFormat::A1:
+                kernels.grayToMono(bits.data(), srcRow, width);
+                MergeBitsRow(dstRow, rect.x, bits.data(), width);
+                break;
+            case AtlasFormat::RGB8:
+                kernels.interleaveRGB(&dstRow[rect.x*3], srcRow, srcRow, srcRow, width);
+                break;
+            case AtlasFormat::RGBA8:
+                break;
+            }
+        }
+        return true;
+    }
+    case FT_PIXEL_MODE_MONO: {
+        std::vector<uint8_t> coverage(format == AtlasFormat::A1 ? 0 : width);
+        for (unsigned int y = 0; y < bitmap.rows; ++y) {
+            const uint8_t* srcRow = &buffer[y*src_pitch];
+            uint8_t* dstRow = &atlasBmp[(y+rect.y)*atlasPitch];
+            switch (format) {
+            case AtlasFormat::GA8:
+                kernels.monoToGray(coverage.data(), srcRow, width);
+                kernels.grayToGA(&dstRow[rect.x*2], coverage.data(), width);
+                break;
+            case AtlasFormat::A8:
+                kernels.monoToGray(&dstRow[rect.x], srcRow, width);
+                break;
+            case AtlasFormat::A1:
+                MergeBitsRow(dstRow, rect.x, srcRow, width);
+                break;
+            case AtlasFormat::RGB8:
+                kernels.monoToGray(coverage.data(), srcRow, width);
+                kernels.interleaveRGB(&dstRow[rect.x*3], coverage.data(), coverage.data(), coverage.data(), width);
+                break;
+            case AtlasFormat::RGBA8:
+                break;
+            }
+        }
+        return true;
+    }
+    case FT_PIXEL_MODE_LCD: {
+        // Three bytes per pixel in R, G, B order, width counts the bytes.
+        for (unsigned int y = 0; y < bitmap.rows; ++y) {
+            memcpy(&atlasBmp[(y+rect.y)*atlasPitch + rect.x*3], &buffer[y*src_pitch], width);
+        }
+        return true;
+    }
+    case FT_PIXEL_MODE_LCD_V: {
+        // Three rows per pixel row, holding the R, G and B subpixels.
+        for (unsigned int y = 0; y < bitmap.rows / 3; ++y) {
+            const uint8_t* srcRow = &buffer[y*3*src_pitch];
+            kernels.interleaveRGB(&atlasBmp[(y+rect.y)*atlasPitch + rect.x*3], srcRow, srcRow + src_pitch, srcRow + 2*src_pitch, width);
+        }
+        return true;
+    }
+    case FT_PIXEL_MODE_BGRA: {
+        // FreeType's color bitmaps are premultiplied, PNG wants straight alpha.
+        for (unsigned int y = 0; y < bitmap.rows; ++y) {
+            const uint8_t* src = &buffer[y*src_pitch];
+            uint8_t* dst = &atlasBmp[(y+rect.y)*atlasPitch + rect.x*4];
+            for (size_t x = 0; x < width; ++x, src += 4, dst += 4) {
+                const unsigned a = src[3];
+                if (a == 0) {
+                    continue;
+                }
+                dst[0] = (uint8_t)std::min(255u, (src[2]*255 + a/2) / a);
+                dst[1] = (uint8_t)std::min(255u, (src[1]*255 + a/2) / a);
+                dst[2] = (uint8_t)std::min(255u, (src[0]*255 + a/2) / a);
+                dst[3] = (uint8_t)a;
+            }
+        }
+        return true;
+    }
+    case FT_PIXEL_MODE_NONE:
+    case FT_PIXEL_MODE_GRAY2:
+    case FT_PIXEL_MODE_GRAY4:
+        printf("Unsupported FT_Pixel_Mode %d\n", bitmap.pixel_mode);
+        return false;
+    default:
+        printf("Unknown FT_Pixel_Mode %d\n", bitmap.pixel_mode);
+        return false;
+    }
+}
+
+// Converts --axis values into design coordinates for every axis of the font, filling in
+// defaults for axes that weren't given. The defaults of a face opened as a named instance are
+// the coordinates of that instance.
+bool ResolveAxes(FT_Library ft, FT_Face face, std::unordered_map<std::string, FT_Fixed> axes, std::vector<FT_Fixed>& coords) {
+    coords.clear();
+    // An empty list resets the axes to the defaults of the font, not of the instance.
+    const FT_Long namedInstance = face->face_index >> 16;
+    if (axes.empty() && namedInstance == 0) {
+        return true;
+    }
+
+    FT_MM_Var* master;
+    if (!FtOk(FT_Get_MM_Var(face, &master))) {
+        return false;
+    }
+    defer { FT_Done_MM_Var(ft, master); };
+
+    if (master->num_axis == 0) {
+        printf("This font has no axes\n");
+        return false;
+    }
+
+    coords.reserve(master->num_axis);
+    for (FT_UInt i = 0; i < master->num_axis; ++i) {
+        const FT_Var_Axis& axis = master->axis[i];
+        FT_Fixed coord = namedInstance != 0 ? master->namedstyle[namedInstance - 1].coords[i] : axis.def;
+        auto it = axes.find(axis.name);
+        if (it != axes.end()) {
+            coord = it->second;
+            axes.erase(it);
+        }
+
+        if (coord < axis.minimum || coord > axis.maximum) {
+            printf("Axis %s must be %f <= x <= %f\n", axis.name, (double)axis.minimum / (1 << 16), (double)axis.maximum / (1 << 16));
+            return false;
+        }
+        coords.push_back(coord);
+    }
+
+    if (!axes.empty()) {
+        printf("The provided axis/axes do not exist in this font:");
+        for (auto it = axes.begin(); it != axes.end(); ++it) {
+            printf("%s%s", it == axes.begin() ? " " : ", ", it->first.c_str());
+        }
+        printf("\nValid axes are:");
+        for (FT_UInt i = 0; i < master->num_axis; ++i) {
+            printf("%s%s", i == 0 ? " " : ", ", master->axis[i].name);
+        }
+        printf("\n");
+        return false;
+    }
+    return true;
+}
+
+}
+
+// One opened face, kept as long as its AtlasFont. Each pixel size gets its own FT_Size so jobs can
+// switch between sizes without FreeType rescaling the font and rerunning its hinting programs.
+class FontInstance {
+    struct SizeEntry {
+        FT_Size size;
+        // Value of m_coordsVersion when this size was last scaled.
+        uint32_t coordsVersion;
+        // Pixel size / size of the selected strike, see StrikeScale().
+        double strikeScale;
+    };
+
+    FT_Library m_ft = nullptr;
+    FT_Face m_face = nullptr;
+    bool m_ownsLibrary = false;
+    std::map<int, SizeEntry> m_sizes;
+    std::vector<FT_Fixed> m_coords;
+    uint32_t m_coordsVersion = 0;
+    double m_strikeScale = 1.0;
+
+public:
+    FontInstance() = default;
+
+    FontInstance(const FontInstance&) = delete;
+    FontInstance& operator=(const FontInstance&) = delete;
+
+    ~FontInstance() {
+        if (m_face) {
+            FT_Done_Face(m_face);
+        }
+        if (m_ownsLibrary) {
+            FT_Done_FreeType(m_ft);
+        }
+    }
+
+    // Opens the font from data if it is set, otherwise from path. Uses its own library when
+    // ft is null. index is a FreeType face index, the named instance in the upper 16 bits.
+    bool Open(FT_Library ft, const char* path, const uint8_t* data, size_t size, FT_Long index) {
+        m_ft = ft;
+        if (!m_ft) {
+            if (!FtOk(FT_Init_FreeType(&m_ft))) {
+                m_ft = nullptr;
+                return false;
+            }
+            m_ownsLibrary = true;
+        }
+        if (data) {
+            return FtOk(FT_New_Memory_Face(m_ft, data, (FT_Long)size, index, &m_face));
+        }
+        return FtOk(FT_New_Face(m_ft, path, index, &m_face));
+    }
+
+    FT_Library Library() const { return m_ft; }
+    FT_Face Face() const { return m_face; }
+
+    // Activates the size object for pixelSize and applies the variation coordinates.
+    bool Select(int pixelSize, const std::vector<FT_Fixed>& coords) {
+        auto it = m_sizes.find(pixelSize);
+        if (it == m_sizes.end()) {
+            FT_Size size;
+            if (!FtOk(FT_New_Size(m_face, &size))) {
+                return false;
+            }
+            it = m_sizes.emplace(pixelSize, SizeEntry{size, m_coordsVersion - 1, 1.0}).first;
+        }
+        if (!FtOk(FT_Activate_Size(it->second.size))) {
+            return false;
+        }
+
+        if (coords != m_coords) {
+            // An empty coordinate list resets every axis to its default.
+            if (!FtOk(FT_Set_Var_Design_Coordinates(m_face, coords.size(), (FT_Fixed*)coords.data()))) {
+                return false;
+            }
+            m_coords = coords;
+            ++m_coordsVersion;
+        }
+        // Metrics and hinting depend on the variation, so sizes scaled for other coordinates
+        // have to be scaled again.
+        if (it->second.coordsVersion != m_coordsVersion) {
+            if (FT_IS_SCALABLE(m_face) || m_face->num_fixed_sizes == 0) {
+                if (!FtOk(FT_Set_Pixel_Sizes(m_face, 0, pixelSize))) {
+                    return false;
+                }
+            } else {
+                // Bitmap-only fonts, like CBDT emoji, only come in fixed strikes. Take the
+                // smallest one at least as large as the pixel size (or the largest there is)
+                // and let MeasureGlyph resample its bitmaps.
+                int best = 0;
+                for (int i = 0; i < m_face->num_fixed_sizes; ++i) {
+                    FT_Pos ppem = m_face->available_sizes[i].y_ppem;
+                    FT_Pos bestPpem = m_face->available_sizes[best].y_ppem;
+                    bool large = ppem >= pixelSize * 64;
+                    bool bestLarge = bestPpem >= pixelSize * 64;
+                    if (large != bestLarge ? large : (large ? ppem < bestPpem : ppem > bestPpem)) {
+                        best = i;
+                    }
+                }
+                if (!FtOk(FT_Select_Size(m_face, best))) {
+                    return false;
+                }
+                it->second.strikeScale = pixelSize * 64.0 / m_face->available_sizes[best].y_ppem;
+            }
+            it->second.coordsVersion = m_coordsVersion;
+        }
+        m_strikeScale = it->second.strikeScale;
+        return true;
+    }
+
+    // How much glyphs of the selected size have to be scaled to get to the pixel size. Only
+    // differs from 1 for bitmap-only fonts without a strike of that size.
+    double StrikeScale() const { return m_strikeScale; }
+};
+
+// Sorted codepoint -> glyph index pairs from the charmap. Built once per font and shared by
+// every job.
+struct CodepointTable {
+    std::vector<std::pair<uint32_t, FT_UInt>> entries;
+
+    bool Build(FT_Face face) {
+        FT_UInt glyphIndex;
+        FT_ULong cp = FT_Get_First_Char(face, &glyphIndex);
+        while (glyphIndex != 0) {
+            entries.push_back({(uint32_t)cp, glyphIndex});
+            cp = FT_Get_Next_Char(face, cp, &glyphIndex);
+        }
+        return !entries.empty();
+    }
+
+    // Calls fn(cp, glyphIndex) for every codepoint in [first, last] that the font maps.
+    // Returns how many there were.
+    template <class Fn>
+    size_t ForEach(uint32_t first, uint32_t last, Fn&& fn) const {
+        auto it = std::lower_bound(entries.begin(), entries.end(), std::pair<uint32_t, FT_UInt>{first, 0});
+        size_t count = 0;
+        for (; it != entries.end() && it->first <= last; ++it, ++count) {
+            fn(it->first, it->second);
+        }
+        return count;
+    }
+
+    // Collapses the charmap into first-last ranges of consecutive codepoints.
+    std::vector<std::pair<uint32_t, uint32_t>> Ranges() const {
+        std::vector<std::pair<uint32_t, uint32_t>> ranges;
+        for (auto& entry : entries) {
+            if (!ranges.empty() && ranges.back().second + 1 == entry.first) {
+                ranges.back().second = entry.first;
+            } else {
+                ranges.push_back({entry.first, entry.first});
+            }
+        }
+        return ranges;
+    }
+};
+
+namespace {
+
+// Adds the time fn takes to *ms, or just runs fn when ms is null.
+template <class Fn>
+void Timed(double* ms, Fn&& fn) {
+    if (!ms) {
+        fn();
+        return;
+    }
+    auto begin = Clock::now();
+    fn();
+    *ms += MsSince(begin);
+}
+
+// The codepoint ranges of a job, sorted and with overlapping and adjacent ranges joined, so
+// every codepoint is in one of them. Without ranges, the whole charmap.
+std::vector<std::pair<uint32_t, uint32_t>> JobRanges(const AtlasOptions& job, const CodepointTable& cpTable) {
+    if (job.cpRanges.empty()) {
+        return cpTable.Ranges();
+    }
+    std::vector<std::pair<uint32_t, uint32_t>> sorted = job.cpRanges;
+    std::sort(sorted.begin(), sorted.end());
+    std::vector<std::pair<uint32_t, uint32_t>> ranges;
+    for (auto range : sorted) {
+        if (!ranges.empty() && (range.first <= ranges.back().second || range.first == ranges.back().second + 1)) {
+            ranges.back().second = std::max(ranges.back().second, range.second);
+        } else {
+            ranges.push_back(range);
+        }
+    }
+    return ranges;
+}
+
+// One codepoint of a job, see BuildAtlas.
+struct CodepointEntry {
+    uint32_t cp;
+    FT_UInt glyphIndex;
+    uint32_t glyphId;
+};
+
+// Sorts the codepoints, drops duplicates and numbers their glyphs. Glyph ids follow glyph
+// index order, except that the leading glyphs keep ids 0, 1, ... The font bounds the glyph
+// indices, so a flat array indexed by them both dedups and numbers the glyphs.
+void NumberGlyphs(FT_Face face, const std::vector<FT_UInt>& leading, std::vector<CodepointEntry>& codepoints, GlyphTable& glyphs) {
+    std::sort(codepoints.begin(), codepoints.end(), [](const CodepointEntry& a, const CodepointEntry& b) {
+        return a.cp < b.cp;
+    });
+    codepoints.erase(std::unique(codepoints.begin(), codepoints.end(), [](const CodepointEntry& a, const CodepointEntry& b) {
+        return a.cp == b.cp;
+    }), codepoints.end());
+
+    FT_UInt indexEnd = (FT_UInt)std::max<FT_Long>(face->num_glyphs, 0);
+    for (auto& entry : codepoints) {
+        indexEnd = std::max(indexEnd, entry.glyphIndex + 1);
+    }
+    const uint32_t NO_GLYPH = UINT32_MAX;
+    const uint32_t NEW_GLYPH = UINT32_MAX - 1;
+    std::vector<uint32_t> glyphIds(indexEnd, NO_GLYPH);
+    for (auto& entry : codepoints) {
+        glyphIds[entry.glyphIndex] = NEW_GLYPH;
+    }
+    for (FT_UInt glyphIndex : leading) {
+        glyphIds[glyphIndex] = (uint32_t)glyphs.glyphIndex.size();
+        glyphs.glyphIndex.push_back(glyphIndex);
+    }
+    for (FT_UInt glyphIndex = 0; glyphIndex < indexEnd; ++glyphIndex) {
+        if (glyphIds[glyphIndex] == NEW_GLYPH) {
+            glyphIds[glyphIndex] = (uint32_t)glyphs.glyphIndex.size();
+            glyphs.glyphIndex.push_back(glyphIndex);
+        }
+    }
+    glyphs.Resize(glyphs.glyphIndex.size());
+    for (auto& entry : codepoints) {
+        entry.glyphId = glyphIds[entry.glyphIndex];
+    }
+}
+
+// Replaces every glyph with one record per subpixel phase: glyph id G becomes records
+// G * subpixel + phase, all of the same glyph index. Codepoints point at phase 0.
+void SplitPhases(int subpixel, std::vector<CodepointEntry>& codepoints, GlyphTable& glyphs) {
+    std::vector<FT_UInt> glyphIndices = std::move(glyphs.glyphIndex);
+    glyphs.glyphIndex.clear();
+    for (FT_UInt glyphIndex : glyphIndices) {
+        glyphs.glyphIndex.insert(glyphs.glyphIndex.end(), subpixel, glyphIndex);
+    }
+    glyphs.Resize(glyphs.glyphIndex.size());
+    for (size_t id = 0; id < glyphs.Size(); ++id) {
+        glyphs.phase[id] = (unsigned char)(id % subpixel);
+    }
+    for (auto& entry : codepoints) {
+        entry.glyphId *= subpixel;
+    }
+}
+
+// The kerning between every pair of glyphs by glyph id, in whole pixels. scale is
+// FontInstance::StrikeScale(), like the other metrics kerning is resampled by it.
+std::vector<MapData::KerningPair> MapKerning(FT_Face face, double scale, const std::vector<FT_UInt>& glyphIndices) {
+    std::vector<GlyphKerning> pairs;
+    ReadKerning(face, glyphIndices, pairs);
+    std::vector<MapData::KerningPair> kerning;
+    for (auto& pair : pairs) {
+        int32_t value = (int32_t)lround(pair.value * scale / 64.0);
+        if (value != 0) {
+            kerning.push_back({pair.left, pair.right, value});
+        }
+    }
+    return kerning;
+}
+
+FT_LcdFilter LcdFilterMode(LcdFilter filter) {
+    switch (filter) {
+    case LcdFilter::Default: return FT_LCD_FILTER_DEFAULT;
+    case LcdFilter::Light: return FT_LCD_FILTER_LIGHT;
+    case LcdFilter::Legacy: return FT_LCD_FILTER_LEGACY;
+    case LcdFilter::None: return FT_LCD_FILTER_NONE;
+    }
+    return FT_LCD_FILTER_DEFAULT;
+}
+
+// How the glyphs of a job are loaded and rasterized.
+struct GlyphRender {
+    FT_Int32 loadFlags = FT_LOAD_DEFAULT;
+    FT_Render_Mode renderMode = FT_RENDER_MODE_LIGHT;
+    // Rendered by RenderMsdf instead of FreeType.
+    bool msdf = false;
+    int spread = 0;
+    // FontInstance::StrikeScale(), bitmaps and metrics are resampled by it.
+    double bitmapScale = 1.0;
+    // Number of subpixel phases, see AtlasOptions::subpixel.
+    int subpixel = 1;
+};
+
+// Checks that the format fits the way glyphs are rendered.
+bool ValidRenderOptions(const AtlasOptions& job) {
+    if (job.format == AtlasFormat::A1 && !job.mono) {
+        printf("--format a1 requires --mono\n");
+        return false;
+    }
+    if (job.distanceField != DistanceField::None && (job.mono || job.format == AtlasFormat::A1)) {
+        printf("--sdf and --msdf can't be combined with --mono\n");
+        return false;
+    }
+    if (job.lcd != LcdLayout::None && (job.mono || job.distanceField != DistanceField::None)) {
+        printf("--lcd can't be combined with --mono, --sdf or --msdf\n");
+        return false;
+    }
+    if ((job.distanceField == DistanceField::Msdf || job.lcd != LcdLayout::None) != (job.format == AtlasFormat::RGB8)) {
+        printf("--msdf and --lcd always write rgb8 atlases, they can't be combined with --format\n");
+        return false;
+    }
+    return true;
+}
+
+// Sets up how the glyphs of a job are loaded and rendered, including the properties of the
+// (per worker) libraries. The load target decides the bitmap size FreeType reports before
+// rendering, so it has to match the render mode or --mono glyphs get measured for the
+// anti-aliased rasterizer. With color, color glyphs (CBDT/sbix bitmaps and COLR layers) come
+// out as BGRA and need pages of their own; --mono, --lcd and distance field jobs, and jobs
+// without color, get them flattened to gray like any other glyph.
+bool SetUpRender(const AtlasOptions& job, bool color, const std::vector<std::unique_ptr<FontInstance>>& instances, GlyphRender& render) {
+    render = GlyphRender{};
+    render.loadFlags = job.mono ? FT_LOAD_TARGET_MONO : color ? FT_LOAD_DEFAULT | FT_LOAD_COLOR : FT_LOAD_DEFAULT;
+    render.renderMode = job.mono ? FT_RENDER_MODE_MONO : FT_RENDER_MODE_LIGHT;
+    render.bitmapScale = instances[0]->StrikeScale();
+    render.subpixel = job.subpixel;
+    if (job.subpixel > 1 && !job.mono) {
+        // Hinting that snaps stems to whole pixels horizontally would undo the phases.
+        render.loadFlags |= FT_LOAD_TARGET_LIGHT;
+    }
+    if (job.lcd != LcdLayout::None) {
+        // LCD hinting only snaps across the subpixels. A FreeType built without
+        // ClearType-style filtering renders with its Harmony method instead, which has no
+        // filter to set.
+        const bool vertical = job.lcd == LcdLayout::Vertical;
+        render.loadFlags = vertical ? FT_LOAD_TARGET_LCD_V : FT_LOAD_TARGET_LCD;
+        render.renderMode = vertical ? FT_RENDER_MODE_LCD_V : FT_RENDER_MODE_LCD;
+        for (auto& instance : instances) {
+            FT_Error err = FT_Library_SetLcdFilter(instance->Library(), LcdFilterMode(job.lcdFilter));
+            if (err != FT_Err_Unimplemented_Feature && !FtOk(err)) {
+                return false;
+            }
+        }
+    }
+    if (job.distanceField != DistanceField::None) {
+        // Distance fields get scaled, so outlines shouldn't be snapped to this size's pixels.
+        render.loadFlags = FT_LOAD_NO_HINTING;
+        render.renderMode = FT_RENDER_MODE_SDF;
+        render.msdf = job.distanceField == DistanceField::Msdf;
+        render.spread = job.spread;
+        if (render.msdf) {
+            render.loadFlags |= FT_LOAD_NO_BITMAP;
+        }
+        // The spread is a property of the library's sdf and bsdf renderers.
+        for (auto& instance : instances) {
+            FT_Int spread = job.spread;
+            if (!FtOk(FT_Property_Set(instance->Library(), "sdf", "spread", &spread)) ||
+                !FtOk(FT_Property_Set(instance->Library(), "bsdf", "spread", &spread))) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Scales a gray or (premultiplied) BGRA bitmap by averaging the source pixels that every
+// destination pixel covers, and appends it to the arena with a pitch of width*channels.
+// Gray values go up to maxValue, which becomes 255.
+void ResampleBitmap(const FT_Bitmap& bitmap, int channels, unsigned maxValue, double scale, unsigned& width, unsigned& height, std::vector<uint8_t>& arena) {
+    width = std::max(1u, (unsigned)lround(bitmap.width * scale));
+    height = std::max(1u, (unsigned)lround(bitmap.rows * scale));
+
+    // Source pixels and their weights for every destination pixel along one axis.
+    struct Tap {
+        unsigned src;
+        float weight;
+    };
+    auto taps = [](unsigned srcSize, unsigned dstSize) {
+        std::vector<std::vector<Tap>> result{dstSize};
+        const double step = (double)srcSize / dstSize;
+        for (unsigned i = 0; i < dstSize; ++i) {
+            double begin = i * step, end = (i + 1) * step;
+            for (unsigned j = (unsigned)begin; j < srcSize && j < end; ++j) {
+                double overlap = std::min(end, j + 1.0) - std::max(begin, (double)j);
+                result[i].push_back({j, (float)(overlap / step)});
+            }
+        }
+        return result;
+    };
+    auto xTaps = taps(bitmap.width, width);
+    auto yTaps = taps(bitmap.rows, height);
+
+    const int srcPitch = abs(bitmap.pitch);
+    const float toByte = 255.0f / maxValue;
+    std::vector<float> row((size_t)width * channels);
+    const size_t offset = arena.size();
+    arena.resize(offset + (size_t)width * height * channels);
+    for (unsigned y = 0; y < height; ++y) {
+        std::fill(row.begin(), row.end(), 0.0f);
+        for (auto& yTap : yTaps[y]) {
+            const uint8_t* src = &bitmap.buffer[(size_t)yTap.src * srcPitch];
+            for (unsigned x = 0; x < width; ++x) {
+                for (auto& xTap : xTaps[x]) {
+                    float weight = xTap.weight * yTap.weight;
+                    for (int c = 0; c < channels; ++c) {
+                        row[x*channels + c] += src[xTap.src*channels + c] * weight;
+                    }
+                }
+            }
+        }
+        uint8_t* dst = &arena[offset + (size_t)y * width * channels];
+        for (size_t i = 0; i < row.size(); ++i) {
+            dst[i] = (uint8_t)std::min(255.0f, row[i] * toByte + 0.5f);
+        }
+    }
+}
+
+// Loads one glyph and captures its metrics. With single pass it is also rendered and the
+// bitmap is appended to the arena, otherwise it is only measured. False if FreeType failed.
+bool MeasureGlyph(FT_Face face, const GlyphRender& render, bool singlePass, GlyphTable& glyphs, size_t id, std::vector<uint8_t>& arena, GlyphTimes* times) {
+    FT_Error err = FT_Err_Ok;
+    Timed(times ? &times->loadMs : nullptr, [&]() {
+        err = FT_Load_Glyph(face, glyphs.glyphIndex[id], render.loadFlags);
+    });
+    if (!FtOk(err)) {
+        return false;
+    }
+    glyphs.advance[id] = face->glyph->advance.x;
+    if (glyphs.phase[id] != 0 && face->glyph->format == FT_GLYPH_FORMAT_OUTLINE) {
+        // The bitmap and its left bearing move with the outline, the advance stays.
+        // Color layers are loaded again by the renderer and stay at phase 0.
+        FT_Outline_Translate(&face->glyph->outline, glyphs.phase[id] * 64 / render.subpixel, 0);
+    }
+
+    if (render.msdf) {
+        // Stored like an FT_PIXEL_MODE_LCD bitmap, three bytes per pixel.
+        MsdfBitmap msdf;
+        if (face->glyph->format == FT_GLYPH_FORMAT_OUTLINE) {
+            Timed(times ? &times->renderMs : nullptr, [&]() {
+                RenderMsdf(face->glyph->outline, render.spread, msdf);
+            });
+        }
+        glyphs.width[id] = msdf.width;
+        glyphs.height[id] = msdf.height;
+        glyphs.leftBearing[id] = msdf.left;
+        glyphs.topBearing[id] = msdf.top;
+        glyphs.bitmapOffset[id] = arena.size();
+        glyphs.bitmapPitch[id] = msdf.width * 3;
+        glyphs.pixelMode[id] = FT_PIXEL_MODE_LCD;
+        arena.insert(arena.end(), msdf.rgb.begin(), msdf.rgb.end());
+        return true;
+    }
+
+    if (singlePass && face->glyph->format != FT_GLYPH_FORMAT_BITMAP) {
+        Timed(times ? &times->renderMs : nullptr, [&]() {
+            err = FT_Render_Glyph(face->glyph, render.renderMode);
+        });
+        if (!FtOk(err)) {
+            return false;
+        }
+    }
+    const FT_Bitmap& bitmap = face->glyph->bitmap;
+    // The table counts pixels, LCD bitmaps have three bytes or three rows for each.
+    glyphs.width[id] = bitmap.pixel_mode == FT_PIXEL_MODE_LCD ? bitmap.width / 3 : bitmap.width;
+    glyphs.height[id] = bitmap.pixel_mode == FT_PIXEL_MODE_LCD_V ? bitmap.rows / 3 : bitmap.rows;
+    glyphs.leftBearing[id] = face->glyph->bitmap_left;
+    glyphs.topBearing[id] = face->glyph->bitmap_top;
+
+    if (render.bitmapScale != 1.0) {
+        // A fixed strike of another size. Color bitmaps keep their layout, everything else
+        // is flattened to gray so it can be averaged.
+        glyphs.advance[id] = lround(glyphs.advance[id] * render.bitmapScale);
+        glyphs.leftBearing[id] = lround(glyphs.leftBearing[id] * render.bitmapScale);
+        glyphs.topBearing[id] = lround(glyphs.topBearing[id] * render.bitmapScale);
+        if (bitmap.width * bitmap.rows == 0) {
+            glyphs.width[id] = 0;
+            glyphs.height[id] = 0;
+            glyphs.bitmapOffset[id] = arena.size();
+            glyphs.bitmapPitch[id] = 0;
+            glyphs.pixelMode[id] = FT_PIXEL_MODE_GRAY;
+            return true;
+        }
+        glyphs.bitmapOffset[id] = arena.size();
+        unsigned width, height;
+        if (bitmap.pixel_mode == FT_PIXEL_MODE_BGRA) {
+            ResampleBitmap(bitmap, 4, 255, render.bitmapScale, width, height, arena);
+            glyphs.bitmapPitch[id] = width * 4;
+        } else {
+            FT_Library ft = face->glyph->library;
+            FT_Bitmap gray;
+            FT_Bitmap_Init(&gray);
+            defer { FT_Bitmap_Done(ft, &gray); };
+            if (!FtOk(FT_Bitmap_Convert(ft, &bitmap, &gray, 1))) {
+                return false;
+            }
+            ResampleBitmap(gray, 1, std::max(1, gray.num_grays - 1), render.bitmapScale, width, height, arena);
+            glyphs.bitmapPitch[id] = width;
+        }
+        glyphs.width[id] = width;
+        glyphs.height[id] = height;
+        glyphs.pixelMode[id] = bitmap.pixel_mode == FT_PIXEL_MODE_BGRA ? FT_PIXEL_MODE_BGRA : FT_PIXEL_MODE_GRAY;
+        return true;
+    }
+
+    if (singlePass && bitmap.pixel_mode == FT_PIXEL_MODE_LCD_V) {
+        // Stored interleaved like FT_PIXEL_MODE_LCD, so the cache, dedup and blit only see
+        // one LCD layout.
+        glyphs.bitmapOffset[id] = arena.size();
+        glyphs.bitmapPitch[id] = glyphs.width[id] * 3;
+        glyphs.pixelMode[id] = FT_PIXEL_MODE_LCD;
+        arena.resize(arena.size() + (size_t)glyphs.bitmapPitch[id] * glyphs.height[id]);
+        stbrp_rect origin{};
+        return BlitGlyph(bitmap, origin, arena.data() + glyphs.bitmapOffset[id], AtlasFormat::RGB8, glyphs.bitmapPitch[id]);
+    }
+    if (singlePass) {
+        glyphs.bitmapOffset[id] = arena.size();
+        glyphs.bitmapPitch[id] = abs(bitmap.pitch);
+        glyphs.pixelMode[id] = bitmap.pixel_mode;
+        size_t bitmapSize = (size_t)glyphs.bitmapPitch[id] * bitmap.rows;
+        arena.resize(arena.size() + bitmapSize);
+        if (bitmapSize != 0) {
+            memcpy(&arena[glyphs.bitmapOffset[id]], bitmap.buffer, bitmapSize);
+        }
+    }
+    return true;
+}
+
+// Bump whenever the cache file layout or the output format changes.
+const uint32_t CACHE_VERSION = 6;
+
+}
+
+// Rendered glyphs of one font/size/variation, stored in a single file so a rebuild only has
+// to rasterize glyphs that weren't rendered before. Layout is a CacheHeader followed by
+// CachedGlyph records, each followed by pitch*height bitmap bytes. It is only ever read back
+// by the machine that wrote it, so everything is in native byte order.
+class GlyphCache {
+public:
+    struct CacheHeader {
+        char magic[4];
+        uint32_t version;
+        uint64_t key;
+        FT_Pos ascender;
+        FT_Pos descender;
+        FT_Pos height;
+        uint64_t count;
+    };
+
+    struct CachedGlyph {
+        FT_UInt glyphIndex;
+        unsigned int width;
+        unsigned int height;
+        FT_Int leftBearing;
+        FT_Int topBearing;
+        FT_Pos advance;
+        int bitmapPitch;
+        unsigned char pixelMode;
+        unsigned char phase;
+    };
+
+private:
+    std::filesystem::path m_path;
+    uint64_t m_key = 0;
+    // Raw file contents, the arena that cached bitmaps are read from.
+    std::vector<uint8_t> m_data;
+    // Offsets by OffsetKey.
+    std::unordered_map<uint64_t, size_t> m_offsets;
+    size_t m_loadedCount = 0;
+    std::vector<uint8_t> m_added;
+    size_t m_addedCount = 0;
+    std::unordered_set<uint64_t> m_addedKeys;
+
+    static uint64_t OffsetKey(FT_UInt glyphIndex, unsigned char phase) {
+        return (uint64_t)glyphIndex << 8 | phase;
+    }
+
+public:
+    FT_Pos ascender = 0, descender = 0, height = 0;
+
+    GlyphCache(std::filesystem::path path, uint64_t key) : m_path(std::move(path)), m_key(key) {}
+
+    // Reads the file if it exists and matches the key. A missing or stale file is an empty cache.
+    void Load() {
+        std::ifstream f{m_path, std::ios::binary};
+        if (!f.is_open()) {
+            return;
+        }
+        m_data.assign(std::istreambuf_iterator<char>{f}, std::istreambuf_iterator<char>{});
+
+        CacheHeader header;
+        if (m_data.size() < sizeof(header)) {
+            m_data.clear();
+            return;
+        }
+        memcpy(&header, m_data.data(), sizeof(header));
+        if (memcmp(header.magic, "AGGC", 4) != 0 || header.version != CACHE_VERSION || header.key != m_key) {
+            m_data.clear();
+            return;
+        }
+        ascender = header.ascender;
+        descender = header.descender;
+        height = header.height;
+
+        size_t offset = sizeof(header);
+        for (uint64_t i = 0; i < header.count; ++i) {
+            CachedGlyph glyph;
+            if (offset + sizeof(glyph) > m_data.size()) {
+                break;
+            }
+            memcpy(&glyph, &m_data[offset], sizeof(glyph));
+            size_t bitmapSize = (size_t)glyph.bitmapPitch * glyph.height;
+            if (offset + sizeof(glyph) + bitmapSize > m_data.size()) {
+                break;
+            }
+            m_offsets[OffsetKey(glyph.glyphIndex, glyph.phase)] = offset;
+            offset += sizeof(glyph) + bitmapSize;
+            ++m_loadedCount;
+        }
+        // Drop a truncated tail so Save() only copies whole records.
+        m_data.resize(offset);
+    }
+
+    const std::vector<uint8_t>& Data() const { return m_data; }
+
+    // Fills in the metrics of a cached glyph and points it at its bitmap in Data().
+    bool Find(GlyphTable& glyphs, size_t id) const {
+        auto it = m_offsets.find(OffsetKey(glyphs.glyphIndex[id], glyphs.phase[id]));
+        if (it == m_offsets.end()) {
+            return false;
+        }
+        CachedGlyph cached;
+        memcpy(&cached, &m_data[it->second], sizeof(cached));
+        glyphs.width[id] = cached.width;
+        glyphs.height[id] = cached.height;
+        glyphs.leftBearing[id] = cached.leftBearing;
+        glyphs.topBearing[id] = cached.topBearing;
+        glyphs.advance[id] = cached.advance;
+        glyphs.bitmapOffset[id] = it->second + sizeof(cached);
+        glyphs.bitmapPitch[id] = cached.bitmapPitch;
+        glyphs.pixelMode[id] = cached.pixelMode;
+        return true;
+    }
+
+    // Glyphs the cache already has are skipped.
+    void Add(const GlyphTable& glyphs, size_t id, const uint8_t* bitmap) {
+        const uint64_t key = OffsetKey(glyphs.glyphIndex[id], glyphs.phase[id]);
+        if (m_offsets.count(key) != 0 || !m_addedKeys.insert(key).second) {
+            return;
+        }
+        CachedGlyph cached;
+        memset(&cached, 0, sizeof(cached));
+        cached.glyphIndex = glyphs.glyphIndex[id];
+        cached.width = glyphs.width[id];
+        cached.height = glyphs.height[id];
+        cached.leftBearing = glyphs.leftBearing[id];
+        cached.topBearing = glyphs.topBearing[id];
+        cached.advance = glyphs.advance[id];
+        cached.bitmapPitch = glyphs.bitmapPitch[id];
+        cached.pixelMode = glyphs.pixelMode[id];
+        cached.phase = glyphs.phase[id];
+        size_t bitmapSize = (size_t)cached.bitmapPitch * cached.height;
+        size_t offset = m_added.size();
+        m_added.resize(offset + sizeof(cached) + bitmapSize);
+        memcpy(&m_added[offset], &cached, sizeof(cached));
+        if (bitmapSize != 0) {
+            memcpy(&m_added[offset + sizeof(cached)], bitmap, bitmapSize);
+        }
+        ++m_addedCount;
+    }
+
+    bool Save() {
+        if (m_addedCount == 0 && !m_data.empty()) {
+            return true;
+        }
+        CacheHeader header;
+        memcpy(header.magic, "AGGC", 4);
+        header.version = CACHE_VERSION;
+        header.key = m_key;
+        header.ascender = ascender;
+        header.descender = descender;
+        header.height = height;
+        header.count = m_loadedCount + m_addedCount;
+
+        // Write to a temporary file first so an interrupted build can't leave a torn cache.
+        auto tmpPath = m_path;
+        tmpPath += ".tmp";
+        {
+            std::ofstream f{tmpPath, std::ios::binary};
+            if (!f.is_open()) {
+                return false;
+            }
+            f.write((const char*)&header, sizeof(header));
+            if (m_data.size() > sizeof(header)) {
+                f.write((const char*)&m_data[sizeof(header)], m_data.size() - sizeof(header));
+            }
+            f.write((const char*)m_added.data(), m_added.size());
+            if (!f) {
+                return false;
+            }
+        }
+        std::error_code err;
+        std::filesystem::rename(tmpPath, m_path, err);
+        return !err;
+    }
+};
+
+namespace {
+
+struct AtlasPage {
+    int width = 0;
+    int height = 0;
+    AtlasFormat format = AtlasFormat::GA8;
+};
+
+int StbrpHeuristic(PackHeuristic heuristic) {
+    return heuristic == PackHeuristic::BestFit ? STBRP_HEURISTIC_Skyline_BF_sortHeight : STBRP_HEURISTIC_Skyline_BL_sortHeight;
+}
+
+// Packs rects into as few pages as possible, each at most maxW x maxH (0 means unlimited).
+// Instead of retrying with ever larger targets, every page is packed once: its width comes
+// from the total area of the remaining rects times slack and its height is left open, so the
+// skyline just grows downwards. Rects that don't fit a height-limited page move on to the next
+// one. The page of every rect is stored in its id.
+bool PackRectsOnce(std::vector<stbrp_rect>& rects, int maxW, int maxH, int heuristic, double slack, std::vector<AtlasPage>& pages) {
+    // stbrp uses 1<<30 as a sentinel, stay below it.
+    const int UNLIMITED_HEIGHT = 1 << 29;
+
+    std::vector<size_t> remaining;
+    remaining.reserve(rects.size());
+    for (size_t i = 0; i < rects.size(); ++i) {
+        remaining.push_back(i);
+    }
+
+    std::vector<stbrp_rect> batch;
+    std::vector<stbrp_node> rpNodes;
+    while (!remaining.empty()) {
+        double area = 0;
+        int widest = 0;
+        for (size_t i : remaining) {
+            area += (double)rects[i].w * rects[i].h;
+            widest = std::max(widest, (int)rects[i].w);
+        }
+
+        int width = std::max(widest, (int)ceil(sqrt(area * slack)));
+        if (maxH) {
+            width = std::max(width, (int)ceil(area * slack / maxH));
+        }
+        if (maxW) {
+            width = std::min(width, maxW);
+        }
+        int height = maxH ? maxH : UNLIMITED_HEIGHT;
+
+        batch.clear();
+        for (size_t i : remaining) {
+            batch.push_back(rects[i]);
+        }
+        rpNodes.resize(width);
+        stbrp_context rpc;
+        stbrp_init_target(&rpc, width, height, rpNodes.data(), rpNodes.size());
+        stbrp_setup_heuristic(&rpc, heuristic);
+        stbrp_pack_rects(&rpc, batch.data(), batch.size());
+
+        AtlasPage page;
+        std::vector<size_t> unpacked;
+        for (size_t j = 0; j < batch.size(); ++j) {
+            stbrp_rect& rect = rects[remaining[j]];
+            if (!batch[j].was_packed) {
+                unpacked.push_back(remaining[j]);
+                continue;
+            }
+            rect.x = batch[j].x;
+            rect.y = batch[j].y;
+            rect.was_packed = 1;
+            rect.id = pages.size();
+            page.width = std::max(page.width, (int)(rect.x + rect.w));
+            page.height = std::max(page.height, (int)(rect.y + rect.h));
+        }
+        if (unpacked.size() == remaining.size()) {
+            printf("Failed to pack glyphs\n");
+            return false;
+        }
+        pages.push_back(page);
+        remaining = std::move(unpacked);
+    }
+
+    if (pages.empty()) {
+        // Nothing visible to pack, still produce a valid (empty) image.
+        pages.push_back(AtlasPage{1, 1});
+    }
+    return true;
+}
+
+// PackRectsOnce with the given heuristic. Auto packs once per heuristic and page width on
+// up to workers threads and keeps the result with the least page area, then the fewest pages.
+// Ties go to the earlier attempt, so the result doesn't depend on the thread count. passes
+// is increased by the number of times PackRectsOnce ran.
+bool PackRects(std::vector<stbrp_rect>& rects, int maxW, int maxH, PackHeuristic heuristic, size_t workers, std::vector<AtlasPage>& pages, size_t& passes) {
+    // The skyline packer leaves some holes, aim for a page a bit larger than the rect area.
+    const double PACK_SLACK = 1.1;
+
+    int widest = 0, tallest = 0;
+    for (auto& rect : rects) {
+        widest = std::max(widest, (int)rect.w);
+        tallest = std::max(tallest, (int)rect.h);
+    }
+    if ((maxW && widest > maxW) || (maxH && tallest > maxH)) {
+        printf("A %dx%d glyph doesn't fit into the maximum atlas size\n", widest, tallest);
+        return false;
+    }
+    if (heuristic != PackHeuristic::Auto) {
+        ++passes;
+        return PackRectsOnce(rects, maxW, maxH, StbrpHeuristic(heuristic), PACK_SLACK, pages);
+    }
+
+    struct Attempt {
+        PackHeuristic heuristic;
+        double slack;
+        std::vector<stbrp_rect> rects;
+        std::vector<AtlasPage> pages;
+        bool packed = false;
+    };
+    std::vector<Attempt> attempts;
+    for (double slack : {PACK_SLACK, 1.0, 1.25}) {
+        for (PackHeuristic h : {PackHeuristic::BottomLeft, PackHeuristic::BestFit}) {
+            attempts.push_back({h, slack, rects, pages});
+        }
+    }
+    passes += attempts.size();
+    ParallelFor(workers, attempts.size(), [&](size_t, size_t i) {
+        Attempt& attempt = attempts[i];
+        attempt.packed = PackRectsOnce(attempt.rects, maxW, maxH, StbrpHeuristic(attempt.heuristic), attempt.slack, attempt.pages);
+    });
+    auto pageArea = [&](const Attempt& attempt) {
+        double area = 0;
+        for (size_t i = pages.size(); i < attempt.pages.size(); ++i) {
+            area += (double)attempt.pages[i].width * attempt.pages[i].height;
+        }
+        return area;
+    };
+    Attempt* best = nullptr;
+    for (auto& attempt : attempts) {
+        if (!attempt.packed) {
+            continue;
+        }
+        if (!best || pageArea(attempt) < pageArea(*best) ||
+            (pageArea(attempt) == pageArea(*best) && attempt.pages.size() < best->pages.size())) {
+            best = &attempt;
+        }
+    }
+    if (!best) {
+        return false;
+    }
+    rects = std::move(best->rects);
+    pages = std::move(best->pages);
+    return true;
+}
+
+// Packs as many of the rects listed in left as fit into a page that already holds rects.
+// skyline is the lowest free row of every column, new rects only go below it. stbrp can't
+// start from a skyline, so its node list is laid out here the way stbrp_init_target does it:
+// extra[0] is the first node, extra[1] the sentinel at the right edge. Packed rects get the
+// page as id and are removed from left. Auto tries both heuristics and keeps the one that
+// packs the most area.
+void PackIntoSkyline(std::vector<stbrp_rect>& rects, std::vector<size_t>& left, const std::vector<int>& skyline, int height, int page, PackHeuristic heuristic) {
+    const int width = (int)skyline.size();
+    std::vector<stbrp_rect> batch;
+    for (size_t i : left) {
+        batch.push_back(rects[i]);
+    }
+    auto pack = [&](int stbrpHeuristic, std::vector<stbrp_rect>& packed) {
+        std::vector<stbrp_node> rpNodes(width * 2);
+        stbrp_context rpc;
+        stbrp_init_target(&rpc, width, height, rpNodes.data(), rpNodes.size());
+        stbrp_setup_heuristic(&rpc, stbrpHeuristic);
+        // One node per run of columns with the same height.
+        stbrp_node* last = rpc.active_head;
+        last->y = skyline[0];
+        for (int x = 1; x < width; ++x) {
+            if (skyline[x] != skyline[x - 1]) {
+                stbrp_node* node = rpc.free_head;
+                rpc.free_head = node->next;
+                node->x = x;
+                node->y = skyline[x];
+                last->next = node;
+                last = node;
+            }
+        }
+        last->next = &rpc.extra[1];
+
+        packed = batch;
+        stbrp_pack_rects(&rpc, packed.data(), packed.size());
+        double area = 0;
+        for (auto& rect : packed) {
+            area += rect.was_packed ? (double)rect.w * rect.h : 0.0;
+        }
+        return area;
+    };
+    std::vector<stbrp_rect> packed;
+    if (heuristic == PackHeuristic::Auto) {
+        std::vector<stbrp_rect> bestFit;
+        if (pack(StbrpHeuristic(PackHeuristic::BestFit), bestFit) > pack(StbrpHeuristic(PackHeuristic::BottomLeft), packed)) {
+            packed = std::move(bestFit);
+        }
+    } else {
+        pack(StbrpHeuristic(heuristic), packed);
+    }
+
+    std::vector<size_t> unpacked;
+    for (size_t j = 0; j < packed.size(); ++j) {
+        if (!packed[j].was_packed) {
+            unpacked.push_back(left[j]);
+            continue;
+        }
+        stbrp_rect& rect = rects[left[j]];
+        rect.x = packed[j].x;
+        rect.y = packed[j].y;
+        rect.was_packed = 1;
+        rect.id = page;
+    }
+    left = std::move(unpacked);
+}
+
+// Little-endian byte buffer for map.bin.
+class BinWriter {
+public:
+    void U16(uint16_t v) {
+        m_data.push_back((uint8_t)v);
+        m_data.push_back((uint8_t)(v >> 8));
+    }
+    void U32(uint32_t v) {
+        U16((uint16_t)v);
+        U16((uint16_t)(v >> 16));
+    }
+    void Tag(const char* tag) {
+        for (int i = 0; i < 4; ++i) {
+            m_data.push_back((uint8_t)tag[i]);
+        }
+    }
+    void Align4() {
+        while (m_data.size() % 4 != 0) {
+            m_data.push_back(0);
+        }
+    }
+    void PatchU32(size_t offset, uint32_t v) {
+        for (int i = 0; i < 4; ++i) {
+            m_data[offset + i] = (uint8_t)(v >> (i * 8));
+        }
+    }
+    size_t Size() const { return m_data.size(); }
+    const std::vector<uint8_t>& Data() const { return m_data; }
+
+private:
+    std::vector<uint8_t> m_data;
+};
+
+}
+
+size_t AddTextCodepoints(std::string_view utf8, AtlasOptions& options) {
+    std::unordered_map<uint32_t, uint64_t> counts;
+    for (auto [cp, count] : options.cpCounts) {
+        counts[cp] = count;
+    }
+    std::unordered_map<uint32_t, uint64_t> added;
+    size_t i = 0;
+    while (i < utf8.size()) {
+        const uint8_t lead = (uint8_t)utf8[i];
+        int length = lead < 0x80 ? 1 : lead >= 0xC2 && lead < 0xE0 ? 2 : lead >= 0xE0 && lead < 0xF0 ? 3 : lead >= 0xF0 && lead < 0xF5 ? 4 : 0;
+        uint32_t cp = length == 1 ? lead : lead & (0x7F >> length);
+        for (int j = 1; j < length; ++j) {
+            if (i + j >= utf8.size() || ((uint8_t)utf8[i + j] & 0xC0) != 0x80) {
+                length = 0;
+                break;
+            }
+            cp = (cp << 6) | ((uint8_t)utf8[i + j] & 0x3F);
+        }
+        // Overlong and surrogate encodings are as invalid as a stray byte.
+        const uint32_t minCp[] = {0, 0, 0x80, 0x800, 0x10000};
+        if (length == 0 || cp < minCp[length] || (cp >= 0xD800 && cp < 0xE000) || cp > 0x10FFFF) {
+            ++i;
+            continue;
+        }
+        i += length;
+        if (cp < 0x20 || (cp >= 0x7F && cp < 0xA0) || cp == 0xFEFF) {
+            continue;
+        }
+        ++added[cp];
+    }
+    // Codepoints counted by an earlier call already have their range.
+    std::vector<uint32_t> cps;
+    for (auto [cp, count] : added) {
+        auto [it, inserted] = counts.try_emplace(cp, 0);
+        it->second += count;
+        if (inserted) {
+            cps.push_back(cp);
+        }
+    }
+    options.cpCounts.assign(counts.begin(), counts.end());
+    std::sort(options.cpCounts.begin(), options.cpCounts.end());
+
+    // Consecutive codepoints collapse into one range.
+    std::sort(cps.begin(), cps.end());
+    for (size_t j = 0; j < cps.size(); ++j) {
+        if (j > 0 && cps[j - 1] + 1 == cps[j]) {
+            options.cpRanges.back().second = cps[j];
+        } else {
+            options.cpRanges.push_back({cps[j], cps[j]});
+        }
+    }
+    return added.size();
+}
+
+uint64_t GlyphCacheKey(uint64_t fontHash, const AtlasOptions& job, bool color) {
+    Hasher hasher;
+    hasher.Add(CACHE_VERSION);
+    hasher.Add(fontHash);
+    hasher.Add(color);
+    hasher.Add(job.size);
+    hasher.Add(job.mono);
+    hasher.Add(job.distanceField);
+    hasher.Add(job.spread);
+    hasher.Add(job.subpixel);
+    hasher.Add(job.lcd);
+    hasher.Add(job.lcdFilter);
+    std::map<std::string, FT_Fixed> axes{job.axes.begin(), job.axes.end()};
+    for (auto& axis : axes) {
+        hasher.Add(std::string_view{axis.first});
+        hasher.Add(axis.second);
+    }
+    return hasher.Hash();
+}
+
+std::string PageFileName(const char* prefix, size_t page) {
+    return page == 0 ? std::string{prefix} + ".png" : std::string{prefix} + "-" + std::to_string(page) + ".png";
+}
+
+std::string MapJsonEncoder::Begin(const MapData& map) {
+    std::ostringstream f;
+    f << '{';
+    f << "\"version\":1,";
+    f << "\"format\":\"" << AtlasFormatName(map.format) << "\",";
+    f << "\"pages\":[";
+    for (size_t i = 0; i < map.pages.size(); ++i) {
+        auto& page = map.pages[i];
+        f << (i == 0 ? "" : ",") << "{\"file\":\"" << page.file << "\",\"width\":" << page.width << ",\"height\":" << page.height;
+        f << ",\"format\":\"" << AtlasFormatName(page.format) << "\"}";
+    }
+    f << "],";
+    if (!map.patches.empty()) {
+        f << "\"patches\":[";
+        for (size_t i = 0; i < map.patches.size(); ++i) {
+            auto& patch = map.patches[i];
+            f << (i == 0 ? "" : ",") << "{\"page\":" << patch.page << ",\"x\":" << patch.x << ",\"y\":" << patch.y << "}";
+        }
+        f << "],\"firstGlyph\":" << map.firstGlyph << ",";
+    }
+    if (map.hotPages != 0) {
+        f << "\"hotPages\":" << map.hotPages << ",";
+    }
+    if (map.subpixel != 0) {
+        f << "\"subpixel\":" << map.subpixel << ",";
+    }
+    if (map.grid.columns != 0) {
+        f << "\"grid\":{\"cellWidth\":" << map.grid.cellWidth << ",\"cellHeight\":" << map.grid.cellHeight;
+        f << ",\"columns\":" << map.grid.columns << ",\"rows\":" << map.grid.rows << ",\"padding\":" << map.grid.padding << "},";
+    }
+    f << "\"fields\":[";
+    for (size_t i = 0; i < map.fields.size(); ++i) {
+        f << (i == 0 ? "" : ",") << '"' << MapFieldName(map.fields[i]) << '"';
+    }
+    f << "],";
+    f << "\"glyphs\":[";
+    m_last.assign(map.fields.size(), 0);
+    m_first = true;
+    return f.str();
+}
+
+std::string MapJsonEncoder::Glyphs(const std::vector<std::vector<int32_t>>& columns) {
+    // Glyph structs flattened into one number array, every field delta-encoded against the
+    // previous glyph.
+    std::ostringstream f;
+    const size_t numGlyphs = columns.empty() ? 0 : columns[0].size();
+    for (size_t i = 0; i < numGlyphs; ++i) {
+        for (size_t field = 0; field < columns.size(); ++field) {
+            int32_t value = columns[field][i];
+            f << (m_first ? "" : ",") << (int64_t)value - m_last[field];
+            m_last[field] = value;
+            m_first = false;
+        }
+    }
+    return f.str();
+}
+
+std::string MapJsonEncoder::End(const MapData& map) {
+    std::ostringstream f;
+    // Pairs of [codepoint, glyphId] flattened into one number array and delta-encoded.
+    f << "],\"codepoints\":[";
+    uint32_t lastCp = 0;
+    uint32_t lastGlyphId = 0;
+    for (size_t i = 0; i < map.codepoints.size(); ++i) {
+        auto [cp, glyphId] = map.codepoints[i];
+        f << (i == 0 ? "" : ",") << (int64_t)cp - (int64_t)lastCp << ',' << (int64_t)glyphId - (int64_t)lastGlyphId;
+        lastCp = cp;
+        lastGlyphId = glyphId;
+    }
+    f << "]";
+    if (!map.kerning.empty()) {
+        // Triples of [left, right, value], flattened and delta-encoded the same way.
+        f << ",\"kerning\":[";
+        MapData::KerningPair last{0, 0, 0};
+        for (size_t i = 0; i < map.kerning.size(); ++i) {
+            auto& pair = map.kerning[i];
+            f << (i == 0 ? "" : ",") << (int64_t)pair.left - (int64_t)last.left << ',' << (int64_t)pair.right - (int64_t)last.right;
+            f << ',' << (int64_t)pair.value - last.value;
+            last = pair;
+        }
+        f << "]";
+    }
+    f << ",\"metrics\":{";
+    f << "\"ascender\":" << map.ascender << ",";
+    f << "\"descender\":" << map.descender << ",";
+    f << "\"height\":" << map.height;
+    if (map.distanceField != DistanceField::None) {
+        f << ",\"distanceField\":\"" << DistanceFieldName(map.distanceField) << "\"";
+        f << ",\"spread\":" << map.spread;
+        f << ",\"emSize\":" << map.emSize;
+    }
+    f << "}";
+    f << '}';
+    return f.str();
+}
+
+std::string EncodeMapJson(const MapData& map) {
+    MapJsonEncoder encoder;
+    std::string json = encoder.Begin(map);
+    json += encoder.Glyphs(map.glyphs);
+    json += encoder.End(map);
+    return json;
+}
+
+// map.bin holds the same data as map.json, laid out so it can be used in place: every value
+// is little-endian and every section starts on a 4-byte boundary, so a client can wrap the
+// sections in typed arrays without parsing anything. See README.md for the layout.
+std::vector<uint8_t> EncodeMapBin(const MapData& map) {
+    const uint32_t numFields = (uint32_t)map.fields.size();
+    const uint32_t numGlyphs = map.glyphs.empty() ? 0 : (uint32_t)map.glyphs[0].size();
+    // Glyph values are int16 unless one of them doesn't fit.
+    bool wide = false;
+    for (auto& column : map.glyphs) {
+        for (int32_t v : column) {
+            wide |= v < INT16_MIN || v > INT16_MAX;
+        }
+    }
+
+    BinWriter w;
+    w.Tag("AGMB");
+    w.U32(1);
+    w.U32((uint32_t)map.format);
+    w.U32((uint32_t)map.ascender);
+    w.U32((uint32_t)map.descender);
+    w.U32((uint32_t)map.height);
+
+    // Section table: tag, offset, record count, record size. Offsets are patched in below.
+    struct Section {
+        const char* tag;
+        uint32_t count;
+        uint32_t stride;
+    };
+    std::vector<Section> sections = {
+        {"PAGE", (uint32_t)map.pages.size(), 12},
+        {"FLDS", numFields, 4},
+        {"GLYF", numGlyphs, numFields * (wide ? 4 : 2)},
+        {"CMAP", (uint32_t)map.codepoints.size(), 8},
+    };
+    if (map.distanceField != DistanceField::None) {
+        sections.push_back({"DIST", 1, 12});
+    }
+    if (map.hotPages != 0) {
+        sections.push_back({"HOTP", 1, 4});
+    }
+    if (map.subpixel != 0) {
+        sections.push_back({"SUBP", 1, 4});
+    }
+    if (map.grid.columns != 0) {
+        sections.push_back({"GRID", 1, 20});
+    }
+    if (!map.kerning.empty()) {
+        sections.push_back({"KERN", (uint32_t)map.kerning.size(), 8});
+    }
+    if (!map.patches.empty()) {
+        sections.push_back({"PTCH", (uint32_t)map.patches.size(), 12});
+        sections.push_back({"FRST", 1, 4});
+    }
+    w.U32((uint32_t)sections.size());
+    w.U32(0);
+    const size_t tableOffset = w.Size();
+    for (auto& section : sections) {
+        w.Tag(section.tag);
+        w.U32(0);
+        w.U32(section.count);
+        w.U32(section.stride);
+    }
+    auto beginSection = [&](uint32_t i) {
+        w.Align4();
+        w.PatchU32(tableOffset + i * 16 + 4, (uint32_t)w.Size());
+    };
+
+    beginSection(0);
+    for (auto& page : map.pages) {
+        w.U32((uint32_t)page.width);
+        w.U32((uint32_t)page.height);
+        w.U32((uint32_t)page.format);
+    }
+    beginSection(1);
+    for (auto field : map.fields) {
+        w.U32((uint32_t)field);
+    }
+    beginSection(2);
+    for (uint32_t i = 0; i < numGlyphs; ++i) {
+        for (auto& column : map.glyphs) {
+            if (wide) {
+                w.U32((uint32_t)column[i]);
+            } else {
+                w.U16((uint16_t)column[i]);
+            }
+        }
+    }
+    beginSection(3);
+    for (auto [cp, glyphId] : map.codepoints) {
+        w.U32(cp);
+        w.U32(glyphId);
+    }
+    // Optional sections follow in the order they were listed.
+    uint32_t nextSection = 4;
+    if (map.distanceField != DistanceField::None) {
+        beginSection(nextSection++);
+        w.U32((uint32_t)map.distanceField);
+        w.U32((uint32_t)map.spread);
+        w.U32((uint32_t)map.emSize);
+    }
+    if (map.hotPages != 0) {
+        beginSection(nextSection++);
+        w.U32((uint32_t)map.hotPages);
+    }
+    if (map.subpixel != 0) {
+        beginSection(nextSection++);
+        w.U32((uint32_t)map.subpixel);
+    }
+    if (map.grid.columns != 0) {
+        beginSection(nextSection++);
+        w.U32((uint32_t)map.grid.cellWidth);
+        w.U32((uint32_t)map.grid.cellHeight);
+        w.U32((uint32_t)map.grid.columns);
+        w.U32((uint32_t)map.grid.rows);
+        w.U32((uint32_t)map.grid.padding);
+    }
+    if (!map.kerning.empty()) {
+        beginSection(nextSection++);
+        for (auto& pair : map.kerning) {
+            w.U32(pair.left << 16 | pair.right);
+            w.U32((uint32_t)pair.value);
+        }
+    }
+    if (!map.patches.empty()) {
+        beginSection(nextSection++);
+        for (auto& patch : map.patches) {
+            w.U32((uint32_t)patch.page);
+            w.U32((uint32_t)patch.x);
+            w.U32((uint32_t)patch.y);
+        }
+        beginSection(nextSection++);
+        w.U32((uint32_t)map.firstGlyph);
+    }
+    w.Align4();
+    return w.Data();
+}
+
+namespace {
+
+bool ParseAtlasFormat(std::string_view name, AtlasFormat& format) {
+    for (AtlasFormat f : {AtlasFormat::GA8, AtlasFormat::A8, AtlasFormat::A1, AtlasFormat::RGB8, AtlasFormat::RGBA8}) {
+        if (name == AtlasFormatName(f)) {
+            format = f;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Every glyph has a value per field, a page column is only valid with a page to point at.
+// The cells of a grid have to hold every glyph, kerning pairs need glyphs on both sides.
+bool ValidMap(const MapData& map) {
+    if (map.glyphs.size() != map.fields.size()) {
+        return false;
+    }
+    for (auto& column : map.glyphs) {
+        if (column.size() != map.glyphs[0].size()) {
+            return false;
+        }
+    }
+    // The glyph ids and glyph pages of a delta are those of the atlas it was made for.
+    const bool delta = !map.patches.empty();
+    // With subpixel phases every glyph has a record per phase.
+    const size_t numRecords = map.firstGlyph + (map.glyphs.empty() ? 0 : map.glyphs[0].size());
+    const size_t phases = map.subpixel != 0 ? (size_t)map.subpixel : 1;
+    if (map.subpixel < 0 || map.subpixel > 8 || numRecords % phases != 0) {
+        return false;
+    }
+    const size_t numGlyphs = numRecords / phases;
+    for (auto [cp, glyphId] : map.codepoints) {
+        if (glyphId >= numGlyphs) {
+            return false;
+        }
+    }
+    for (auto& pair : map.kerning) {
+        if (pair.left >= numGlyphs || pair.right >= numGlyphs) {
+            return false;
+        }
+    }
+    if (map.grid.columns != 0) {
+        const MapData::Grid& grid = map.grid;
+        if (grid.columns < 0 || grid.rows <= 0 || grid.cellWidth <= 0 || grid.cellHeight <= 0 ||
+            (uint64_t)grid.columns * grid.rows * map.pages.size() < numRecords) {
+            return false;
+        }
+    }
+    for (size_t field = 0; field < map.fields.size(); ++field) {
+        if (map.fields[field] > MapField::Page) {
+            return false;
+        }
+        if (map.fields[field] == MapField::Page && !delta) {
+            for (int32_t page : map.glyphs[field]) {
+                if (page < 0 || (size_t)page >= map.pages.size()) {
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+}
+
+bool DecodeMapJson(std::string_view json, MapData& map) {
+    JsonValue root;
+    JsonReader reader{json};
+    if (!reader.Read(root) || !reader.AtEnd() || root.type != JsonValue::Object) {
+        return false;
+    }
+    auto get = [&](const JsonValue& object, std::string_view key, JsonValue::Type type) -> const JsonValue* {
+        const JsonValue* value = object.Find(key);
+        return value && value->type == type ? value : nullptr;
+    };
+
+    map = MapData{};
+    const JsonValue* version = get(root, "version", JsonValue::Number);
+    const JsonValue* format = get(root, "format", JsonValue::String);
+    const JsonValue* pages = get(root, "pages", JsonValue::Array);
+    const JsonValue* fields = get(root, "fields", JsonValue::Array);
+    const JsonValue* glyphs = get(root, "glyphs", JsonValue::Array);
+    const JsonValue* codepoints = get(root, "codepoints", JsonValue::Array);
+    const JsonValue* metrics = get(root, "metrics", JsonValue::Object);
+    if (!version || version->number != 1 || !format || !ParseAtlasFormat(format->string, map.format) ||
+        !pages || !fields || !glyphs || !codepoints || !metrics) {
+        return false;
+    }
+    for (auto& page : pages->items) {
+        const JsonValue* file = get(page, "file", JsonValue::String);
+        const JsonValue* width = get(page, "width", JsonValue::Number);
+        const JsonValue* height = get(page, "height", JsonValue::Number);
+        const JsonValue* pageFormat = get(page, "format", JsonValue::String);
+        auto& out = map.pages.emplace_back();
+        if (!file || !width || !height || !pageFormat || !ParseAtlasFormat(pageFormat->string, out.format)) {
+            return false;
+        }
+        out.file = file->string;
+        out.width = (int)width->number;
+        out.height = (int)height->number;
+    }
+    for (auto& field : fields->items) {
+        bool known = false;
+        for (uint32_t i = 0; i <= (uint32_t)MapField::Page; ++i) {
+            if (field.type == JsonValue::String && field.string == MapFieldName((MapField)i)) {
+                map.fields.push_back((MapField)i);
+                known = true;
+            }
+        }
+        if (!known) {
+            return false;
+        }
+    }
+    // Undo the delta encoding of both arrays.
+    const size_t numFields = map.fields.size();
+    if (numFields == 0 || glyphs->items.size() % numFields != 0 || codepoints->items.size() % 2 != 0) {
+        return false;
+    }
+    map.glyphs.resize(numFields);
+    for (size_t i = 0; i < glyphs->items.size(); ++i) {
+        auto& column = map.glyphs[i % numFields];
+        int64_t prev = column.empty() ? 0 : column.back();
+        column.push_back((int32_t)(prev + glyphs->items[i].number));
+    }
+    int64_t cp = 0, glyphId = 0;
+    for (size_t i = 0; i < codepoints->items.size(); i += 2) {
+        cp += codepoints->items[i].number;
+        glyphId += codepoints->items[i + 1].number;
+        if (cp < 0 || glyphId < 0) {
+            return false;
+        }
+        map.codepoints.push_back({(uint32_t)cp, (uint32_t)glyphId});
+    }
+    if (const JsonValue* kerning = get(root, "kerning", JsonValue::Array)) {
+        if (kerning->items.size() % 3 != 0) {
+            return false;
+        }
+        int64_t left = 0, right = 0, value = 0;
+        for (size_t i = 0; i < kerning->items.size(); i += 3) {
+            left += kerning->items[i].number;
+            right += kerning->items[i + 1].number;
+            value += kerning->items[i + 2].number;
+            if (left < 0 || right < 0) {
+                return false;
+            }
+            map.kerning.push_back({(uint32_t)left, (uint32_t)right, (int32_t)value});
+        }
+    }
+    auto metric = [&](std::string_view key, int32_t& value) {
+        if (const JsonValue* number = get(*metrics, key, JsonValue::Number)) {
+            value = (int32_t)number->number;
+        }
+    };
+    metric("ascender", map.ascender);
+    metric("descender", map.descender);
+    metric("height", map.height);
+    if (const JsonValue* field = get(*metrics, "distanceField", JsonValue::String)) {
+        map.distanceField = field->string == "msdf" ? DistanceField::Msdf : DistanceField::Sdf;
+        metric("spread", map.spread);
+        metric("emSize", map.emSize);
+    }
+    if (const JsonValue* hotPages = get(root, "hotPages", JsonValue::Number)) {
+        map.hotPages = (int32_t)hotPages->number;
+    }
+    if (const JsonValue* subpixel = get(root, "subpixel", JsonValue::Number)) {
+        map.subpixel = (int32_t)subpixel->number;
+    }
+    if (const JsonValue* grid = get(root, "grid", JsonValue::Object)) {
+        const JsonValue* cellWidth = get(*grid, "cellWidth", JsonValue::Number);
+        const JsonValue* cellHeight = get(*grid, "cellHeight", JsonValue::Number);
+        const JsonValue* columns = get(*grid, "columns", JsonValue::Number);
+        const JsonValue* rows = get(*grid, "rows", JsonValue::Number);
+        const JsonValue* padding = get(*grid, "padding", JsonValue::Number);
+        if (!cellWidth || !cellHeight || !columns || !rows || !padding || columns->number <= 0) {
+            return false;
+        }
+        map.grid = {(int32_t)cellWidth->number, (int32_t)cellHeight->number, (int32_t)columns->number, (int32_t)rows->number, (int32_t)padding->number};
+    }
+    if (const JsonValue* patches = get(root, "patches", JsonValue::Array)) {
+        for (auto& patch : patches->items) {
+            const JsonValue* page = get(patch, "page", JsonValue::Number);
+            const JsonValue* x = get(patch, "x", JsonValue::Number);
+            const JsonValue* y = get(patch, "y", JsonValue::Number);
+            if (!page || !x || !y) {
+                return false;
+            }
+            map.patches.push_back({(int32_t)page->number, (int32_t)x->number, (int32_t)y->number});
+        }
+        if (const JsonValue* firstGlyph = get(root, "firstGlyph", JsonValue::Number)) {
+            map.firstGlyph = (int32_t)firstGlyph->number;
+        }
+    }
+    return ValidMap(map);
+}
+
+bool DecodeMapBin(const uint8_t* data, size_t size, MapData& map) {
+    auto u32 = [&](size_t offset) {
+        return (uint32_t)data[offset] | (uint32_t)data[offset + 1] << 8 | (uint32_t)data[offset + 2] << 16 | (uint32_t)data[offset + 3] << 24;
+    };
+    if (size < 32 || memcmp(data, "AGMB", 4) != 0 || u32(4) != 1) {
+        return false;
+    }
+    map = MapData{};
+    map.format = (AtlasFormat)u32(8);
+    map.ascender = (int32_t)u32(12);
+    map.descender = (int32_t)u32(16);
+    map.height = (int32_t)u32(20);
+    const uint32_t numSections = u32(24);
+    if (map.format > AtlasFormat::RGBA8 || numSections > (size - 32) / 16) {
+        return false;
+    }
+    struct Section {
+        uint32_t offset;
+        uint32_t count;
+        uint32_t stride;
+    };
+    std::unordered_map<std::string, Section> sections;
+    for (uint32_t i = 0; i < numSections; ++i) {
+        const size_t at = 32 + (size_t)i * 16;
+        Section section{u32(at + 4), u32(at + 8), u32(at + 12)};
+        if (section.offset > size || (uint64_t)section.count * section.stride > size - section.offset) {
+            return false;
+        }
+        sections[std::string{(const char*)&data[at], 4}] = section;
+    }
+    auto find = [&](const char* tag, uint32_t minStride) -> const Section* {
+        auto it = sections.find(tag);
+        return it != sections.end() && it->second.stride >= minStride ? &it->second : nullptr;
+    };
+    const Section* pages = find("PAGE", 12);
+    const Section* fields = find("FLDS", 4);
+    const Section* glyphs = find("GLYF", 0);
+    const Section* codepoints = find("CMAP", 8);
+    if (!pages || !fields || !glyphs || !codepoints) {
+        return false;
+    }
+    for (uint32_t i = 0; i < pages->count; ++i) {
+        const size_t at = pages->offset + (size_t)i * pages->stride;
+        AtlasFormat format = (AtlasFormat)u32(at + 8);
+        if (format > AtlasFormat::RGBA8) {
+            return false;
+        }
+        map.pages.push_back({PageFileName("atlas", i), (int)u32(at), (int)u32(at + 4), format});
+    }
+    for (uint32_t i = 0; i < fields->count; ++i) {
+        map.fields.push_back((MapField)u32(fields->offset + (size_t)i * 4));
+    }
+    const size_t numFields = map.fields.size();
+    const bool wide = glyphs->stride == numFields * 4;
+    if (numFields == 0 || (glyphs->stride != numFields * 2 && !wide)) {
+        return false;
+    }
+    map.glyphs.resize(numFields);
+    for (uint32_t i = 0; i < glyphs->count; ++i) {
+        for (size_t field = 0; field < numFields; ++field) {
+            const size_t at = glyphs->offset + (size_t)i * glyphs->stride + field * (wide ? 4 : 2);
+            map.glyphs[field].push_back(wide ? (int32_t)u32(at) : (int16_t)(data[at] | data[at + 1] << 8));
+        }
+    }
+    for (uint32_t i = 0; i < codepoints->count; ++i) {
+        const size_t at = codepoints->offset + (size_t)i * codepoints->stride;
+        map.codepoints.push_back({u32(at), u32(at + 4)});
+    }
+    if (const Section* dist = find("DIST", 12)) {
+        map.distanceField = (DistanceField)u32(dist->offset);
+        map.spread = (int32_t)u32(dist->offset + 4);
+        map.emSize = (int32_t)u32(dist->offset + 8);
+    }
+    if (const Section* hot = find("HOTP", 4)) {
+        map.hotPages = (int32_t)u32(hot->offset);
+    }
+    if (const Section* subpixel = find("SUBP", 4)) {
+        map.subpixel = (int32_t)u32(subpixel->offset);
+    }
+    if (const Section* grid = find("GRID", 20)) {
+        map.grid = {(int32_t)u32(grid->offset), (int32_t)u32(grid->offset + 4), (int32_t)u32(grid->offset + 8),
+            (int32_t)u32(grid->offset + 12), (int32_t)u32(grid->offset + 16)};
+        if (map.grid.columns == 0) {
+            return false;
+        }
+    }
+    if (const Section* kerning = find("KERN", 8)) {
+        for (uint32_t i = 0; i < kerning->count; ++i) {
+            const size_t at = kerning->offset + (size_t)i * kerning->stride;
+            map.kerning.push_back({u32(at) >> 16, u32(at) & 0xFFFF, (int32_t)u32(at + 4)});
+        }
+    }
+    if (const Section* patches = find("PTCH", 12)) {
+        if (patches->count != map.pages.size()) {
+            return false;
+        }
+        for (uint32_t i = 0; i < patches->count; ++i) {
+            const size_t at = patches->offset + (size_t)i * patches->stride;
+            map.patches.push_back({(int32_t)u32(at), (int32_t)u32(at + 4), (int32_t)u32(at + 8)});
+            map.pages[i].file = PageFileName("patch", i);
+        }
+    }
+    if (const Section* first = find("FRST", 4)) {
+        map.firstGlyph = (int32_t)u32(first->offset);
+    }
+    return ValidMap(map);
+}
+
+AtlasFont::AtlasFont() = default;
+AtlasFont::~AtlasFont() = default;
+
+AtlasStatus AtlasFont::Open(FT_Library ft, const char* path, size_t workers, int faceIndex, int namedInstance) {
+    if (faceIndex < 0 || faceIndex > 0xffff || namedInstance < 0 || namedInstance > 0x7fff) {
+        printf("Face index or named instance out of range\n");
+        return AtlasStatus::InvalidOptions;
+    }
+    const uint8_t* data = nullptr;
+    size_t size = 0;
+    if (m_data) {
+        data = m_data->data();
+        size = m_data->size();
+    } else if (m_mapping) {
+        data = m_mapping->Data();
+        size = m_mapping->Size();
+    }
+    const FT_Long index = ((FT_Long)namedInstance << 16) | faceIndex;
+
+    // Worker 0 shares the caller's library, every other worker needs one of its own.
+    for (size_t i = 0; i < std::max<size_t>(workers, 1); ++i) {
+        auto& instance = m_instances.emplace_back(std::make_unique<FontInstance>());
+        if (!instance->Open(i == 0 ? ft : nullptr, path, data, size, index)) {
+            if (i == 0 && index != 0 && instance->Library()) {
+                // Tell apart a font that doesn't open at all from an index that doesn't exist.
+                FontInstance probe;
+                if (probe.Open(instance->Library(), path, data, size, faceIndex)) {
+                    printf("Face %d has %ld named instances\n", faceIndex, probe.Face()->style_flags >> 16);
+                } else if (faceIndex != 0 && probe.Open(instance->Library(), path, data, size, 0)) {
+                    printf("The font has %ld faces\n", probe.Face()->num_faces);
+                }
+            }
+            return AtlasStatus::InvalidFont;
+        }
+    }
+    m_cpTable = std::make_unique<CodepointTable>();
+    if (!m_cpTable->Build(Face())) {
+        printf("Font has no charmap\n");
+        return AtlasStatus::InvalidFont;
+    }
+    return AtlasStatus::Ok;
+}
+
+AtlasStatus AtlasFont::OpenFile(FT_Library ft, const char* path, size_t workers, std::unique_ptr<AtlasFont>& font, int faceIndex, int namedInstance) {
+    font = std::make_unique<AtlasFont>();
+    // Falls back to FreeType reading the file itself when it can't be mapped.
+    font->m_mapping = MapFileShared(path);
+    AtlasStatus status = font->Open(ft, path, workers, faceIndex, namedInstance);
+    if (status != AtlasStatus::Ok) {
+        font.reset();
+    }
+    return status;
+}
+
+AtlasStatus AtlasFont::OpenMemory(FT_Library ft, std::shared_ptr<const std::vector<uint8_t>> data, size_t workers, std::unique_ptr<AtlasFont>& font) {
+    font = std::make_unique<AtlasFont>();
+    font->m_data = std::move(data);
+    AtlasStatus status = font->Open(ft, nullptr, workers, 0, 0);
+    if (status != AtlasStatus::Ok) {
+        font.reset();
+    }
+    return status;
+}
+
+FT_Face AtlasFont::Face() const {
+    return m_instances[0]->Face();
+}
+
+AtlasStatus AtlasFontCache::Get(const uint8_t* data, size_t size, std::shared_ptr<AtlasFont>& font) {
+    Hasher hasher;
+    hasher.Add(data, size);
+    const uint64_t key = hasher.Hash();
+
+    std::lock_guard<std::mutex> lock{m_mutex};
+    auto it = m_fonts.find(key);
+    if (it != m_fonts.end()) {
+        font = it->second;
+        return AtlasStatus::Ok;
+    }
+    std::unique_ptr<AtlasFont> opened;
+    auto bytes = std::make_shared<const std::vector<uint8_t>>(data, data + size);
+    AtlasStatus status = AtlasFont::OpenMemory(m_ft, std::move(bytes), m_workers, opened);
+    if (status != AtlasStatus::Ok) {
+        return status;
+    }
+    font = std::move(opened);
+    m_fonts.emplace(key, font);
+    return AtlasStatus::Ok;
+}
+
+AtlasStatus AtlasFontCache::GetFile(const char* path, int faceIndex, int namedInstance, std::shared_ptr<AtlasFont>& font) {
+    std::string key = std::string{path} + '\0' + std::to_string(faceIndex) + '\0' + std::to_string(namedInstance);
+    // Opened before taking the lock, checking whether the file changed touches the disk.
+    auto mapping = MapFileShared(path);
+    std::filesystem::file_time_type writeTime;
+    uintmax_t size = 0;
+    bool stamped = true;
+    if (!mapping) {
+        std::error_code err;
+        writeTime = std::filesystem::last_write_time(path, err);
+        size = err ? 0 : std::filesystem::file_size(path, err);
+        stamped = !err;
+    }
+
+    std::lock_guard<std::mutex> lock{m_mutex};
+    auto it = m_files.find(key);
+    if (it != m_files.end() && it->second.font->m_mapping == mapping &&
+        (mapping || (stamped && it->second.writeTime == writeTime && it->second.size == size))) {
+        font = it->second.font;
+        return AtlasStatus::Ok;
+    }
+    std::unique_ptr<AtlasFont> opened;
+    AtlasStatus status = AtlasFont::OpenFile(m_ft, path, m_workers, opened, faceIndex, namedInstance);
+    if (status != AtlasStatus::Ok) {
+        return status;
+    }
+    font = std::move(opened);
+    m_files[key] = {font, writeTime, size};
+    return AtlasStatus::Ok;
+}
+
+void AtlasFontCache::Clear() {
+    std::lock_guard<std::mutex> lock{m_mutex};
+    m_fonts.clear();
+    m_files.clear();
+}
+
+AtlasStatus BuildAtlas(AtlasFont& font, const BuildSettings& settings, const AtlasOptions& job, AtlasPageSink& sink, MapData& map, JobStats& stats, AtlasAppend* append) {
+    std::lock_guard<std::mutex> lock{font.m_mutex};
+    auto& instances = font.m_instances;
+    const CodepointTable& cpTable = *font.m_cpTable;
+    FT_Face face = instances[0]->Face();
+    const MapData* base = append ? &append->baseMap : nullptr;
+    const uint32_t baseGlyphs = base && !base->glyphs.empty() ? (uint32_t)base->glyphs[0].size() : 0;
+
+    if (!ValidRenderOptions(job)) {
+        return AtlasStatus::InvalidOptions;
+    }
+    if (job.hotGlyphs != 0 && job.cpCounts.empty()) {
+        printf("--hot requires --text or --text-stdin\n");
+        return AtlasStatus::InvalidOptions;
+    }
+    if (job.hotGlyphs != 0 && base) {
+        printf("--hot can't be combined with --append\n");
+        return AtlasStatus::InvalidOptions;
+    }
+    // Grid cells are found by glyph id alone, so they can't be moved, shared or reordered.
+    if (job.grid && (base || job.hotGlyphs != 0 || job.dedup)) {
+        printf("--grid can't be combined with --append, --hot or --dedup\n");
+        return AtlasStatus::InvalidOptions;
+    }
+    if (job.subpixel < 1 || job.subpixel > 8) {
+        printf("--subpixel must be between 1 and 8\n");
+        return AtlasStatus::InvalidOptions;
+    }
+    // Distance fields are meant to be scaled, not shifted.
+    if (job.subpixel > 1 && (base || job.distanceField != DistanceField::None)) {
+        printf("--subpixel can't be combined with --append, --sdf or --msdf\n");
+        return AtlasStatus::InvalidOptions;
+    }
+
+    std::vector<FT_Fixed> coords;
+    if (!ResolveAxes(instances[0]->Library(), face, job.axes, coords)) {
+        return AtlasStatus::InvalidOptions;
+    }
+    for (auto& instance : instances) {
+        if (!instance->Select(job.size, coords)) {
+            return AtlasStatus::InvalidFont;
+        }
+    }
+    // Strike metrics are scaled like the glyphs.
+    auto faceMetric = [&](FT_Pos value) {
+        return (int32_t)floor(value * instances[0]->StrikeScale() / 64.0);
+    };
+    if (base) {
+        // Size isn't stored for coverage atlases, the font metrics stand in for it. Maps of
+        // --metrics-only have no positions and can't be appended to.
+        bool matches = base->format == job.format && base->distanceField == job.distanceField &&
+            base->ascender == faceMetric(face->size->metrics.ascender) &&
+            base->descender == faceMetric(face->size->metrics.descender) &&
+            base->height == faceMetric(face->size->metrics.height) &&
+            append->basePages.size() == base->pages.size() &&
+            std::find(base->fields.begin(), base->fields.end(), MapField::X) != base->fields.end();
+        if (job.distanceField != DistanceField::None) {
+            matches &= base->spread == job.spread && base->emSize == job.size;
+        }
+        for (size_t i = 0; matches && i < base->pages.size(); ++i) {
+            const AtlasBitmap& page = append->basePages[i];
+            matches = page.width == base->pages[i].width && page.height == base->pages[i].height &&
+                page.format == base->pages[i].format && page.pitch == AtlasPitch(page.format, page.width) &&
+                page.pixels.size() == page.pitch * page.height;
+        }
+        if (!matches) {
+            printf("The atlas to append to was built with another font, size or format\n");
+            return AtlasStatus::InvalidOptions;
+        }
+        if (!base->patches.empty()) {
+            printf("Can't append to a delta, only to a whole atlas\n");
+            return AtlasStatus::InvalidOptions;
+        }
+    }
+
+    const std::vector<std::pair<uint32_t, uint32_t>> cpRanges = JobRanges(job, cpTable);
+
+    // Every requested codepoint the font maps, sorted and without duplicates, along with
+    // its glyph and that glyph's id in the map files. Everything after this works from it.
+    std::vector<CodepointEntry> codepoints;
+    for (auto range : cpRanges) {
+        size_t mapped = cpTable.ForEach(range.first, range.second, [&](uint32_t cp, FT_UInt glyphIndex) {
+            codepoints.push_back({cp, glyphIndex, 0});
+        });
+        stats.unmappedCodepoints += (size_t)(range.second - range.first) + 1 - mapped;
+    }
+    // The base glyphs have to be the glyphs this font maps their codepoints to.
+    const FT_UInt NO_INDEX = UINT_MAX;
+    std::vector<FT_UInt> baseIndices(baseGlyphs, NO_INDEX);
+    if (base) {
+        bool matches = true;
+        for (auto [cp, glyphId] : base->codepoints) {
+            size_t mapped = cpTable.ForEach(cp, cp, [&](uint32_t, FT_UInt glyphIndex) {
+                codepoints.push_back({cp, glyphIndex, 0});
+                matches &= baseIndices[glyphId] == NO_INDEX || baseIndices[glyphId] == glyphIndex;
+                baseIndices[glyphId] = glyphIndex;
+            });
+            matches &= mapped == 1;
+        }
+        for (FT_UInt glyphIndex : baseIndices) {
+            matches &= glyphIndex != NO_INDEX;
+        }
+        if (!matches) {
+            printf("The atlas to append to doesn't match the font\n");
+            return AtlasStatus::InvalidOptions;
+        }
+    }
+    // Glyphs of an append base keep their ids, new glyphs are numbered after them.
+    GlyphTable glyphs;
+    NumberGlyphs(face, baseIndices, codepoints, glyphs);
+    stats.codepoints = codepoints.size();
+    const size_t numGlyphs = glyphs.Size();
+    std::vector<FT_UInt> glyphIndices = glyphs.glyphIndex;
+    if (job.subpixel > 1) {
+        SplitPhases(job.subpixel, codepoints, glyphs);
+    }
+    if (base) {
+        // Base glyphs are already in the base pages, they only need their map values.
+        auto column = [&](MapField field) -> const std::vector<int32_t>* {
+            for (size_t i = 0; i < base->fields.size(); ++i) {
+                if (base->fields[i] == field) {
+                    return &base->glyphs[i];
+                }
+            }
+            return nullptr;
+        };
+        auto value = [&](MapField field, uint32_t id) {
+            const std::vector<int32_t>* values = column(field);
+            return values ? (*values)[id] : 0;
+        };
+        for (uint32_t id = 0; id < baseGlyphs; ++id) {
+            glyphs.width[id] = value(MapField::Width, id);
+            glyphs.height[id] = value(MapField::Height, id);
+            glyphs.leftBearing[id] = value(MapField::LeftBearing, id);
+            glyphs.topBearing[id] = value(MapField::TopBearing, id);
+            glyphs.advance[id] = (FT_Pos)value(MapField::Advance, id) * 64;
+            glyphs.x[id] = value(MapField::X, id);
+            glyphs.y[id] = value(MapField::Y, id);
+            glyphs.page[id] = value(MapField::Page, id);
+        }
+    }
+    // Unique glyphs that still have to be rendered and placed, in the order their codepoints
+    // were first seen.
+    std::vector<uint32_t> glyphOrder;
+    glyphOrder.reserve(glyphs.Size() - baseGlyphs);
+    std::vector<bool> seen(glyphs.Size());
+    for (auto& entry : codepoints) {
+        if (!seen[entry.glyphId]) {
+            seen[entry.glyphId] = true;
+            for (uint32_t id = entry.glyphId; id < entry.glyphId + (uint32_t)job.subpixel; ++id) {
+                if (id >= baseGlyphs) {
+                    glyphOrder.push_back(id);
+                }
+            }
+        }
+    }
+    stats.uniqueGlyphs = numGlyphs;
+    stats.times.Lap("setup");
+
+    GlyphRender render;
+    if (!SetUpRender(job, !job.grid, instances, render)) {
+        return AtlasStatus::RenderFailed;
+    }
+    std::optional<GlyphCache> glyphCache;
+    if (!settings.glyphCacheDir.empty()) {
+        std::filesystem::path cacheDir = settings.glyphCacheDir;
+        std::error_code err;
+        std::filesystem::create_directories(cacheDir, err);
+        uint64_t key = GlyphCacheKey(settings.fontHash, job, !job.grid);
+        glyphCache.emplace(cacheDir / ("glyphs-" + HexKey(key) + ".bin"), key);
+        glyphCache->Load();
+    }
+    // The cache and dedup need the rendered bitmaps, so they always work like --single-pass.
+    // Distance fields are larger than the glyph FreeType measures, so they have to be rendered
+    // to be measured. The same goes for color glyphs, whose layers can reach past the base
+    // glyph, for resampled strikes and for subpixel phases, which FreeType measures before
+    // the outline is moved.
+    const bool singlePass = settings.singlePass || glyphCache || job.dedup || job.distanceField != DistanceField::None || job.subpixel > 1 ||
+        (FT_HAS_COLOR(face) && (render.loadFlags & FT_LOAD_COLOR)) || render.bitmapScale != 1.0;
+
+    // With --single-pass, every rendered bitmap is stored back to back in the arena of the
+    // worker that rendered it. Cached bitmaps are read from the cache file, which is the
+    // last arena.
+    std::vector<std::vector<uint8_t>> glyphArenas{instances.size()};
+    std::vector<uint32_t> toRender;
+    if (glyphCache) {
+        for (uint32_t id : glyphOrder) {
+            if (glyphCache->Find(glyphs, id)) {
+                glyphs.bitmapArena[id] = glyphArenas.size();
+            } else {
+                toRender.push_back(id);
+            }
+        }
+    } else {
+        toRender = glyphOrder;
+    }
+    stats.cachedGlyphs = glyphOrder.size() - toRender.size();
+    stats.renderedGlyphs = toRender.size();
+    if (glyphCache) {
+        stats.times.Lap("cacheLoad");
+    }
+    std::vector<GlyphTimes> workerTimes{instances.size()};
+    std::atomic<bool> renderFailed = false;
+    ParallelFor(instances.size(), toRender.size(), [&](size_t worker, size_t i) {
+        uint32_t id = toRender[i];
+        glyphs.bitmapArena[id] = worker;
+        if (!MeasureGlyph(instances[worker]->Face(), render, singlePass, glyphs, id, glyphArenas[worker], settings.stats ? &workerTimes[worker] : nullptr)) {
+            renderFailed = true;
+        }
+    });
+    if (renderFailed) {
+        return AtlasStatus::RenderFailed;
+    }
+    stats.times.Lap(singlePass ? "render" : "measure");
+    auto glyphBitmap = [&](uint32_t id) -> const uint8_t* {
+        if (glyphs.bitmapArena[id] == glyphArenas.size()) {
+            return &glyphCache->Data()[glyphs.bitmapOffset[id]];
+        }
+        return &glyphArenas[glyphs.bitmapArena[id]][glyphs.bitmapOffset[id]];
+    };
+
+    if (glyphCache) {
+        for (uint32_t id : toRender) {
+            glyphCache->Add(glyphs, id, glyphBitmap(id));
+        }
+        glyphCache->ascender = face->size->metrics.ascender;
+        glyphCache->descender = face->size->metrics.descender;
+        glyphCache->height = face->size->metrics.height;
+        if (!glyphCache->Save()) {
+            printf("Failed to write glyph cache\n");
+        }
+        if (settings.verbose) {
+            printf("Glyph cache: %zu cached, %zu rendered\n", glyphOrder.size() - toRender.size(), toRender.size());
+        }
+        stats.times.Lap("cacheSave");
+    }
+
+    // Distance fields are sampled further out than the glyph, so they get spread pixels of
+    // empty space around them. A rect is its glyph plus RECT_PAD in front of it and, unless the
+    // gutters are shared, behind it. Shared gutters leave PAGE_BORDER at the page edges.
+    const uint32_t RECT_PAD = job.distanceField != DistanceField::None ? job.spread : 1;
+    const uint32_t RECT_GROW = job.padding == PackPadding::Shared ? RECT_PAD : RECT_PAD*2;
+    const int PAGE_BORDER = job.padding == PackPadding::Shared ? (int)RECT_PAD : 0;
+
+    // Glyphs are only placed once per distinct bitmap, the first glyph with that bitmap is the
+    // original of the others. Base glyphs of an append have no bitmaps and are never originals.
+    std::vector<uint32_t> original(glyphs.Size());
+    for (uint32_t id = 0; id < glyphs.Size(); ++id) {
+        original[id] = id;
+    }
+    if (job.dedup) {
+        auto rowBytes = [&](uint32_t id) -> size_t {
+            switch (glyphs.pixelMode[id]) {
+            case FT_PIXEL_MODE_MONO: return (glyphs.width[id] + 7) / 8;
+            case FT_PIXEL_MODE_LCD: return (size_t)glyphs.width[id] * 3;
+            case FT_PIXEL_MODE_BGRA: return (size_t)glyphs.width[id] * 4;
+            default: return glyphs.width[id];
+            }
+        };
+        // Pitches can differ between equal bitmaps, rows are compared without their padding.
+        auto sameBitmap = [&](uint32_t a, uint32_t b) {
+            if (glyphs.width[a] != glyphs.width[b] || glyphs.height[a] != glyphs.height[b] || glyphs.pixelMode[a] != glyphs.pixelMode[b]) {
+                return false;
+            }
+            const uint8_t* rowA = glyphBitmap(a);
+            const uint8_t* rowB = glyphBitmap(b);
+            for (unsigned y = 0; y < glyphs.height[a]; ++y) {
+                if (memcmp(rowA, rowB, rowBytes(a)) != 0) {
+                    return false;
+                }
+                rowA += glyphs.bitmapPitch[a];
+                rowB += glyphs.bitmapPitch[b];
+            }
+            return true;
+        };
+        std::vector<uint64_t> hashes(glyphOrder.size());
+        ParallelFor(instances.size(), glyphOrder.size(), [&](size_t, size_t i) {
+            uint32_t id = glyphOrder[i];
+            Hasher hasher;
+            hasher.Add(glyphs.width[id]);
+            hasher.Add(glyphs.height[id]);
+            hasher.Add(glyphs.pixelMode[id]);
+            const uint8_t* row = glyphBitmap(id);
+            for (unsigned y = 0; y < glyphs.height[id]; ++y) {
+                hasher.Add(row, rowBytes(id));
+                row += glyphs.bitmapPitch[id];
+            }
+            hashes[i] = hasher.Hash();
+        });
+        // Originals by bitmap hash, in glyph order so the same glyph always wins.
+        std::unordered_map<uint64_t, std::vector<uint32_t>> byHash;
+        for (size_t i = 0; i < glyphOrder.size(); ++i) {
+            uint32_t id = glyphOrder[i];
+            if (glyphs.width[id] * glyphs.height[id] == 0) {
+                continue;
+            }
+            auto& candidates = byHash[hashes[i]];
+            for (uint32_t candidate : candidates) {
+                if (sameBitmap(candidate, id)) {
+                    original[id] = candidate;
+                    break;
+                }
+            }
+            if (original[id] == id) {
+                candidates.push_back(id);
+            } else {
+                ++stats.dedupedGlyphs;
+                stats.dedupedArea += (double)(glyphs.width[id] + RECT_GROW) * (glyphs.height[id] + RECT_GROW);
+            }
+        }
+        if (settings.verbose && stats.dedupedGlyphs != 0) {
+            printf("%zu glyphs share the bitmap of another glyph, saving %.0f pixels\n", stats.dedupedGlyphs, stats.dedupedArea);
+        }
+        stats.times.Lap("dedup");
+    }
+
+    // Only glyphs with pixels take up space in the atlas. Color glyphs are packed onto RGBA
+    // pages of their own, after the coverage pages, so the rest of the atlas doesn't grow to
+    // four channels. With hotGlyphs the most frequent coverage glyphs come before both.
+    auto isColor = [&](uint32_t id) {
+        return singlePass && glyphs.pixelMode[id] == FT_PIXEL_MODE_BGRA;
+    };
+    std::vector<bool> hot(glyphs.Size());
+    if (job.hotGlyphs != 0) {
+        // A shared rect is as frequent as all glyphs using it.
+        std::vector<uint64_t> frequency(glyphs.Size());
+        for (auto& entry : codepoints) {
+            auto it = std::lower_bound(job.cpCounts.begin(), job.cpCounts.end(), std::pair<uint32_t, uint64_t>{entry.cp, 0});
+            if (it != job.cpCounts.end() && it->first == entry.cp) {
+                for (int phase = 0; phase < job.subpixel; ++phase) {
+                    frequency[original[entry.glyphId + phase]] += it->second;
+                }
+            }
+        }
+        std::vector<uint32_t> byFrequency;
+        for (uint32_t id : glyphOrder) {
+            if (frequency[id] != 0 && original[id] == id && glyphs.width[id] * glyphs.height[id] != 0 && !isColor(id)) {
+                byFrequency.push_back(id);
+            }
+        }
+        std::stable_sort(byFrequency.begin(), byFrequency.end(), [&](uint32_t a, uint32_t b) {
+            return frequency[a] > frequency[b];
+        });
+        for (size_t i = 0; i < std::min(job.hotGlyphs, byFrequency.size()); ++i) {
+            hot[byFrequency[i]] = true;
+        }
+    }
+    enum RectGroup { HOT, COVERAGE, COLOR, GROUP_COUNT };
+    // rectGlyphs maps the rects of each group back to glyphs.
+    std::vector<stbrp_rect> rects[GROUP_COUNT];
+    std::vector<uint32_t> rectGlyphs[GROUP_COUNT];
+    for (uint32_t id : glyphOrder) {
+        if (glyphs.width[id] * glyphs.height[id] != 0 && original[id] == id) {
+            stbrp_rect rect;
+            memset(&rect, 0, sizeof(rect));
+            rect.w = glyphs.width[id] + RECT_GROW;
+            rect.h = glyphs.height[id] + RECT_GROW;
+            RectGroup group = isColor(id) ? COLOR : hot[id] ? HOT : COVERAGE;
+            rects[group].push_back(rect);
+            rectGlyphs[group].push_back(id);
+        }
+    }
+
+    std::vector<AtlasPage> pages;
+    int hotPages = base ? base->hotPages : 0;
+    MapData::Grid gridLayout;
+    // Lowest free row of every column of the base pages, see PackIntoSkyline.
+    std::vector<std::vector<int>> skylines;
+    if (base) {
+        for (auto& page : base->pages) {
+            pages.push_back({page.width, page.height, page.format});
+            skylines.emplace_back(std::max(1, page.width - PAGE_BORDER), 0);
+        }
+        for (uint32_t id = 0; id < baseGlyphs; ++id) {
+            if (glyphs.width[id] * glyphs.height[id] == 0) {
+                continue;
+            }
+            auto& skyline = skylines[glyphs.page[id]];
+            const int bottom = glyphs.y[id] + (int)(glyphs.height[id] + RECT_GROW - RECT_PAD);
+            const int end = std::min((int)skyline.size(), glyphs.x[id] + (int)(glyphs.width[id] + RECT_GROW - RECT_PAD));
+            for (int x = std::max(0, glyphs.x[id] - (int)RECT_PAD); x < end; ++x) {
+                skyline[x] = std::max(skyline[x], bottom);
+            }
+        }
+    }
+    {
+        auto packBegin = Clock::now();
+        // With append, rects first fill the free space of the base pages of their format,
+        // hot pages excepted. The rest go onto new pages of that format.
+        auto packGroup = [&](RectGroup group, AtlasFormat format) {
+            auto& groupRects = rects[group];
+            std::vector<size_t> left(groupRects.size());
+            for (size_t i = 0; i < left.size(); ++i) {
+                left[i] = i;
+            }
+            for (size_t page = hotPages; base && page < base->pages.size() && !left.empty(); ++page) {
+                if (pages[page].format == format) {
+                    PackIntoSkyline(groupRects, left, skylines[page], std::max(1, pages[page].height - PAGE_BORDER), (int)page, job.heuristic);
+                }
+            }
+            std::vector<stbrp_rect> rest;
+            for (size_t i : left) {
+                rest.push_back(groupRects[i]);
+            }
+            const size_t firstNew = pages.size();
+            const int maxW = job.maxPageW ? job.maxPageW - PAGE_BORDER : 0;
+            const int maxH = job.maxPageH ? job.maxPageH - PAGE_BORDER : 0;
+            // A group with no rects left, empty or all put onto base pages, has no pass to count.
+            size_t passes = 0;
+            if (!PackRects(rest, maxW, maxH, job.heuristic, instances.size(), pages, passes)) {
+                return false;
+            }
+            if (!rest.empty()) {
+                stats.packPasses += passes;
+            }
+            for (size_t i = firstNew; i < pages.size(); ++i) {
+                pages[i].format = format;
+                if (!rest.empty()) {
+                    pages[i].width += PAGE_BORDER;
+                    pages[i].height += PAGE_BORDER;
+                }
+            }
+            for (size_t j = 0; j < left.size(); ++j) {
+                groupRects[left[j]] = rest[j];
+            }
+            return true;
+        };
+        // A grid page holds columns x rows cells of the largest glyph. Its width is the
+        // maximum width, or makes a square page when there is none. A single page is cut down
+        // to the rows it needs, several pages all have the full size.
+        auto layoutGrid = [&]() {
+            int widest = 1, tallest = 1;
+            for (uint32_t id : glyphOrder) {
+                if (glyphs.width[id] * glyphs.height[id] != 0) {
+                    widest = std::max(widest, (int)glyphs.width[id]);
+                    tallest = std::max(tallest, (int)glyphs.height[id]);
+                }
+            }
+            const int cellW = widest + (int)RECT_GROW;
+            const int cellH = tallest + (int)RECT_GROW;
+            const int maxW = job.maxPageW ? job.maxPageW - PAGE_BORDER : 0;
+            const int maxH = job.maxPageH ? job.maxPageH - PAGE_BORDER : 0;
+            if ((maxW && cellW > maxW) || (maxH && cellH > maxH)) {
+                printf("A %dx%d glyph doesn't fit into the maximum atlas size\n", cellW, cellH);
+                return false;
+            }
+            const size_t count = std::max<size_t>(glyphs.Size(), 1);
+            size_t columns, rows;
+            if (maxW) {
+                columns = maxW / cellW;
+            } else if (maxH) {
+                columns = (count + maxH / cellH - 1) / (maxH / cellH);
+            } else {
+                columns = (size_t)ceil(sqrt((double)count * cellH / cellW));
+            }
+            columns = std::clamp<size_t>(columns, 1, count);
+            rows = maxH ? maxH / cellH : (count + columns - 1) / columns;
+            const size_t numPages = (count + columns * rows - 1) / (columns * rows);
+            if (numPages == 1) {
+                rows = (count + columns - 1) / columns;
+            }
+            for (size_t i = 0; i < numPages; ++i) {
+                pages.push_back({(int)columns * cellW + PAGE_BORDER, (int)rows * cellH + PAGE_BORDER, job.format});
+            }
+            const size_t perPage = columns * rows;
+            for (int group = 0; group < GROUP_COUNT; ++group) {
+                for (size_t i = 0; i < rects[group].size(); ++i) {
+                    const size_t cell = rectGlyphs[group][i] % perPage;
+                    rects[group][i].x = (int)(cell % columns) * cellW;
+                    rects[group][i].y = (int)(cell / columns) * cellH;
+                    rects[group][i].id = (int)(rectGlyphs[group][i] / perPage);
+                    rects[group][i].was_packed = 1;
+                }
+            }
+            gridLayout = {cellW, cellH, (int32_t)columns, (int32_t)rows, (int32_t)RECT_PAD};
+            return true;
+        };
+        size_t colorPageBegin = pages.size();
+        if (job.grid) {
+            if (!layoutGrid()) {
+                return AtlasStatus::PackFailed;
+            }
+            colorPageBegin = pages.size();
+        } else {
+            if (!rects[HOT].empty()) {
+                if (!packGroup(HOT, job.format)) {
+                    return AtlasStatus::PackFailed;
+                }
+                hotPages = (int)pages.size();
+            }
+            // An atlas of nothing but color glyphs has no coverage pages.
+            if (!rects[COVERAGE].empty() || (pages.empty() && rects[COLOR].empty())) {
+                if (!packGroup(COVERAGE, job.format)) {
+                    return AtlasStatus::PackFailed;
+                }
+            }
+            colorPageBegin = pages.size();
+            if (!rects[COLOR].empty()) {
+                if (!packGroup(COLOR, AtlasFormat::RGBA8)) {
+                    return AtlasStatus::PackFailed;
+                }
+            }
+        }
+        double packMs = MsSince(packBegin);
+
+        double rectArea = 0, pageArea = 0;
+        size_t rectCount = 0;
+        for (uint32_t id = 0; id < baseGlyphs; ++id) {
+            if (glyphs.width[id] * glyphs.height[id] != 0) {
+                rectArea += (double)(glyphs.width[id] + RECT_GROW) * (glyphs.height[id] + RECT_GROW);
+            }
+        }
+        for (auto& group : rects) {
+            for (auto& rect : group) {
+                rectArea += (double)rect.w * rect.h;
+            }
+            rectCount += group.size();
+        }
+        for (auto& page : pages) {
+            pageArea += (double)page.width * page.height;
+        }
+        if (settings.verbose) {
+            printf("Packed %zu glyphs into %zu page(s) in %f ms, %.1f%% fill\n", rectCount, pages.size(),
+                packMs, pageArea > 0 ? rectArea / pageArea * 100.0 : 0.0);
+            if (!rects[HOT].empty()) {
+                printf("%zu hot glyphs on %d page(s)\n", rects[HOT].size(), hotPages);
+            }
+            if (!rects[COLOR].empty()) {
+                printf("%zu color glyphs on %zu RGBA page(s)\n", rects[COLOR].size(), pages.size() - colorPageBegin);
+            }
+        }
+        stats.packedRects = rectCount;
+        stats.colorGlyphs = rects[COLOR].size();
+        stats.hotGlyphs = rects[HOT].size();
+        stats.pages = pages.size();
+        stats.rectArea = rectArea;
+        stats.atlasArea = pageArea;
+        stats.times.Lap("pack");
+    }
+    for (int group = 0; group < GROUP_COUNT; ++group) {
+        for (size_t i = 0; i < rects[group].size(); ++i) {
+            uint32_t id = rectGlyphs[group][i];
+            glyphs.x[id] = rects[group][i].x + RECT_PAD;
+            glyphs.y[id] = rects[group][i].y + RECT_PAD;
+            glyphs.page[id] = rects[group][i].id;
+        }
+    }
+    for (uint32_t id : glyphOrder) {
+        glyphs.x[id] = glyphs.x[original[id]];
+        glyphs.y[id] = glyphs.y[original[id]];
+        glyphs.page[id] = glyphs.page[original[id]];
+    }
+    std::vector<uint32_t> packedGlyphs;
+    for (auto& group : rectGlyphs) {
+        packedGlyphs.insert(packedGlyphs.end(), group.begin(), group.end());
+    }
+
+    // Copies a glyph into an image of its page that starts at page row firstRow.
+    auto blitGlyph = [&](size_t worker, uint32_t id, uint8_t* atlasBmp, int firstRow) -> AtlasStatus {
+        stbrp_rect rect;
+        memset(&rect, 0, sizeof(rect));
+        rect.x = glyphs.x[id];
+        rect.y = glyphs.y[id] - firstRow;
+        const int page = glyphs.page[id];
+        const AtlasFormat format = pages[page].format;
+        const size_t atlasPitch = AtlasPitch(format, pages[page].width);
+
+        if (singlePass) {
+            FT_Bitmap bitmap;
+            memset(&bitmap, 0, sizeof(bitmap));
+            bitmap.rows = glyphs.height[id];
+            bitmap.width = glyphs.width[id] * (glyphs.pixelMode[id] == FT_PIXEL_MODE_LCD ? 3 : 1);
+            bitmap.pitch = glyphs.bitmapPitch[id];
+            bitmap.buffer = (unsigned char*)glyphBitmap(id);
+            bitmap.pixel_mode = glyphs.pixelMode[id];
+            return BlitGlyph(bitmap, rect, atlasBmp, format, atlasPitch) ? AtlasStatus::Ok : AtlasStatus::BlitFailed;
+        }
+
+        FT_Face workerFace = instances[worker]->Face();
+        GlyphTimes* times = settings.stats ? &workerTimes[worker] : nullptr;
+        FT_Error err = FT_Err_Ok;
+        Timed(times ? &times->loadMs : nullptr, [&]() {
+            err = FT_Load_Glyph(workerFace, glyphs.glyphIndex[id], render.loadFlags);
+        });
+        if (err == FT_Err_Ok && workerFace->glyph->format != FT_GLYPH_FORMAT_BITMAP) {
+            Timed(times ? &times->renderMs : nullptr, [&]() {
+                err = FT_Render_Glyph(workerFace->glyph, render.renderMode);
+            });
+        }
+        if (!FtOk(err)) {
+            return AtlasStatus::RenderFailed;
+        }
+        return BlitGlyph(workerFace->glyph->bitmap, rect, atlasBmp, format, atlasPitch) ? AtlasStatus::Ok : AtlasStatus::BlitFailed;
+    };
+    // Keeps the first failure of a parallel blit.
+    std::atomic<AtlasStatus> blitStatus = AtlasStatus::Ok;
+    auto blitFailed = [&](AtlasStatus status) {
+        AtlasStatus ok = AtlasStatus::Ok;
+        if (status != AtlasStatus::Ok) {
+            blitStatus.compare_exchange_strong(ok, status);
+        }
+    };
+
+    // The patches of an append: the rect of every base page that got new glyphs, and every
+    // new page whole. A1 patches are widened to whole bytes.
+    struct PatchRect {
+        int x0 = INT_MAX, y0 = INT_MAX, x1 = 0, y1 = 0;
+    };
+    std::vector<PatchRect> patchRects{append ? pages.size() : 0};
+    if (append) {
+        for (size_t i = base->pages.size(); i < pages.size(); ++i) {
+            patchRects[i] = {0, 0, pages[i].width, pages[i].height};
+        }
+        for (uint32_t id : packedGlyphs) {
+            PatchRect& patch = patchRects[glyphs.page[id]];
+            patch.x0 = std::min(patch.x0, glyphs.x[id]);
+            patch.y0 = std::min(patch.y0, glyphs.y[id]);
+            patch.x1 = std::max(patch.x1, glyphs.x[id] + (int)glyphs.width[id]);
+            patch.y1 = std::max(patch.y1, glyphs.y[id] + (int)glyphs.height[id]);
+        }
+        for (size_t i = 0; i < pages.size(); ++i) {
+            if (pages[i].format == AtlasFormat::A1 && patchRects[i].x1 > 0) {
+                patchRects[i].x0 &= ~7;
+                patchRects[i].x1 = std::min(pages[i].width, (patchRects[i].x1 + 7) & ~7);
+            }
+        }
+    }
+    MapData delta;
+    auto writePatch = [&](size_t page, const uint8_t* pixels) {
+        const PatchRect& patch = patchRects[page];
+        if (patch.x1 <= patch.x0) {
+            return true;
+        }
+        const AtlasFormat format = pages[page].format;
+        const size_t pitch = AtlasPitch(format, pages[page].width);
+        const size_t patchPitch = AtlasPitch(format, patch.x1 - patch.x0);
+        const size_t offset = format == AtlasFormat::A1 ? patch.x0 / 8 : AtlasPitch(format, patch.x0);
+        const size_t index = delta.pages.size();
+        delta.pages.push_back({PageFileName("patch", index), patch.x1 - patch.x0, patch.y1 - patch.y0, format});
+        delta.patches.push_back({(int32_t)page, patch.x0, patch.y0});
+        if (!append->patchSink) {
+            return true;
+        }
+        if (!append->patchSink->BeginPage(index, patch.x1 - patch.x0, patch.y1 - patch.y0, format)) {
+            return false;
+        }
+        for (int y = patch.y0; y < patch.y1; ++y) {
+            if (!append->patchSink->WriteRows(&pixels[y * pitch + offset], 1, patchPitch)) {
+                return false;
+            }
+        }
+        return append->patchSink->EndPage();
+    };
+
+    // Packed rects never overlap, so workers can blit into the atlas without synchronizing.
+    // Appends start from the base pages, so they are always built whole.
+    if (!settings.stream || append) {
+        std::vector<std::vector<uint8_t>> pageBmps{pages.size()};
+        for (size_t i = 0; i < pages.size(); ++i) {
+            if (append && i < append->basePages.size()) {
+                pageBmps[i] = append->basePages[i].pixels;
+                continue;
+            }
+            pageBmps[i].resize(AtlasPitch(pages[i].format, pages[i].width) * pages[i].height);
+            memset(pageBmps[i].data(), AtlasBackground(pages[i].format), pageBmps[i].size());
+        }
+        ParallelFor(instances.size(), packedGlyphs.size(), [&](size_t worker, size_t i) {
+            uint32_t id = packedGlyphs[i];
+            blitFailed(blitGlyph(worker, id, pageBmps[glyphs.page[id]].data(), 0));
+        });
+        if (blitStatus != AtlasStatus::Ok) {
+            return blitStatus;
+        }
+        stats.times.Lap("blit");
+
+        for (size_t i = 0; i < pages.size(); ++i) {
+            if (!sink.BeginPage(i, pages[i].width, pages[i].height, pages[i].format) ||
+                !sink.WriteRows(pageBmps[i].data(), pages[i].height, AtlasPitch(pages[i].format, pages[i].width)) ||
+                !sink.EndPage()) {
+                return AtlasStatus::OutputFailed;
+            }
+            if (append && !writePatch(i, pageBmps[i].data())) {
+                return AtlasStatus::OutputFailed;
+            }
+            // The sink has its copy, don't keep every page around until the end.
+            std::vector<uint8_t>{}.swap(pageBmps[i]);
+        }
+        stats.times.Lap("png");
+    } else {
+        // Each page is built band by band. A band holds STREAM_ROWS rows plus room for the
+        // tallest glyph, so every glyph that starts in the band can be blitted whole. Once
+        // the band is written the rows glyphs reached into move up and become the start of
+        // the next band.
+        const int STREAM_ROWS = 128;
+        std::vector<std::vector<uint32_t>> pageGlyphs{pages.size()};
+        for (uint32_t id : packedGlyphs) {
+            pageGlyphs[glyphs.page[id]].push_back(id);
+        }
+        std::vector<uint8_t> band;
+        for (size_t i = 0; i < pages.size(); ++i) {
+            auto& onPage = pageGlyphs[i];
+            std::stable_sort(onPage.begin(), onPage.end(), [&](uint32_t a, uint32_t b) {
+                return glyphs.y[a] < glyphs.y[b];
+            });
+            int tallest = 0;
+            for (uint32_t id : onPage) {
+                tallest = std::max(tallest, (int)glyphs.height[id]);
+            }
+            const AtlasFormat format = pages[i].format;
+            const uint8_t background = AtlasBackground(format);
+            const size_t pitch = AtlasPitch(format, pages[i].width);
+            const size_t bandRows = STREAM_ROWS + tallest;
+            band.assign(pitch * bandRows, background);
+
+            if (!sink.BeginPage(i, pages[i].width, pages[i].height, format)) {
+                return AtlasStatus::OutputFailed;
+            }
+            size_t next = 0;
+            for (int firstRow = 0; firstRow < pages[i].height; firstRow += STREAM_ROWS) {
+                size_t end = next;
+                while (end < onPage.size() && glyphs.y[onPage[end]] < firstRow + STREAM_ROWS) {
+                    ++end;
+                }
+                ParallelFor(instances.size(), end - next, [&](size_t worker, size_t j) {
+                    blitFailed(blitGlyph(worker, onPage[next + j], band.data(), firstRow));
+                });
+                if (blitStatus != AtlasStatus::Ok) {
+                    return blitStatus;
+                }
+                next = end;
+
+                const size_t rows = std::min(STREAM_ROWS, pages[i].height - firstRow);
+                if (!sink.WriteRows(band.data(), rows, pitch)) {
+                    return AtlasStatus::OutputFailed;
+                }
+                memmove(band.data(), &band[rows * pitch], (bandRows - rows) * pitch);
+                memset(&band[(bandRows - rows) * pitch], background, rows * pitch);
+            }
+            if (!sink.EndPage()) {
+                return AtlasStatus::OutputFailed;
+            }
+        }
+        stats.times.Lap("stream");
+    }
+    for (auto& times : workerTimes) {
+        stats.glyphTimes.loadMs += times.loadMs;
+        stats.glyphTimes.renderMs += times.renderMs;
+    }
+    if (singlePass && settings.verbose) {
+        size_t arenaSize = 0;
+        for (auto& arena : glyphArenas) {
+            arenaSize += arena.size();
+        }
+        printf("Glyph arena: %.2f MB\n", (double)arenaSize / (1024.0 * 1024.0));
+    }
+
+    map = MapData{};
+    map.format = job.format;
+    map.hotPages = hotPages;
+    for (size_t i = 0; i < pages.size(); ++i) {
+        map.pages.push_back({PageFileName("atlas", i), pages[i].width, pages[i].height, pages[i].format});
+    }
+    auto addColumn = [&](MapField field, auto&& value) {
+        map.fields.push_back(field);
+        auto& column = map.glyphs.emplace_back();
+        column.reserve(glyphs.Size());
+        for (size_t id = 0; id < glyphs.Size(); ++id) {
+            column.push_back((int32_t)value(id));
+        }
+    };
+    addColumn(MapField::Width, [&](size_t id) { return glyphs.width[id]; });
+    addColumn(MapField::Height, [&](size_t id) { return glyphs.height[id]; });
+    addColumn(MapField::LeftBearing, [&](size_t id) { return glyphs.leftBearing[id]; });
+    addColumn(MapField::TopBearing, [&](size_t id) { return glyphs.topBearing[id]; });
+    addColumn(MapField::Advance, [&](size_t id) { return glyphs.advance[id] >> 6; });
+    // Grid positions follow from the glyph id. Otherwise the page only needs to be stored per
+    // glyph when there is more than one.
+    if (job.grid) {
+        map.grid = gridLayout;
+    } else {
+        addColumn(MapField::X, [&](size_t id) { return glyphs.x[id]; });
+        addColumn(MapField::Y, [&](size_t id) { return glyphs.y[id]; });
+        if (pages.size() > 1) {
+            addColumn(MapField::Page, [&](size_t id) { return glyphs.page[id]; });
+        }
+    }
+    for (auto& entry : codepoints) {
+        map.codepoints.push_back({entry.cp, entry.glyphId / job.subpixel});
+    }
+    map.subpixel = job.subpixel > 1 ? job.subpixel : 0;
+    map.distanceField = job.distanceField;
+    map.spread = job.spread;
+    map.emSize = job.size;
+    map.ascender = faceMetric(face->size->metrics.ascender);
+    map.descender = faceMetric(face->size->metrics.descender);
+    map.height = faceMetric(face->size->metrics.height);
+    if (job.kerning) {
+        map.kerning = MapKerning(face, instances[0]->StrikeScale(), glyphIndices);
+        stats.times.Lap("kerning");
+    }
+
+    if (append) {
+        // The delta is a map of the new glyphs and codepoints whose pages are the patches.
+        delta.format = map.format;
+        delta.fields = map.fields;
+        for (auto& column : map.glyphs) {
+            delta.glyphs.emplace_back(column.begin() + baseGlyphs, column.end());
+        }
+        std::vector<uint32_t> baseCps;
+        for (auto [cp, glyphId] : base->codepoints) {
+            baseCps.push_back(cp);
+        }
+        std::sort(baseCps.begin(), baseCps.end());
+        for (auto [cp, glyphId] : map.codepoints) {
+            if (!std::binary_search(baseCps.begin(), baseCps.end(), cp)) {
+                delta.codepoints.push_back({cp, glyphId});
+            }
+        }
+        // Pairs between base glyphs are in the base already.
+        for (auto& pair : map.kerning) {
+            if (std::max(pair.left, pair.right) >= baseGlyphs) {
+                delta.kerning.push_back(pair);
+            }
+        }
+        delta.firstGlyph = (int32_t)baseGlyphs;
+        delta.distanceField = map.distanceField;
+        delta.spread = map.spread;
+        delta.emSize = map.emSize;
+        delta.ascender = map.ascender;
+        delta.descender = map.descender;
+        delta.height = map.height;
+        append->delta = std::move(delta);
+    }
+    return AtlasStatus::Ok;
+}
+
+namespace {
+
+// Loads one glyph for BuildMetrics. Loading an outline presets the bitmap size FreeType
+// would render from its control box, so this gets the atlas metrics without rasterizing.
+bool MeasureMetrics(FT_Face face, FT_Int32 loadFlags, double scale, GlyphTable& glyphs, size_t id, GlyphTimes* times) {
+    FT_Error err = FT_Err_Ok;
+    Timed(times ? &times->loadMs : nullptr, [&]() {
+        err = FT_Load_Glyph(face, glyphs.glyphIndex[id], loadFlags);
+    });
+    if (!FtOk(err)) {
+        return false;
+    }
+    const FT_GlyphSlot slot = face->glyph;
+    glyphs.advance[id] = slot->advance.x;
+    glyphs.width[id] = slot->bitmap.width;
+    glyphs.height[id] = slot->bitmap.rows;
+    glyphs.leftBearing[id] = slot->bitmap_left;
+    glyphs.topBearing[id] = slot->bitmap_top;
+    if (scale != 1.0) {
+        // Rounded like MeasureGlyph and ResampleBitmap round resampled strikes.
+        glyphs.advance[id] = lround(glyphs.advance[id] * scale);
+        glyphs.leftBearing[id] = lround(glyphs.leftBearing[id] * scale);
+        glyphs.topBearing[id] = lround(glyphs.topBearing[id] * scale);
+        if (glyphs.width[id] * glyphs.height[id] != 0) {
+            glyphs.width[id] = std::max(1u, (unsigned)lround(glyphs.width[id] * scale));
+            glyphs.height[id] = std::max(1u, (unsigned)lround(glyphs.height[id] * scale));
+        } else {
+            glyphs.width[id] = 0;
+            glyphs.height[id] = 0;
+        }
+    }
+    return true;
+}
+
+}
+
+AtlasStatus BuildMetrics(AtlasFont& font, const BuildSettings& settings, const AtlasOptions& job, MetricsSink& sink, JobStats& stats) {
+    std::lock_guard<std::mutex> lock{font.m_mutex};
+    auto& instances = font.m_instances;
+    const CodepointTable& cpTable = *font.m_cpTable;
+    FT_Face face = instances[0]->Face();
+
+    if (job.distanceField != DistanceField::None) {
+        printf("--metrics-only can't be combined with --sdf or --msdf\n");
+        return AtlasStatus::InvalidOptions;
+    }
+    if (job.hotGlyphs != 0 || job.grid || job.subpixel > 1) {
+        printf("--hot, --grid and --subpixel can't be combined with --metrics-only\n");
+        return AtlasStatus::InvalidOptions;
+    }
+
+    std::vector<FT_Fixed> coords;
+    if (!ResolveAxes(instances[0]->Library(), face, job.axes, coords)) {
+        return AtlasStatus::InvalidOptions;
+    }
+    for (auto& instance : instances) {
+        if (!instance->Select(job.size, coords)) {
+            return AtlasStatus::InvalidFont;
+        }
+    }
+    const double scale = instances[0]->StrikeScale();
+    auto faceMetric = [&](FT_Pos value) {
+        return (int32_t)floor(value * scale / 64.0);
+    };
+
+    const std::vector<std::pair<uint32_t, uint32_t>> cpRanges = JobRanges(job, cpTable);
+    std::vector<CodepointEntry> codepoints;
+    for (auto range : cpRanges) {
+        size_t mapped = cpTable.ForEach(range.first, range.second, [&](uint32_t cp, FT_UInt glyphIndex) {
+            codepoints.push_back({cp, glyphIndex, 0});
+        });
+        stats.unmappedCodepoints += (size_t)(range.second - range.first) + 1 - mapped;
+    }
+    GlyphTable glyphs;
+    NumberGlyphs(face, {}, codepoints, glyphs);
+    stats.codepoints = codepoints.size();
+    stats.uniqueGlyphs = glyphs.Size();
+    stats.renderedGlyphs = glyphs.Size();
+    stats.times.Lap("setup");
+
+    // Loaded with the atlas hinting. Fonts with outlines are measured by them, embedded
+    // bitmaps would only cost time; bitmap-only fonts are measured by their strike.
+    FT_Int32 loadFlags = job.mono ? FT_LOAD_TARGET_MONO : FT_LOAD_DEFAULT;
+    if (job.lcd != LcdLayout::None) {
+        loadFlags = job.lcd == LcdLayout::Vertical ? FT_LOAD_TARGET_LCD_V : FT_LOAD_TARGET_LCD;
+    }
+    if (FT_IS_SCALABLE(face)) {
+        loadFlags |= FT_LOAD_NO_BITMAP;
+    }
+
+    MapData map;
+    map.format = job.format;
+    map.fields = {MapField::Width, MapField::Height, MapField::LeftBearing, MapField::TopBearing, MapField::Advance};
+    for (auto& entry : codepoints) {
+        map.codepoints.push_back({entry.cp, entry.glyphId});
+    }
+    map.ascender = faceMetric(face->size->metrics.ascender);
+    map.descender = faceMetric(face->size->metrics.descender);
+    map.height = faceMetric(face->size->metrics.height);
+    if (job.kerning) {
+        map.kerning = MapKerning(face, scale, glyphs.glyphIndex);
+    }
+    if (!sink.Begin(map)) {
+        return AtlasStatus::OutputFailed;
+    }
+
+    // Streaming hands every batch to the sink as soon as it is measured.
+    const size_t STREAM_GLYPHS = 4096;
+    const size_t batch = settings.stream ? STREAM_GLYPHS : std::max<size_t>(glyphs.Size(), 1);
+    std::vector<GlyphTimes> workerTimes{instances.size()};
+    std::vector<std::vector<int32_t>> columns{map.fields.size()};
+    for (size_t begin = 0; begin < glyphs.Size(); begin += batch) {
+        const size_t end = std::min(glyphs.Size(), begin + batch);
+        std::atomic<bool> failed = false;
+        ParallelFor(instances.size(), end - begin, [&](size_t worker, size_t i) {
+            if (!MeasureMetrics(instances[worker]->Face(), loadFlags, scale, glyphs, begin + i, settings.stats ? &workerTimes[worker] : nullptr)) {
+                failed = true;
+            }
+        });
+        if (failed) {
+            return AtlasStatus::RenderFailed;
+        }
+        for (auto& column : columns) {
+            column.clear();
+        }
+        for (size_t id = begin; id < end; ++id) {
+            columns[0].push_back((int32_t)glyphs.width[id]);
+            columns[1].push_back((int32_t)glyphs.height[id]);
+            columns[2].push_back((int32_t)glyphs.leftBearing[id]);
+            columns[3].push_back((int32_t)glyphs.topBearing[id]);
+            columns[4].push_back((int32_t)(glyphs.advance[id] >> 6));
+        }
+        if (!sink.WriteGlyphs(columns)) {
+            return AtlasStatus::OutputFailed;
+        }
+    }
+    for (auto& times : workerTimes) {
+        stats.glyphTimes.loadMs += times.loadMs;
+    }
+    stats.times.Lap("measure");
+    return sink.End() ? AtlasStatus::Ok : AtlasStatus::OutputFailed;
+}
+
+namespace {
+
+// Collects the pages of an in-memory build into AtlasBitmaps.
+class MemoryPageSink : public AtlasPageSink {
+    std::vector<AtlasBitmap>& m_pages;
+    size_t m_row = 0;
+
+public:
+    explicit MemoryPageSink(std::vector<AtlasBitmap>& pages) : m_pages(pages) {}
+
+    bool BeginPage(size_t, int width, int height, AtlasFormat format) override {
+        AtlasBitmap& page = m_pages.emplace_back();
+        page.width = width;
+        page.height = height;
+        page.format = format;
+        page.pitch = AtlasPitch(format, width);
+        page.pixels.resize(page.pitch * height);
+        m_row = 0;
+        return true;
+    }
+
+    bool WriteRows(const uint8_t* rows, size_t count, size_t pitch) override {
+        AtlasBitmap& page = m_pages.back();
+        if (m_row + count > (size_t)page.height || pitch != page.pitch) {
+            return false;
+        }
+        memcpy(&page.pixels[m_row * page.pitch], rows, count * pitch);
+        m_row += count;
+        return true;
+    }
+
+    bool EndPage() override {
+        return m_row == (size_t)m_pages.back().height;
+    }
+};
+
+}
+
+AtlasStatus BuildAtlas(const uint8_t* fontData, size_t fontSize, const AtlasOptions& options, AtlasResult& result, AtlasFontCache* cache) {
+    std::shared_ptr<AtlasFont> font;
+    AtlasStatus status;
+    if (cache) {
+        status = cache->Get(fontData, fontSize, font);
+    } else {
+        std::unique_ptr<AtlasFont> opened;
+        auto bytes = std::make_shared<const std::vector<uint8_t>>(fontData, fontData + fontSize);
+        status = AtlasFont::OpenMemory(nullptr, std::move(bytes), 1, opened);
+        font = std::move(opened);
+    }
+    if (status != AtlasStatus::Ok) {
+        return status;
+    }
+
+    // Streaming writes each page straight into its bitmap instead of building it twice.
+    BuildSettings settings;
+    settings.stream = true;
+    settings.verbose = false;
+    result = AtlasResult{};
+    MemoryPageSink sink{result.pages};
+    JobStats stats;
+    return BuildAtlas(*font, settings, options, sink, result.map, stats);
+}
+
+LiveAtlas::LiveAtlas() = default;
+LiveAtlas::~LiveAtlas() = default;
+
+AtlasStatus LiveAtlas::Create(std::shared_ptr<AtlasFont> font, const BuildSettings& settings, const AtlasOptions& options, size_t pages, std::unique_ptr<LiveAtlas>& atlas) {
+    if (options.maxPageW <= 0 || options.maxPageH <= 0 || pages == 0) {
+        printf("A live atlas needs a page size and at least one page\n");
+        return AtlasStatus::InvalidOptions;
+    }
+    if (!options.cpRanges.empty() || !options.cpCounts.empty() || options.hotGlyphs != 0 || options.grid ||
+        options.dedup || options.kerning || options.subpixel != 1) {
+        printf("Codepoint ranges, --text, --hot, --grid, --dedup, --kerning and --subpixel don't apply to a live atlas\n");
+        return AtlasStatus::InvalidOptions;
+    }
+    // Color glyphs are flattened, RGBA pages would only hold them.
+    if (options.format == AtlasFormat::RGBA8 || !ValidRenderOptions(options)) {
+        return AtlasStatus::InvalidOptions;
+    }
+
+    std::lock_guard<std::mutex> lock{font->m_mutex};
+    auto& instances = font->m_instances;
+    FT_Face face = instances[0]->Face();
+    std::unique_ptr<LiveAtlas> live{new LiveAtlas};
+    if (!ResolveAxes(instances[0]->Library(), face, options.axes, live->m_coords)) {
+        return AtlasStatus::InvalidOptions;
+    }
+    for (auto& instance : instances) {
+        if (!instance->Select(options.size, live->m_coords)) {
+            return AtlasStatus::InvalidFont;
+        }
+    }
+    live->m_font = std::move(font);
+    live->m_options = options;
+
+    // Strike metrics are scaled like the glyphs.
+    const double scale = instances[0]->StrikeScale();
+    MapData& metrics = live->m_metrics;
+    metrics.format = options.format;
+    metrics.ascender = (int32_t)floor(face->size->metrics.ascender * scale / 64.0);
+    metrics.descender = (int32_t)floor(face->size->metrics.descender * scale / 64.0);
+    metrics.height = (int32_t)floor(face->size->metrics.height * scale / 64.0);
+    metrics.distanceField = options.distanceField;
+    metrics.spread = options.spread;
+    metrics.emSize = options.size;
+
+    const int PAGE_BORDER = options.padding == PackPadding::Shared ? (options.distanceField != DistanceField::None ? options.spread : 1) : 0;
+    live->m_pages.resize(pages);
+    for (Page& page : live->m_pages) {
+        page.bitmap.width = options.maxPageW;
+        page.bitmap.height = options.maxPageH;
+        page.bitmap.format = options.format;
+        page.bitmap.pitch = AtlasPitch(options.format, options.maxPageW);
+        page.bitmap.pixels.assign(page.bitmap.pitch * page.bitmap.height, AtlasBackground(options.format));
+        page.skyline.assign(std::max(1, options.maxPageW - PAGE_BORDER), 0);
+    }
+
+    if (!settings.glyphCacheDir.empty()) {
+        std::filesystem::path cacheDir = settings.glyphCacheDir;
+        std::error_code err;
+        std::filesystem::create_directories(cacheDir, err);
+        uint64_t key = GlyphCacheKey(settings.fontHash, options, false);
+        live->m_glyphCache = std::make_unique<GlyphCache>(cacheDir / ("glyphs-" + HexKey(key) + ".bin"), key);
+        live->m_glyphCache->Load();
+        live->m_glyphCache->ascender = face->size->metrics.ascender;
+        live->m_glyphCache->descender = face->size->metrics.descender;
+        live->m_glyphCache->height = face->size->metrics.height;
+    }
+    atlas = std::move(live);
+    return AtlasStatus::Ok;
+}
+
+AtlasStatus LiveAtlas::Request(const std::vector<uint32_t>& codepoints, LiveUpdate& update) {
+    std::lock_guard<std::mutex> lock{m_font->m_mutex};
+    auto& instances = m_font->m_instances;
+    const CodepointTable& cpTable = *m_font->m_cpTable;
+    const AtlasOptions& job = m_options;
+    update = LiveUpdate{};
+    ++m_serial;
+
+    // Builds of the same font may have selected other sizes and set other renderer properties
+    // since the last request.
+    for (auto& instance : instances) {
+        if (!instance->Select(job.size, m_coords)) {
+            return AtlasStatus::InvalidFont;
+        }
+    }
+    GlyphRender render;
+    if (!SetUpRender(job, false, instances, render)) {
+        return AtlasStatus::RenderFailed;
+    }
+
+    // Pages that hold a requested glyph count as used, so they are recycled last. Glyphs that
+    // aren't in the atlas yet are rendered once, however many of the
+    // codepoints map to them.
+    std::vector<std::pair<uint32_t, FT_UInt>> requested;
+    std::unordered_set<uint32_t> seen;
+    std::unordered_map<FT_UInt, uint32_t> newIds;
+    GlyphTable glyphs;
+    for (uint32_t cp : codepoints) {
+        if (!seen.insert(cp).second) {
+            continue;
+        }
+        size_t mapped = cpTable.ForEach(cp, cp, [&](uint32_t, FT_UInt glyphIndex) {
+            requested.push_back({cp, glyphIndex});
+            auto it = m_glyphs.find(glyphIndex);
+            if (it != m_glyphs.end()) {
+                if (it->second.glyph.width * it->second.glyph.height != 0) {
+                    m_pages[it->second.glyph.page].lastUse = m_serial;
+                }
+            } else if (newIds.emplace(glyphIndex, (uint32_t)glyphs.glyphIndex.size()).second) {
+                glyphs.glyphIndex.push_back(glyphIndex);
+            }
+        });
+        if (mapped == 0) {
+            update.unmapped.push_back(cp);
+        }
+    }
+    glyphs.Resize(glyphs.glyphIndex.size());
+
+    // Cached bitmaps are read from the cache file, which is the last arena.
+    std::vector<std::vector<uint8_t>> glyphArenas{instances.size()};
+    std::vector<uint32_t> toRender;
+    for (uint32_t id = 0; id < glyphs.Size(); ++id) {
+        if (m_glyphCache && m_glyphCache->Find(glyphs, id)) {
+            glyphs.bitmapArena[id] = glyphArenas.size();
+        } else {
+            toRender.push_back(id);
+        }
+    }
+    update.cachedGlyphs = glyphs.Size() - toRender.size();
+    update.renderedGlyphs = toRender.size();
+    std::atomic<bool> renderFailed = false;
+    ParallelFor(instances.size(), toRender.size(), [&](size_t worker, size_t i) {
+        uint32_t id = toRender[i];
+        glyphs.bitmapArena[id] = worker;
+        if (!MeasureGlyph(instances[worker]->Face(), render, true, glyphs, id, glyphArenas[worker], nullptr)) {
+            renderFailed = true;
+        }
+    });
+    if (renderFailed) {
+        return AtlasStatus::RenderFailed;
+    }
+    // Requested glyphs that have to move off a recycled page are copied out of it into the
+    // arena after the cache.
+    std::vector<uint8_t> movedArena;
+    auto glyphBitmap = [&](uint32_t id) -> const uint8_t* {
+        if (glyphs.bitmapArena[id] == glyphArenas.size()) {
+            return &m_glyphCache->Data()[glyphs.bitmapOffset[id]];
+        }
+        if (glyphs.bitmapArena[id] == glyphArenas.size() + 1) {
+            return &movedArena[glyphs.bitmapOffset[id]];
+        }
+        return &glyphArenas[glyphs.bitmapArena[id]][glyphs.bitmapOffset[id]];
+    };
+    if (m_glyphCache) {
+        for (uint32_t id : toRender) {
+            m_glyphCache->Add(glyphs, id, glyphBitmap(id));
+        }
+    }
+
+    // Rects are padded like the ones of BuildAtlas.
+    const uint32_t RECT_PAD = job.distanceField != DistanceField::None ? job.spread : 1;
+    const uint32_t RECT_GROW = job.padding == PackPadding::Shared ? RECT_PAD : RECT_PAD*2;
+    const int PAGE_BORDER = job.padding == PackPadding::Shared ? (int)RECT_PAD : 0;
+    const int packHeight = std::max(1, job.maxPageH - PAGE_BORDER);
+    std::vector<stbrp_rect> rects;
+    std::vector<uint32_t> rectGlyphs;
+    std::vector<size_t> left;
+    auto addRect = [&](uint32_t id) {
+        stbrp_rect rect;
+        memset(&rect, 0, sizeof(rect));
+        rect.w = glyphs.width[id] + RECT_GROW;
+        rect.h = glyphs.height[id] + RECT_GROW;
+        left.push_back(rects.size());
+        rects.push_back(rect);
+        rectGlyphs.push_back(id);
+    };
+    for (uint32_t id = 0; id < glyphs.Size(); ++id) {
+        if (glyphs.width[id] * glyphs.height[id] == 0) {
+            continue;
+        }
+        if ((int)(glyphs.width[id] + RECT_GROW) > (int)m_pages[0].skyline.size() || (int)(glyphs.height[id] + RECT_GROW) > packHeight) {
+            printf("A %dx%d glyph doesn't fit into a live atlas page\n", (int)glyphs.width[id], (int)glyphs.height[id]);
+            return AtlasStatus::PackFailed;
+        }
+        addRect(id);
+    }
+
+    // Copies a glyph off its page into movedArena as a bitmap BlitGlyph can put back, and adds
+    // it to the glyphs to pack.
+    std::unordered_map<FT_UInt, std::vector<uint32_t>> movedCodepoints;
+    auto moveGlyph = [&](const Slot& slot) {
+        const LiveGlyph& glyph = slot.glyph;
+        const AtlasBitmap& page = m_pages[glyph.page].bitmap;
+        const uint32_t id = (uint32_t)glyphs.Size();
+        glyphs.glyphIndex.push_back(glyph.glyphIndex);
+        glyphs.Resize(id + 1);
+        glyphs.width[id] = glyph.width;
+        glyphs.height[id] = glyph.height;
+        glyphs.leftBearing[id] = glyph.leftBearing;
+        glyphs.topBearing[id] = glyph.topBearing;
+        glyphs.advance[id] = (FT_Pos)glyph.advance << 6;
+        glyphs.bitmapArena[id] = glyphArenas.size() + 1;
+        glyphs.bitmapOffset[id] = movedArena.size();
+        switch (page.format) {
+        case AtlasFormat::A1: glyphs.bitmapPitch[id] = (glyph.width + 7) / 8; glyphs.pixelMode[id] = FT_PIXEL_MODE_MONO; break;
+        case AtlasFormat::RGB8: glyphs.bitmapPitch[id] = glyph.width * 3; glyphs.pixelMode[id] = FT_PIXEL_MODE_LCD; break;
+        default: glyphs.bitmapPitch[id] = glyph.width; glyphs.pixelMode[id] = FT_PIXEL_MODE_GRAY; break;
+        }
+        movedArena.resize(movedArena.size() + (size_t)glyphs.bitmapPitch[id] * glyph.height);
+        for (int y = 0; y < glyph.height; ++y) {
+            const uint8_t* src = &page.pixels[(glyph.y + y) * page.pitch];
+            uint8_t* dst = &movedArena[glyphs.bitmapOffset[id] + (size_t)y * glyphs.bitmapPitch[id]];
+            for (int x = 0; x < glyph.width; ++x) {
+                const int px = glyph.x + x;
+                switch (page.format) {
+                case AtlasFormat::GA8: dst[x] = src[px * 2 + 1]; break;
+                case AtlasFormat::A8: dst[x] = src[px]; break;
+                case AtlasFormat::A1: dst[x / 8] |= ((src[px / 8] >> (7 - px % 8)) & 1) << (7 - x % 8); break;
+                case AtlasFormat::RGB8: memcpy(&dst[x * 3], &src[px * 3], 3); break;
+                case AtlasFormat::RGBA8: break;
+                }
+            }
+        }
+        movedCodepoints[glyph.glyphIndex] = slot.codepoints;
+        addRect(id);
+    };
+    std::unordered_set<FT_UInt> requestedIndices;
+    for (auto& entry : requested) {
+        requestedIndices.insert(entry.second);
+    }
+
+    // New rects fill the free space below the skylines first. When they don't fit, the page
+    // used least recently that this request doesn't use is recycled and packed again. A
+    // request that uses every page recycles the one with the least requested area on it and
+    // moves those glyphs, each page at most once.
+    std::vector<bool> recycled(m_pages.size());
+    // left stays sorted, the rects that are no longer in it went onto the page.
+    auto packInto = [&](size_t page) {
+        std::vector<size_t> before = left;
+        PackIntoSkyline(rects, left, m_pages[page].skyline, packHeight, (int)page, job.heuristic);
+        auto& skyline = m_pages[page].skyline;
+        for (size_t i : before) {
+            const stbrp_rect& rect = rects[i];
+            if (!std::binary_search(left.begin(), left.end(), i)) {
+                for (int x = rect.x; x < rect.x + (int)rect.w; ++x) {
+                    skyline[x] = std::max(skyline[x], (int)(rect.y + rect.h));
+                }
+                m_pages[page].lastUse = m_serial;
+            }
+        }
+    };
+    AtlasStatus status = AtlasStatus::Ok;
+    for (size_t page = 0; page < m_pages.size() && !left.empty(); ++page) {
+        packInto(page);
+    }
+    while (!left.empty()) {
+        size_t victim = m_pages.size();
+        for (size_t page = 0; page < m_pages.size(); ++page) {
+            if (m_pages[page].lastUse < m_serial && (victim == m_pages.size() || m_pages[page].lastUse < m_pages[victim].lastUse)) {
+                victim = page;
+            }
+        }
+        if (victim == m_pages.size()) {
+            double least = 0;
+            for (size_t page = 0; page < m_pages.size(); ++page) {
+                if (recycled[page]) {
+                    continue;
+                }
+                double area = 0;
+                for (FT_UInt glyphIndex : m_pages[page].glyphs) {
+                    if (requestedIndices.count(glyphIndex) != 0) {
+                        const LiveGlyph& glyph = m_glyphs.at(glyphIndex).glyph;
+                        area += (double)glyph.width * glyph.height;
+                    }
+                }
+                if (victim == m_pages.size() || area < least) {
+                    victim = page;
+                    least = area;
+                }
+            }
+        }
+        if (victim == m_pages.size()) {
+            printf("The glyphs of one request don't fit into the live atlas pages\n");
+            status = AtlasStatus::PackFailed;
+            break;
+        }
+        Page& page = m_pages[victim];
+        for (FT_UInt glyphIndex : page.glyphs) {
+            auto it = m_glyphs.find(glyphIndex);
+            if (requestedIndices.count(glyphIndex) != 0) {
+                moveGlyph(it->second);
+            }
+            m_glyphs.erase(it);
+            update.evicted.push_back(glyphIndex);
+        }
+        // Rects this request already packed onto the page are packed again as well.
+        for (size_t i = 0; i < rects.size(); ++i) {
+            if (rects[i].was_packed && rects[i].id == (int)victim) {
+                rects[i].was_packed = 0;
+                left.push_back(i);
+            }
+        }
+        std::sort(left.begin(), left.end());
+        page.glyphs.clear();
+        std::fill(page.bitmap.pixels.begin(), page.bitmap.pixels.end(), AtlasBackground(page.bitmap.format));
+        std::fill(page.skyline.begin(), page.skyline.end(), 0);
+        page.lastUse = m_serial;
+        recycled[victim] = true;
+        packInto(victim);
+    }
+
+    // Packed rects never overlap, so workers can blit without synchronizing.
+    std::vector<uint32_t> placed;
+    for (size_t i = 0; i < rects.size(); ++i) {
+        if (rects[i].was_packed) {
+            uint32_t id = rectGlyphs[i];
+            glyphs.x[id] = rects[i].x + RECT_PAD;
+            glyphs.y[id] = rects[i].y + RECT_PAD;
+            glyphs.page[id] = rects[i].id;
+            placed.push_back(id);
+        }
+    }
+    std::atomic<bool> blitFailed = false;
+    ParallelFor(instances.size(), placed.size(), [&](size_t, size_t i) {
+        uint32_t id = placed[i];
+        AtlasBitmap& page = m_pages[glyphs.page[id]].bitmap;
+        stbrp_rect rect;
+        memset(&rect, 0, sizeof(rect));
+        rect.x = glyphs.x[id];
+        rect.y = glyphs.y[id];
+        FT_Bitmap bitmap;
+        memset(&bitmap, 0, sizeof(bitmap));
+        bitmap.rows = glyphs.height[id];
+        bitmap.width = glyphs.width[id] * (glyphs.pixelMode[id] == FT_PIXEL_MODE_LCD ? 3 : 1);
+        bitmap.pitch = glyphs.bitmapPitch[id];
+        bitmap.buffer = (unsigned char*)glyphBitmap(id);
+        bitmap.pixel_mode = glyphs.pixelMode[id];
+        if (!BlitGlyph(bitmap, rect, page.pixels.data(), page.format, page.pitch)) {
+            blitFailed = true;
+        }
+    });
+    if (blitFailed) {
+        return AtlasStatus::BlitFailed;
+    }
+
+    // A patch covers the new glyphs of its page, widened to whole bytes on A1 pages.
+    struct PatchRect {
+        int x0 = INT_MAX, y0 = INT_MAX, x1 = 0, y1 = 0;
+    };
+    std::vector<PatchRect> patchRects{m_pages.size()};
+    for (size_t i = 0; i < m_pages.size(); ++i) {
+        if (recycled[i]) {
+            patchRects[i] = {0, 0, m_pages[i].bitmap.width, m_pages[i].bitmap.height};
+        }
+    }
+    for (uint32_t id : placed) {
+        PatchRect& patch = patchRects[glyphs.page[id]];
+        patch.x0 = std::min(patch.x0, glyphs.x[id]);
+        patch.y0 = std::min(patch.y0, glyphs.y[id]);
+        patch.x1 = std::max(patch.x1, glyphs.x[id] + (int)glyphs.width[id]);
+        patch.y1 = std::max(patch.y1, glyphs.y[id] + (int)glyphs.height[id]);
+    }
+    for (size_t i = 0; i < m_pages.size(); ++i) {
+        PatchRect patch = patchRects[i];
+        if (patch.x1 <= patch.x0) {
+            continue;
+        }
+        const AtlasBitmap& page = m_pages[i].bitmap;
+        if (page.format == AtlasFormat::A1) {
+            patch.x0 &= ~7;
+            patch.x1 = std::min(page.width, (patch.x1 + 7) & ~7);
+        }
+        LiveUpdate::Patch& out = update.patches.emplace_back();
+        out.page = (int32_t)i;
+        out.x = patch.x0;
+        out.y = patch.y0;
+        out.bitmap.width = patch.x1 - patch.x0;
+        out.bitmap.height = patch.y1 - patch.y0;
+        out.bitmap.format = page.format;
+        out.bitmap.pitch = AtlasPitch(page.format, out.bitmap.width);
+        out.bitmap.pixels.resize(out.bitmap.pitch * out.bitmap.height);
+        const size_t offset = page.format == AtlasFormat::A1 ? patch.x0 / 8 : AtlasPitch(page.format, patch.x0);
+        for (int y = 0; y < out.bitmap.height; ++y) {
+            memcpy(&out.bitmap.pixels[y * out.bitmap.pitch], &page.pixels[(patch.y0 + y) * page.pitch + offset], out.bitmap.pitch);
+        }
+    }
+
+    // Glyphs with nothing to draw take no space, they are never evicted.
+    auto addSlot = [&](uint32_t id, bool drawn) {
+        Slot& slot = m_glyphs[glyphs.glyphIndex[id]];
+        auto moved = movedCodepoints.find(glyphs.glyphIndex[id]);
+        if (moved != movedCodepoints.end()) {
+            slot.codepoints = std::move(moved->second);
+        }
+        slot.glyph = {0, glyphs.glyphIndex[id], drawn ? glyphs.page[id] : 0, drawn ? glyphs.x[id] : 0, drawn ? glyphs.y[id] : 0,
+            (int32_t)glyphs.width[id], (int32_t)glyphs.height[id], glyphs.leftBearing[id], glyphs.topBearing[id], (int32_t)(glyphs.advance[id] >> 6)};
+        if (drawn) {
+            m_pages[glyphs.page[id]].glyphs.push_back(glyphs.glyphIndex[id]);
+        }
+    };
+    for (uint32_t id : placed) {
+        addSlot(id, true);
+    }
+    for (uint32_t id = 0; id < glyphs.Size(); ++id) {
+        if (glyphs.width[id] * glyphs.height[id] == 0) {
+            addSlot(id, false);
+        }
+    }
+    for (auto [cp, glyphIndex] : requested) {
+        auto it = m_glyphs.find(glyphIndex);
+        if (it == m_glyphs.end()) {
+            continue;
+        }
+        auto& cps = it->second.codepoints;
+        if (std::find(cps.begin(), cps.end(), cp) == cps.end()) {
+            cps.push_back(cp);
+        }
+        LiveGlyph& glyph = update.glyphs.emplace_back(it->second.glyph);
+        glyph.codepoint = cp;
+    }
+    return status;
+}
+
+std::vector<const AtlasBitmap*> LiveAtlas::Pages() const {
+    std::vector<const AtlasBitmap*> pages;
+    for (const Page& page : m_pages) {
+        pages.push_back(&page.bitmap);
+    }
+    return pages;
+}
+
+MapData LiveAtlas::Snapshot() const {
+    std::lock_guard<std::mutex> lock{m_font->m_mutex};
+    MapData map = m_metrics;
+    for (size_t i = 0; i < m_pages.size(); ++i) {
+        map.pages.push_back({PageFileName("atlas", i), m_pages[i].bitmap.width, m_pages[i].bitmap.height, m_pages[i].bitmap.format});
+    }
+    map.fields = {MapField::Width, MapField::Height, MapField::LeftBearing, MapField::TopBearing, MapField::Advance, MapField::X, MapField::Y};
+    if (m_pages.size() > 1) {
+        map.fields.push_back(MapField::Page);
+    }
+    std::vector<FT_UInt> glyphIndices;
+    for (auto& entry : m_glyphs) {
+        glyphIndices.push_back(entry.first);
+    }
+    std::sort(glyphIndices.begin(), glyphIndices.end());
+    map.glyphs.resize(map.fields.size());
+    for (uint32_t id = 0; id < glyphIndices.size(); ++id) {
+        const Slot& slot = m_glyphs.at(glyphIndices[id]);
+        const LiveGlyph& glyph = slot.glyph;
+        for (size_t i = 0; i < map.fields.size(); ++i) {
+            int32_t value = 0;
+            switch (map.fields[i]) {
+            case MapField::Width: value = glyph.width; break;
+            case MapField::Height: value = glyph.height; break;
+            case MapField::LeftBearing: value = glyph.leftBearing; break;
+            case MapField::TopBearing: value = glyph.topBearing; break;
+            case MapField::Advance: value = glyph.advance; break;
+            case MapField::X: value = glyph.x; break;
+            case MapField::Y: value = glyph.y; break;
+            case MapField::Page: value = glyph.page; break;
+            }
+            map.glyphs[i].push_back(value);
+        }
+        for (uint32_t cp : slot.codepoints) {
+            map.codepoints.push_back({cp, id});
+        }
+    }
+    std::sort(map.codepoints.begin(), map.codepoints.end());
+    return map;
+}
+
+bool LiveAtlas::SaveCache() {
+    std::lock_guard<std::mutex> lock{m_font->m_mutex};
+    return !m_glyphCache || m_glyphCache->Save();
+}
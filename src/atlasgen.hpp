@@ -0,0 +1,551 @@
+#pragma once
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <freetype/freetype.h>
+
+// The atlas builder behind the atlasgen command line tool. Fonts are opened once into an
+// AtlasFont and every BuildAtlas call renders, packs and blits one atlas from it. Nothing
+// here exits the process, every failure is returned as an AtlasStatus.
+
+// Pixel layout of the atlas images.
+enum class AtlasFormat {
+    // Gray + alpha. Gray is always 0xFF and alpha is the coverage.
+    GA8,
+    // One 8-bit channel holding the coverage, written as a grayscale PNG.
+    A8,
+    // One bit per pixel, written as a 1-bit grayscale PNG. Only used with --mono.
+    A1,
+    // Three 8-bit channels, written as an RGB PNG. Only used with --msdf and --lcd.
+    RGB8,
+    // Straight (not premultiplied) RGBA. Only used for the pages holding color glyphs.
+    RGBA8,
+};
+
+const char* AtlasFormatName(AtlasFormat format);
+// Bytes per row of an atlas page.
+size_t AtlasPitch(AtlasFormat format, int width);
+
+// Distance field atlases, see --sdf and --msdf.
+enum class DistanceField {
+    None,
+    Sdf,
+    Msdf,
+};
+
+const char* DistanceFieldName(DistanceField field);
+
+// Subpixel rendering for LCD screens, see --lcd. Each channel of an RGB8 atlas holds the
+// coverage of one subpixel.
+enum class LcdLayout {
+    None,
+    // Subpixels side by side, FT_RENDER_MODE_LCD.
+    Horizontal,
+    // Subpixels stacked top to bottom, FT_RENDER_MODE_LCD_V.
+    Vertical,
+};
+
+// FreeType's FT_LcdFilter that spreads the coverage over neighbouring subpixels against
+// color fringes, see --lcd-filter.
+enum class LcdFilter {
+    Default,
+    Light,
+    Legacy,
+    None,
+};
+
+// Empty space kept between packed glyphs, see --padding.
+enum class PackPadding {
+    // Every glyph has a gutter on all four sides, two gutters end up between neighbours.
+    Full,
+    // Every glyph has a gutter on its left and top only, neighbours share it. Pages get one
+    // more gutter along their right and bottom edge.
+    Shared,
+};
+
+// How the skyline packer picks the spot of the next rect, see --pack.
+enum class PackHeuristic {
+    // stbrp's Skyline_BL_sortHeight: the lowest spot.
+    BottomLeft,
+    // stbrp's Skyline_BF_sortHeight: the spot that wastes the least area below the rect.
+    BestFit,
+    // Packs with both heuristics and a few page widths and keeps the smallest result.
+    Auto,
+};
+
+// Everything that decides what an atlas looks like.
+struct AtlasOptions {
+    int size = 16;
+    // Array of first-last codepoint ranges. Empty means every codepoint of the font.
+    std::vector<std::pair<uint32_t, uint32_t>> cpRanges;
+    // How often each codepoint occurs in the text the atlas is for, sorted by codepoint.
+    // See AddTextCodepoints.
+    std::vector<std::pair<uint32_t, uint64_t>> cpCounts;
+    // When set, this many of the most frequent glyphs by cpCounts are packed onto pages of
+    // their own, which come first, so clients can fetch common glyphs before the long tail.
+    size_t hotGlyphs = 0;
+    std::unordered_map<std::string, FT_Fixed> axes;
+    bool mono = false;
+    // Largest allowed atlas page, 0 means unlimited. Glyphs that don't fit spill onto more pages.
+    int maxPageW = 0;
+    int maxPageH = 0;
+    AtlasFormat format = AtlasFormat::GA8;
+    DistanceField distanceField = DistanceField::None;
+    // Distance in pixels covered by a distance field on either side of the outline.
+    int spread = 4;
+    PackPadding padding = PackPadding::Full;
+    PackHeuristic heuristic = PackHeuristic::BottomLeft;
+    // Instead of packing, put every glyph into a cell of a fixed grid, by glyph id. Every page
+    // has the same size, and the map has no x, y and page, see MapData::Grid.
+    bool grid = false;
+    // Glyphs whose rendered bitmap is identical to one of an earlier glyph share its rect
+    // instead of being packed again. They still have their own metrics. Renders every glyph
+    // up front, like BuildSettings::singlePass.
+    bool dedup = false;
+    // Also export the kerning between every pair of glyphs in the atlas, see MapData::kerning.
+    bool kerning = false;
+    // Render every glyph at this many horizontal subpixel phases, 1 to 8, each shifted right
+    // by phase / subpixel pixels and packed as a glyph of its own. 1 renders every glyph once.
+    int subpixel = 1;
+    LcdLayout lcd = LcdLayout::None;
+    LcdFilter lcdFilter = LcdFilter::Default;
+};
+
+enum class AtlasStatus {
+    Ok,
+    // The options contradict each other or don't fit the font, like an unknown axis.
+    InvalidOptions,
+    // The font couldn't be opened or has no charmap.
+    InvalidFont,
+    // FreeType failed to load or render a glyph.
+    RenderFailed,
+    // A glyph is larger than the maximum page size.
+    PackFailed,
+    // A rendered bitmap can't be stored in its page.
+    BlitFailed,
+    // The page sink or a glyph cache file failed.
+    OutputFailed,
+};
+
+const char* AtlasStatusName(AtlasStatus status);
+
+using Clock = std::chrono::high_resolution_clock;
+
+inline double MsSince(Clock::time_point begin) {
+    return (double)std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - begin).count() / 1000.0;
+}
+
+// Wall time of consecutive stages, each one ends where the next begins.
+class StageTimes {
+    Clock::time_point m_lap = Clock::now();
+
+public:
+    std::vector<std::pair<std::string, double>> stages;
+
+    void Lap(const char* name) {
+        auto now = Clock::now();
+        stages.push_back({name, (double)std::chrono::duration_cast<std::chrono::microseconds>(now - m_lap).count() / 1000.0});
+        m_lap = now;
+    }
+    // Starts the next stage without recording the time since the last one.
+    void Skip() {
+        m_lap = Clock::now();
+    }
+};
+
+// Time one worker spent inside FreeType. Only measured with --stats.
+struct GlyphTimes {
+    double loadMs = 0;
+    double renderMs = 0;
+};
+
+// What --stats reports for one job.
+struct JobStats {
+    std::string outDir;
+    bool upToDate = false;
+    StageTimes times;
+    // Summed over all workers, so with --jobs these can add up to more than the wall time.
+    GlyphTimes glyphTimes;
+    size_t codepoints = 0;
+    size_t unmappedCodepoints = 0;
+    size_t uniqueGlyphs = 0;
+    size_t cachedGlyphs = 0;
+    size_t renderedGlyphs = 0;
+    size_t packedRects = 0;
+    // Rects on RGBA pages and on hot pages, included in packedRects.
+    size_t colorGlyphs = 0;
+    size_t hotGlyphs = 0;
+    // Glyphs that share the rect of an identical one, and the area their rects would have had.
+    size_t dedupedGlyphs = 0;
+    double dedupedArea = 0;
+    size_t packPasses = 0;
+    size_t pages = 0;
+    double rectArea = 0;
+    double atlasArea = 0;
+    std::vector<std::pair<std::string, uintmax_t>> outputBytes;
+};
+
+enum class MapField : uint32_t {
+    Width,
+    Height,
+    LeftBearing,
+    TopBearing,
+    Advance,
+    X,
+    Y,
+    Page,
+};
+
+const char* MapFieldName(MapField field);
+
+// Everything that goes into map.json / map.bin, in final form.
+struct MapData {
+    struct Page {
+        std::string file;
+        int width;
+        int height;
+        AtlasFormat format;
+    };
+    AtlasFormat format = AtlasFormat::GA8;
+    std::vector<Page> pages;
+    std::vector<MapField> fields;
+    // One column per field, each with a value for every glyph.
+    std::vector<std::vector<int32_t>> glyphs;
+    // Pairs of [codepoint, glyph id].
+    std::vector<std::pair<uint32_t, uint32_t>> codepoints;
+    // Only set with AtlasOptions::subpixel above 1. glyphs then has this many records per
+    // glyph id, glyph id G at phase p being record G * subpixel + p.
+    int32_t subpixel = 0;
+    // Number of leading pages that hold the hot glyphs, see AtlasOptions::hotGlyphs.
+    int32_t hotPages = 0;
+    // Only set for grid atlases. Glyph record N is on page N / (columns * rows), in cell
+    // i = N % (columns * rows), with its top left at (i % columns * cellWidth + padding,
+    // i / columns * cellHeight + padding).
+    struct Grid {
+        int32_t cellWidth = 0;
+        int32_t cellHeight = 0;
+        int32_t columns = 0;
+        int32_t rows = 0;
+        int32_t padding = 0;
+    };
+    Grid grid;
+    // Only set with AtlasOptions::kerning. Horizontal kerning in whole pixels to add to the
+    // advance of glyph id left when glyph id right follows it, sorted by left, then right.
+    // Pairs without kerning are left out.
+    struct KerningPair {
+        uint32_t left;
+        uint32_t right;
+        int32_t value;
+    };
+    std::vector<KerningPair> kerning;
+    int32_t ascender = 0;
+    int32_t descender = 0;
+    int32_t height = 0;
+    // Only written for distance field atlases. emSize is the pixel size they were rendered at.
+    DistanceField distanceField = DistanceField::None;
+    int32_t spread = 0;
+    int32_t emSize = 0;
+    // Only set in the delta of an append, where the pages are patches: the page and position
+    // every patch goes to, and the id of the first glyph in glyphs.
+    struct Patch {
+        int32_t page;
+        int32_t x;
+        int32_t y;
+    };
+    std::vector<Patch> patches;
+    int32_t firstGlyph = 0;
+};
+
+// File name of page (or patch) number page: prefix.png, prefix-1.png, prefix-2.png, ...
+std::string PageFileName(const char* prefix, size_t page);
+
+// Counts the codepoints of UTF-8 text into options.cpCounts and adds them to
+// options.cpRanges. Control characters, byte order marks and invalid bytes are skipped.
+// Returns how many distinct codepoints the text has.
+size_t AddTextCodepoints(std::string_view utf8, AtlasOptions& options);
+
+// The contents of map.json and map.bin, see README.md.
+std::string EncodeMapJson(const MapData& map);
+std::vector<uint8_t> EncodeMapBin(const MapData& map);
+// EncodeMapJson in pieces, for writing map.json while the glyphs are still being measured.
+// Begin, then Glyphs for every batch of glyphs in order, then End give the same text.
+class MapJsonEncoder {
+    std::vector<int32_t> m_last;
+    bool m_first = true;
+
+public:
+    // Everything before the glyph values. map.glyphs isn't used.
+    std::string Begin(const MapData& map);
+    // The values of the next glyphs, one column per field.
+    std::string Glyphs(const std::vector<std::vector<int32_t>>& columns);
+    // Codepoints and metrics.
+    std::string End(const MapData& map);
+};
+
+// Read map files written by EncodeMapJson/EncodeMapBin back. False if they are malformed.
+bool DecodeMapJson(std::string_view json, MapData& map);
+bool DecodeMapBin(const uint8_t* data, size_t size, MapData& map);
+
+// Receives the finished pages of an atlas, one after the other. Without streaming a page
+// arrives in a single WriteRows call, with it a band of rows at a time.
+class AtlasPageSink {
+public:
+    virtual ~AtlasPageSink() = default;
+    virtual bool BeginPage(size_t page, int width, int height, AtlasFormat format) = 0;
+    // The next count rows of the page, pitch bytes apart.
+    virtual bool WriteRows(const uint8_t* rows, size_t count, size_t pitch) = 0;
+    virtual bool EndPage() = 0;
+};
+
+class MetricsSink;
+class MappedFile;
+class FontInstance;
+struct CodepointTable;
+struct BuildSettings;
+struct AtlasAppend;
+class GlyphCache;
+
+// A font opened once per worker thread, FreeType faces can't be shared between threads.
+// Worker 0 uses the library passed to Open (or its own when that is null), every other
+// worker gets its own library. Only one BuildAtlas call can use a font at a time.
+// faceIndex picks the font of a collection (.ttc/.otc), namedInstance one of the named
+// instances of a variable font, starting at 1, 0 for none.
+class AtlasFont {
+    // Font bytes for fonts opened from memory, FreeType reads them for as long as the faces live.
+    std::shared_ptr<const std::vector<uint8_t>> m_data;
+    // Fonts opened from a file are mapped instead, every face of every font opened from the
+    // same file reads the same mapping. Null if the file couldn't be mapped.
+    std::shared_ptr<const MappedFile> m_mapping;
+    std::vector<std::unique_ptr<FontInstance>> m_instances;
+    std::unique_ptr<CodepointTable> m_cpTable;
+    std::mutex m_mutex;
+
+    AtlasStatus Open(FT_Library ft, const char* path, size_t workers, int faceIndex, int namedInstance);
+
+    friend AtlasStatus BuildAtlas(AtlasFont& font, const BuildSettings& settings, const AtlasOptions& options, AtlasPageSink& sink, MapData& map, JobStats& stats, AtlasAppend* append);
+    friend AtlasStatus BuildMetrics(AtlasFont& font, const BuildSettings& settings, const AtlasOptions& options, MetricsSink& sink, JobStats& stats);
+    friend class AtlasFontCache;
+    friend class LiveAtlas;
+
+public:
+    AtlasFont();
+    AtlasFont(const AtlasFont&) = delete;
+    AtlasFont& operator=(const AtlasFont&) = delete;
+    ~AtlasFont();
+
+    static AtlasStatus OpenFile(FT_Library ft, const char* path, size_t workers, std::unique_ptr<AtlasFont>& font, int faceIndex = 0, int namedInstance = 0);
+    static AtlasStatus OpenMemory(FT_Library ft, std::shared_ptr<const std::vector<uint8_t>> data, size_t workers, std::unique_ptr<AtlasFont>& font);
+
+    FT_Face Face() const;
+    size_t Workers() const { return m_instances.size(); }
+};
+
+// Fonts opened from memory, keyed by a hash of their bytes, and fonts opened from files,
+// keyed by path, face index and named instance, so repeated requests for the same font don't
+// open it again. Safe to use from several threads. When a library is passed in, it is shared
+// by worker 0 of every font. Distance field builds set their spread on that library, so
+// builds with different spreads shouldn't run at the same time then.
+class AtlasFontCache {
+    FT_Library m_ft;
+    size_t m_workers;
+    std::mutex m_mutex;
+    std::unordered_map<uint64_t, std::shared_ptr<AtlasFont>> m_fonts;
+    struct FileEntry {
+        std::shared_ptr<AtlasFont> font;
+        // Tells whether a file that couldn't be mapped changed, since there is no mapping
+        // to compare.
+        std::filesystem::file_time_type writeTime;
+        uintmax_t size = 0;
+    };
+    std::unordered_map<std::string, FileEntry> m_files;
+
+public:
+    explicit AtlasFontCache(FT_Library ft = nullptr, size_t workers = 1) : m_ft(ft), m_workers(workers) {}
+
+    AtlasStatus Get(const uint8_t* data, size_t size, std::shared_ptr<AtlasFont>& font);
+    // A file that changed since it was opened is opened again.
+    AtlasStatus GetFile(const char* path, int faceIndex, int namedInstance, std::shared_ptr<AtlasFont>& font);
+    void Clear();
+};
+
+// How BuildAtlas works, as opposed to what it builds.
+struct BuildSettings {
+    // Render every glyph once and keep its bitmap until it is blitted.
+    bool singlePass = false;
+    // Hand the pages to the sink a band of rows at a time instead of building them whole.
+    bool stream = false;
+    // Directory of the on-disk glyph cache, empty for none. fontHash is part of its key.
+    std::string glyphCacheDir;
+    uint64_t fontHash = 0;
+    // Also time every FreeType call.
+    bool stats = false;
+    // Print progress (glyph, packing and cache counts). Errors are always printed.
+    bool verbose = true;
+};
+
+// Key of everything that affects how a glyph is rendered. color is false for builds that
+// flatten color glyphs to gray, like --grid and LiveAtlas.
+uint64_t GlyphCacheKey(uint64_t fontHash, const AtlasOptions& options, bool color);
+
+// One page of an atlas built in memory.
+struct AtlasBitmap {
+    int width = 0;
+    int height = 0;
+    AtlasFormat format = AtlasFormat::GA8;
+    size_t pitch = 0;
+    std::vector<uint8_t> pixels;
+};
+
+// Adds glyphs to an atlas that was built before, see --append. Glyphs already in the base
+// keep their id and position. New glyphs go into the free space below the skyline of the
+// base pages (hot pages excepted) and onto new pages after them when there isn't enough.
+struct AtlasAppend {
+    MapData baseMap;
+    // Pixels of every page of baseMap, in its format.
+    std::vector<AtlasBitmap> basePages;
+    // Receives the patches: for every page that changed, the rect holding its new glyphs.
+    AtlasPageSink* patchSink = nullptr;
+    // Filled in with the new glyphs, the new codepoints and the patches (patch.png,
+    // patch-1.png, ...) as pages.
+    MapData delta;
+};
+
+// Renders, packs and blits one atlas and passes its pages to the sink. map is filled in
+// with page files named atlas.png, atlas-1.png, ... With append, only the glyphs missing
+// from its base are rendered and the pages are built on top of the base pages.
+AtlasStatus BuildAtlas(AtlasFont& font, const BuildSettings& settings, const AtlasOptions& options, AtlasPageSink& sink, MapData& map, JobStats& stats, AtlasAppend* append = nullptr);
+
+// Receives the glyph metrics of BuildMetrics. Without streaming every glyph arrives in a
+// single WriteGlyphs call, with it a batch of consecutive glyphs at a time.
+class MetricsSink {
+public:
+    virtual ~MetricsSink() = default;
+    // map is complete but for the glyph values: fields, codepoints, kerning and font metrics.
+    virtual bool Begin(const MapData& map) = 0;
+    // The values of the next glyphs, one column per field.
+    virtual bool WriteGlyphs(const std::vector<std::vector<int32_t>>& columns) = 0;
+    virtual bool End() = 0;
+};
+
+// Measures the glyphs an atlas would hold without rasterizing or packing them, see
+// --metrics-only. The map has no pages and only the width, height, leftBearing, topBearing
+// and advance fields, with the same values the atlas would have.
+AtlasStatus BuildMetrics(AtlasFont& font, const BuildSettings& settings, const AtlasOptions& options, MetricsSink& sink, JobStats& stats);
+
+struct AtlasResult {
+    std::vector<AtlasBitmap> pages;
+    MapData map;
+};
+
+// Builds an atlas from font bytes without touching the disk. With a cache the font stays
+// open for the next call, without one it is opened and closed again.
+AtlasStatus BuildAtlas(const uint8_t* fontData, size_t fontSize, const AtlasOptions& options, AtlasResult& result, AtlasFontCache* cache = nullptr);
+
+// Where a LiveAtlas put one glyph. Metrics are in pixels like the map fields, x and y are
+// its top left on the page. Glyphs with nothing to draw have a zero size and position.
+struct LiveGlyph {
+    uint32_t codepoint;
+    FT_UInt glyphIndex;
+    int32_t page;
+    int32_t x;
+    int32_t y;
+    int32_t width;
+    int32_t height;
+    int32_t leftBearing;
+    int32_t topBearing;
+    int32_t advance;
+};
+
+// What one LiveAtlas::Request changed, for a client that keeps a copy of the pages.
+struct LiveUpdate {
+    // Every requested codepoint the font maps, in request order without duplicates.
+    std::vector<LiveGlyph> glyphs;
+    // Requested codepoints the font doesn't map.
+    std::vector<uint32_t> unmapped;
+    // Glyph indices that were evicted to make room. Their earlier placement is gone, the
+    // client has to request them again before drawing them. Requested glyphs that had to move
+    // are in here as well as in glyphs, with their new placement there.
+    std::vector<FT_UInt> evicted;
+    // Rects of the pages that changed, to copy over the client's pages in order. A page that
+    // was recycled is sent whole, so the pixels of its evicted glyphs are cleared as well.
+    struct Patch {
+        int32_t page;
+        int32_t x;
+        int32_t y;
+        AtlasBitmap bitmap;
+    };
+    std::vector<Patch> patches;
+    // New glyphs that were read from the glyph cache and that were rendered.
+    size_t cachedGlyphs = 0;
+    size_t renderedGlyphs = 0;
+};
+
+// An atlas that starts out empty and gets glyphs as they are requested, for fonts too large
+// to render whole, like CJK or emoji fonts behind a chat. It has a fixed number of pages of
+// options.maxPageW x options.maxPageH, so memory and the work per request don't depend on the
+// font. New glyphs are rendered on the font's workers and packed into the free space below
+// the skyline of the pages. When no page has room, the page used least recently is recycled:
+// its glyphs are evicted and it starts out empty again. Color glyphs are flattened to gray.
+// Requests wait for each other and for BuildAtlas calls on the same font.
+class LiveAtlas {
+    // A glyph in the atlas and the codepoints it was requested for.
+    struct Slot {
+        LiveGlyph glyph;
+        std::vector<uint32_t> codepoints;
+    };
+    struct Page {
+        AtlasBitmap bitmap;
+        // Lowest free row of every column, see PackIntoSkyline.
+        std::vector<int> skyline;
+        std::vector<FT_UInt> glyphs;
+        uint64_t lastUse = 0;
+    };
+
+    std::shared_ptr<AtlasFont> m_font;
+    AtlasOptions m_options;
+    std::vector<FT_Fixed> m_coords;
+    std::unordered_map<FT_UInt, Slot> m_glyphs;
+    std::vector<Page> m_pages;
+    MapData m_metrics;
+    std::unique_ptr<GlyphCache> m_glyphCache;
+    // Number of requests so far, pages remember the last one that used them.
+    uint64_t m_serial = 0;
+
+    LiveAtlas();
+
+public:
+    LiveAtlas(const LiveAtlas&) = delete;
+    LiveAtlas& operator=(const LiveAtlas&) = delete;
+    ~LiveAtlas();
+
+    // options.maxPageW and maxPageH are required and size every page. Codepoint lists, hot
+    // glyphs, grids, dedup, kerning and subpixel phases don't apply. With settings.glyphCacheDir
+    // set, bitmaps come from and go to the glyph cache of these options, see SaveCache.
+    static AtlasStatus Create(std::shared_ptr<AtlasFont> font, const BuildSettings& settings, const AtlasOptions& options, size_t pages, std::unique_ptr<LiveAtlas>& atlas);
+
+    // Makes sure every glyph of the codepoints is in the atlas and fills in the update. The
+    // pages the request needs are recycled last, and when it needs all of them its glyphs
+    // move instead of being evicted. PackFailed means they don't fit into the pages together
+    // (or one doesn't fit into a page at all). The update then still holds the glyphs placed,
+    // evicted and patched until then, so a client can keep its copy in sync.
+    AtlasStatus Request(const std::vector<uint32_t>& codepoints, LiveUpdate& update);
+
+    // Every page as it is now. They change with every Request.
+    std::vector<const AtlasBitmap*> Pages() const;
+    // The glyphs in the atlas as a map, with page files named atlas.png, atlas-1.png, ...
+    // for EncodeMapJson and EncodeMapBin. Glyph ids follow glyph index order.
+    MapData Snapshot() const;
+    // Writes the glyphs rendered so far to the glyph cache file, if there is one. Not done by
+    // Request, since it rewrites the whole file. Color glyphs are stored flattened, in the
+    // entries --grid uses.
+    bool SaveCache();
+};
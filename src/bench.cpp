@@ -0,0 +1,417 @@
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <filesystem>
+#include <memory>
+#include <fstream>
+#include <iterator>
+#include <thread>
+#include <algorithm>
+
+#include <png.h>
+#include "atlasgen.hpp"
+#include "defer.hpp"
+#include "json.hpp"
+#include "png_writer.hpp"
+
+// atlasgen_bench builds every atlas of a fixed corpus a number of times and reports the
+// min, median and 95th percentile of every stage, see README.md. The fonts aren't part of
+// the repository, they are looked up by file name in --fonts.
+
+namespace {
+
+struct BenchFont {
+    const char* name;
+    const char* file;
+    std::vector<int> sizes;
+    // Empty means every codepoint of the font.
+    std::vector<std::pair<uint32_t, uint32_t>> cpRanges;
+    std::vector<std::pair<const char*, double>> axes;
+};
+
+const BenchFont CORPUS[] = {
+    // Latin text font: Basic Latin through Latin Extended-B.
+    {"latin", "NotoSans-Regular.ttf", {12, 16, 32, 64}, {{32, 591}}, {}},
+    // Variable font away from its default instance.
+    {"variable", "NotoSans[wdth,wght].ttf", {16, 48}, {{32, 591}}, {{"Weight", 700}, {"Width", 75}}},
+    // Large CJK font: ASCII plus every CJK Unified Ideograph.
+    {"cjk", "NotoSansCJKsc-Regular.otf", {16, 32}, {{32, 126}, {0x4E00, 0x9FFF}}, {}},
+    // Color emoji (CBDT), scaled from its bitmap strike.
+    {"emoji", "NotoColorEmoji.ttf", {32, 64}, {}, {}},
+};
+
+// In pipeline order. cmap is the enumeration of the requested codepoints and the glyph
+// dedup, render is FT_Load_Glyph + FT_Render_Glyph of every glyph.
+const char* const STAGES[] = {"fontOpen", "cmap", "render", "pack", "blit", "png", "map"};
+const size_t NUM_STAGES = std::size(STAGES);
+
+// Name of each stage in JobStats::times, null for stages measured here.
+const char* const BUILD_STAGES[] = {nullptr, "setup", "render", "pack", "blit", nullptr, nullptr};
+
+// Medians that moved by less than this are noise, whatever the percentage.
+const int64_t MIN_REGRESSION_US = 100;
+
+struct StageSummary {
+    int64_t minUs = 0;
+    int64_t medianUs = 0;
+    int64_t p95Us = 0;
+};
+
+struct CaseResult {
+    std::string name;
+    std::string font;
+    int size = 0;
+    size_t glyphs = 0;
+    size_t pages = 0;
+    StageSummary stages[NUM_STAGES];
+};
+
+// Keeps every page whole, the sink of a non-streamed build gets each one in one call.
+class BenchPageSink : public AtlasPageSink {
+    std::vector<AtlasBitmap>& m_pages;
+
+public:
+    explicit BenchPageSink(std::vector<AtlasBitmap>& pages) : m_pages(pages) {}
+
+    bool BeginPage(size_t, int width, int height, AtlasFormat format) override {
+        AtlasBitmap& page = m_pages.emplace_back();
+        page.width = width;
+        page.height = height;
+        page.format = format;
+        page.pitch = AtlasPitch(format, width);
+        return true;
+    }
+
+    bool WriteRows(const uint8_t* rows, size_t count, size_t pitch) override {
+        AtlasBitmap& page = m_pages.back();
+        if (pitch != page.pitch) {
+            return false;
+        }
+        page.pixels.insert(page.pixels.end(), rows, rows + count * pitch);
+        return true;
+    }
+
+    bool EndPage() override {
+        return m_pages.back().pixels.size() == m_pages.back().pitch * m_pages.back().height;
+    }
+};
+
+// Same PNG layout as the atlasgen pages.
+void PagePngType(AtlasFormat format, int& bitDepth, int& colorType) {
+    bitDepth = format == AtlasFormat::A1 ? 1 : 8;
+    switch (format) {
+    case AtlasFormat::GA8: colorType = PNG_COLOR_TYPE_GRAY_ALPHA; break;
+    case AtlasFormat::A8: colorType = PNG_COLOR_TYPE_GRAY; break;
+    case AtlasFormat::A1: colorType = PNG_COLOR_TYPE_GRAY; break;
+    case AtlasFormat::RGB8: colorType = PNG_COLOR_TYPE_RGB; break;
+    case AtlasFormat::RGBA8: colorType = PNG_COLOR_TYPE_RGBA; break;
+    }
+}
+
+bool WriteFile(const std::filesystem::path& path, const void* data, size_t size) {
+    std::ofstream f{path, std::ios::binary};
+    if (!f.is_open()) {
+        return false;
+    }
+    f.write((const char*)data, size);
+    return !f.fail();
+}
+
+StageSummary Summarize(std::vector<double> samples) {
+    std::sort(samples.begin(), samples.end());
+    auto us = [](double ms) { return (int64_t)llround(ms * 1000.0); };
+    StageSummary summary;
+    summary.minUs = us(samples.front());
+    summary.medianUs = us(samples[samples.size() / 2]);
+    // Nearest rank.
+    size_t rank = (size_t)ceil(samples.size() * 0.95);
+    summary.p95Us = us(samples[std::max<size_t>(rank, 1) - 1]);
+    return summary;
+}
+
+// One build of one case. With times, the time of every stage is appended to it.
+bool RunCase(FT_Library ft, const std::filesystem::path& fontPath, const AtlasOptions& options, size_t jobs,
+        const std::filesystem::path& tmpDir, std::vector<double>* times, CaseResult& result) {
+    auto openBegin = Clock::now();
+    std::unique_ptr<AtlasFont> font;
+    if (AtlasFont::OpenFile(ft, fontPath.string().c_str(), jobs, font) != AtlasStatus::Ok) {
+        return false;
+    }
+    double openMs = MsSince(openBegin);
+
+    // Single pass, so rendering is a stage of its own instead of happening during the blit.
+    BuildSettings settings;
+    settings.singlePass = true;
+    settings.verbose = false;
+    std::vector<AtlasBitmap> pages;
+    BenchPageSink sink{pages};
+    MapData map;
+    JobStats stats;
+    if (AtlasStatus status = BuildAtlas(*font, settings, options, sink, map, stats); status != AtlasStatus::Ok) {
+        printf("Building %s failed: %s\n", result.name.c_str(), AtlasStatusName(status));
+        return false;
+    }
+
+    auto pngBegin = Clock::now();
+    PngOptions png;
+    png.threads = jobs;
+    for (size_t i = 0; i < pages.size(); ++i) {
+        int bitDepth = 8, colorType = 0;
+        PagePngType(pages[i].format, bitDepth, colorType);
+        auto path = tmpDir / PageFileName("atlas", i);
+        if (!WritePng(path.string().c_str(), pages[i].width, pages[i].height, bitDepth, colorType, pages[i].pixels.data(), pages[i].pitch, png)) {
+            printf("Failed to write PNG file %s\n", path.string().c_str());
+            return false;
+        }
+    }
+    double pngMs = MsSince(pngBegin);
+
+    auto mapBegin = Clock::now();
+    std::vector<uint8_t> bin = EncodeMapBin(map);
+    std::string json = EncodeMapJson(map);
+    if (!WriteFile(tmpDir / "map.bin", bin.data(), bin.size()) || !WriteFile(tmpDir / "map.json", json.data(), json.size())) {
+        printf("Failed to write map to %s\n", tmpDir.string().c_str());
+        return false;
+    }
+    double mapMs = MsSince(mapBegin);
+
+    result.glyphs = stats.uniqueGlyphs;
+    result.pages = pages.size();
+    if (!times) {
+        return true;
+    }
+    for (size_t stage = 0; stage < NUM_STAGES; ++stage) {
+        double ms = 0;
+        if (stage == 0) {
+            ms = openMs;
+        } else if (BUILD_STAGES[stage]) {
+            for (auto& [name, stageMs] : stats.times.stages) {
+                if (name == BUILD_STAGES[stage]) {
+                    ms = stageMs;
+                }
+            }
+        } else {
+            ms = strcmp(STAGES[stage], "png") == 0 ? pngMs : mapMs;
+        }
+        times[stage].push_back(ms);
+    }
+    return true;
+}
+
+bool WriteResults(const char* path, size_t iterations, size_t jobs, const std::vector<CaseResult>& results) {
+    std::ofstream f{path};
+    if (!f.is_open()) {
+        return false;
+    }
+    f << "{\"version\":1,\"iterations\":" << iterations << ",\"jobs\":" << jobs << ",\"cases\":[";
+    for (size_t i = 0; i < results.size(); ++i) {
+        auto& result = results[i];
+        f << (i == 0 ? "" : ",") << "{\"name\":\"" << result.name << "\",\"font\":\"" << result.font << "\"";
+        f << ",\"size\":" << result.size << ",\"glyphs\":" << result.glyphs << ",\"pages\":" << result.pages;
+        f << ",\"stages\":{";
+        for (size_t stage = 0; stage < NUM_STAGES; ++stage) {
+            auto& summary = result.stages[stage];
+            f << (stage == 0 ? "" : ",") << '"' << STAGES[stage] << "\":{\"minUs\":" << summary.minUs;
+            f << ",\"medianUs\":" << summary.medianUs << ",\"p95Us\":" << summary.p95Us << '}';
+        }
+        f << "}}";
+    }
+    f << "]}\n";
+    f.close();
+    return !f.fail();
+}
+
+// Compares the medians against an earlier --out. Returns the number of regressions, or -1
+// if the baseline can't be read.
+int CompareBaseline(const char* path, const std::vector<CaseResult>& results, int thresholdPercent) {
+    std::ifstream f{path, std::ios::binary};
+    if (!f.is_open()) {
+        printf("Failed to open baseline %s\n", path);
+        return -1;
+    }
+    std::string text{std::istreambuf_iterator<char>{f}, std::istreambuf_iterator<char>{}};
+    JsonValue root;
+    JsonReader reader{text};
+    const JsonValue* cases = nullptr;
+    if (reader.Read(root) && reader.AtEnd() && root.type == JsonValue::Object) {
+        cases = root.Find("cases");
+    }
+    if (!cases || cases->type != JsonValue::Array) {
+        printf("%s is not a bench result\n", path);
+        return -1;
+    }
+
+    int regressions = 0;
+    for (auto& result : results) {
+        const JsonValue* stages = nullptr;
+        for (auto& item : cases->items) {
+            const JsonValue* name = item.Find("name");
+            if (name && name->string == result.name) {
+                stages = item.Find("stages");
+            }
+        }
+        if (!stages) {
+            printf("%s is not in the baseline\n", result.name.c_str());
+            continue;
+        }
+        for (size_t stage = 0; stage < NUM_STAGES; ++stage) {
+            const JsonValue* summary = stages->Find(STAGES[stage]);
+            const JsonValue* median = summary ? summary->Find("medianUs") : nullptr;
+            if (!median || median->type != JsonValue::Number) {
+                continue;
+            }
+            const int64_t before = median->number;
+            const int64_t now = result.stages[stage].medianUs;
+            if (now - before >= MIN_REGRESSION_US && now * 100 > before * (100 + thresholdPercent)) {
+                printf("Regression: %s %s median %.3f ms -> %.3f ms\n", result.name.c_str(), STAGES[stage], before / 1000.0, now / 1000.0);
+                ++regressions;
+            }
+        }
+    }
+    return regressions;
+}
+
+void PrintHelp() {
+    printf(
+        "atlasgen_bench --fonts <folder>\n"
+        "Optional:\n"
+        "  --iterations <int>  = Timed builds of every case. Default is 10.\n"
+        "  --jobs <int>        = Rendering and PNG threads. 0 uses every core. Default is 1.\n"
+        "  --only <name>       = Only run the cases of this corpus font (latin, variable, cjk,\n"
+        "                        emoji). Can be given more than once.\n"
+        "  --out <file>        = Where to write the results. Default is bench.json.\n"
+        "  --baseline <file>   = Compare the medians against an earlier --out and exit with 1\n"
+        "                        when a stage got slower by more than --threshold.\n"
+        "  --threshold <int>   = Allowed slowdown in percent. Default is 10.\n"
+    );
+}
+
+}
+
+int main(int argc, char** argv) {
+    std::filesystem::path fontsDir;
+    const char* outPath = "bench.json";
+    const char* baselinePath = nullptr;
+    size_t iterations = 10;
+    size_t jobs = 1;
+    int thresholdPercent = 10;
+    std::vector<std::string_view> only;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string_view flag = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : nullptr;
+        if (flag == "--help") {
+            PrintHelp();
+            return 0;
+        } else if (!value) {
+            printf("Unknown flag or missing value: %s\n", argv[i]);
+            return -1;
+        }
+        ++i;
+        if (flag == "--fonts") {
+            fontsDir = value;
+        } else if (flag == "--iterations") {
+            iterations = std::max(1, atoi(value));
+        } else if (flag == "--jobs") {
+            jobs = (size_t)std::max(0, atoi(value));
+            if (jobs == 0) {
+                jobs = std::max(1u, std::thread::hardware_concurrency());
+            }
+        } else if (flag == "--only") {
+            only.push_back(value);
+        } else if (flag == "--out") {
+            outPath = value;
+        } else if (flag == "--baseline") {
+            baselinePath = value;
+        } else if (flag == "--threshold") {
+            thresholdPercent = std::max(0, atoi(value));
+        } else {
+            printf("Unknown flag: %s\n", argv[i - 1]);
+            return -1;
+        }
+    }
+    if (fontsDir.empty()) {
+        PrintHelp();
+        return -1;
+    }
+
+    FT_Library ft;
+    if (FT_Error err = FT_Init_FreeType(&ft)) {
+        printf("FT_Error %d (%s)\n", err, FT_Error_String(err));
+        return -1;
+    }
+    defer { FT_Done_FreeType(ft); };
+
+    std::error_code err;
+    auto tmpDir = std::filesystem::temp_directory_path(err) / "atlasgen-bench";
+    std::filesystem::create_directories(tmpDir, err);
+    defer { std::filesystem::remove_all(tmpDir, err); };
+
+    std::vector<CaseResult> results;
+    for (const BenchFont& benchFont : CORPUS) {
+        if (!only.empty() && std::find(only.begin(), only.end(), benchFont.name) == only.end()) {
+            continue;
+        }
+        auto fontPath = fontsDir / benchFont.file;
+        if (!std::filesystem::exists(fontPath, err)) {
+            printf("Skipping %s, %s not found\n", benchFont.name, fontPath.string().c_str());
+            continue;
+        }
+        for (int size : benchFont.sizes) {
+            CaseResult result;
+            result.name = std::string{benchFont.name} + "-" + std::to_string(size);
+            result.font = benchFont.file;
+            result.size = size;
+            AtlasOptions options;
+            options.size = size;
+            options.cpRanges = benchFont.cpRanges;
+            for (auto [axis, value] : benchFont.axes) {
+                options.axes[axis] = (FT_Fixed)(value * (1 << 16));
+            }
+
+            // The first build warms the file cache and the allocator and isn't counted.
+            std::vector<double> times[NUM_STAGES];
+            if (!RunCase(ft, fontPath, options, jobs, tmpDir, nullptr, result)) {
+                return -1;
+            }
+            for (size_t i = 0; i < iterations; ++i) {
+                if (!RunCase(ft, fontPath, options, jobs, tmpDir, times, result)) {
+                    return -1;
+                }
+            }
+            printf("%-12s %6zu glyphs %3zu page(s)\n", result.name.c_str(), result.glyphs, result.pages);
+            for (size_t stage = 0; stage < NUM_STAGES; ++stage) {
+                result.stages[stage] = Summarize(times[stage]);
+                auto& summary = result.stages[stage];
+                printf("  %-10s min %10.3f ms  median %10.3f ms  p95 %10.3f ms\n",
+                    STAGES[stage], summary.minUs / 1000.0, summary.medianUs / 1000.0, summary.p95Us / 1000.0);
+            }
+            results.push_back(std::move(result));
+        }
+    }
+    if (results.empty()) {
+        printf("No corpus font found in %s\n", fontsDir.string().c_str());
+        return -1;
+    }
+
+    if (!WriteResults(outPath, iterations, jobs, results)) {
+        printf("Failed to write results to %s\n", outPath);
+        return -1;
+    }
+    if (baselinePath) {
+        int regressions = CompareBaseline(baselinePath, results, thresholdPercent);
+        if (regressions < 0) {
+            return -1;
+        }
+        if (regressions > 0) {
+            printf("%d regression(s) against %s\n", regressions, baselinePath);
+            return 1;
+        }
+        printf("No regressions against %s\n", baselinePath);
+    }
+    return 0;
+}
@@ -0,0 +1,279 @@
+#include "blit.hpp"
+
+#include <atomic>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define BLIT_X64 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define BLIT_NEON 1
+#include <arm_neon.h>
+#endif
+
+// MSVC compiles AVX2 intrinsics anywhere, GCC and Clang need the function marked.
+#if defined(BLIT_X64) && (defined(__GNUC__) || defined(__clang__))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_AVX2
+#endif
+
+namespace {
+
+struct ExpandTable {
+    // 8 output bytes for every value of a mono byte.
+    uint64_t bytes[256];
+    // Bit-reversed bytes, movemask produces bits LSB first.
+    uint8_t reversed[256];
+
+    ExpandTable() {
+        for (int v = 0; v < 256; ++v) {
+            uint8_t out[8];
+            uint8_t rev = 0;
+            for (int bit = 0; bit < 8; ++bit) {
+                out[bit] = (v & (0x80 >> bit)) ? 0xFF : 0;
+                rev |= ((v >> bit) & 1) << (7 - bit);
+            }
+            memcpy(&bytes[v], out, 8);
+            reversed[v] = rev;
+        }
+    }
+};
+const ExpandTable table;
+
+#ifdef BLIT_X64
+struct InterleaveTable {
+    // pshufb masks for 16 pixels of three channels: byte j of output vector v takes byte
+    // masks[v][c][j] of channel c, 0x80 zeroes it.
+    alignas(16) uint8_t masks[3][3][16];
+
+    InterleaveTable() {
+        for (int v = 0; v < 3; ++v) {
+            for (int j = 0; j < 16; ++j) {
+                const int byte = v * 16 + j;
+                for (int c = 0; c < 3; ++c) {
+                    masks[v][c][j] = byte % 3 == c ? (uint8_t)(byte / 3) : 0x80;
+                }
+            }
+        }
+    }
+};
+const InterleaveTable interleave;
+#endif
+
+void GrayToGAScalar(uint8_t* dst, const uint8_t* src, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        dst[i*2] = 0xFF;
+        dst[i*2 + 1] = src[i];
+    }
+}
+
+void MonoToGray(uint8_t* dst, const uint8_t* src, size_t count) {
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        memcpy(&dst[i], &table.bytes[src[i / 8]], 8);
+    }
+    if (i < count) {
+        memcpy(&dst[i], &table.bytes[src[i / 8]], count - i);
+    }
+}
+
+void GrayToMonoScalar(uint8_t* dst, const uint8_t* src, size_t count) {
+    for (size_t i = 0; i < count; i += 8) {
+        uint8_t bits = 0;
+        for (size_t bit = 0; bit < 8 && i + bit < count; ++bit) {
+            bits |= (src[i + bit] >> 7) << (7 - bit);
+        }
+        dst[i / 8] = bits;
+    }
+}
+
+void InterleaveRGBScalar(uint8_t* dst, const uint8_t* r, const uint8_t* g, const uint8_t* b, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        dst[i*3] = r[i];
+        dst[i*3 + 1] = g[i];
+        dst[i*3 + 2] = b[i];
+    }
+}
+
+#ifdef BLIT_X64
+void GrayToGASse2(uint8_t* dst, const uint8_t* src, size_t count) {
+    const __m128i gray = _mm_set1_epi8((char)0xFF);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)&src[i]);
+        _mm_storeu_si128((__m128i*)&dst[i*2], _mm_unpacklo_epi8(gray, v));
+        _mm_storeu_si128((__m128i*)&dst[i*2 + 16], _mm_unpackhi_epi8(gray, v));
+    }
+    GrayToGAScalar(&dst[i*2], &src[i], count - i);
+}
+
+void GrayToMonoSse2(uint8_t* dst, const uint8_t* src, size_t count) {
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)&src[i]));
+        dst[i / 8] = table.reversed[mask & 0xFF];
+        dst[i / 8 + 1] = table.reversed[mask >> 8];
+    }
+    GrayToMonoScalar(&dst[i / 8], &src[i], count - i);
+}
+
+TARGET_AVX2 void GrayToGAAvx2(uint8_t* dst, const uint8_t* src, size_t count) {
+    const __m256i gray = _mm256_set1_epi8((char)0xFF);
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        // unpack works within 128-bit lanes, so reorder the qwords to 0, 2, 1, 3 first: the
+        // low lane gets source bytes 0-7 and 16-23, the high lane 8-15 and 24-31. unpacklo then
+        // widens bytes 0-15 and unpackhi bytes 16-31.
+        __m256i v = _mm256_permute4x64_epi64(_mm256_loadu_si256((const __m256i*)&src[i]), 0xD8);
+        _mm256_storeu_si256((__m256i*)&dst[i*2], _mm256_unpacklo_epi8(gray, v));
+        _mm256_storeu_si256((__m256i*)&dst[i*2 + 32], _mm256_unpackhi_epi8(gray, v));
+    }
+    GrayToGASse2(&dst[i*2], &src[i], count - i);
+}
+
+TARGET_AVX2 void GrayToMonoAvx2(uint8_t* dst, const uint8_t* src, size_t count) {
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_loadu_si256((const __m256i*)&src[i]));
+        for (int b = 0; b < 4; ++b) {
+            dst[i / 8 + b] = table.reversed[(mask >> (b * 8)) & 0xFF];
+        }
+    }
+    GrayToMonoSse2(&dst[i / 8], &src[i], count - i);
+}
+
+// SSE2 has no byte shuffle, pshufb comes with SSSE3, which every AVX2 CPU has.
+TARGET_AVX2 void InterleaveRGBAvx2(uint8_t* dst, const uint8_t* r, const uint8_t* g, const uint8_t* b, size_t count) {
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        const __m128i channels[3] = {
+            _mm_loadu_si128((const __m128i*)&r[i]),
+            _mm_loadu_si128((const __m128i*)&g[i]),
+            _mm_loadu_si128((const __m128i*)&b[i]),
+        };
+        for (int v = 0; v < 3; ++v) {
+            __m128i out = _mm_setzero_si128();
+            for (int c = 0; c < 3; ++c) {
+                out = _mm_or_si128(out, _mm_shuffle_epi8(channels[c], _mm_load_si128((const __m128i*)interleave.masks[v][c])));
+            }
+            _mm_storeu_si128((__m128i*)&dst[i*3 + v*16], out);
+        }
+    }
+    InterleaveRGBScalar(&dst[i*3], &r[i], &g[i], &b[i], count - i);
+}
+
+bool HasAvx2() {
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) {
+        return false;
+    }
+    // AVX registers have to be enabled by the OS as well.
+    __cpuid(info, 1);
+    const int osxsaveAvx = (1 << 27) | (1 << 28);
+    if ((info[2] & osxsaveAvx) != osxsaveAvx || (_xgetbv(0) & 6) != 6) {
+        return false;
+    }
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+#ifdef BLIT_NEON
+void GrayToGANeon(uint8_t* dst, const uint8_t* src, size_t count) {
+    size_t i = 0;
+    uint8x16x2_t ga;
+    ga.val[0] = vdupq_n_u8(0xFF);
+    for (; i + 16 <= count; i += 16) {
+        ga.val[1] = vld1q_u8(&src[i]);
+        vst2q_u8(&dst[i*2], ga);
+    }
+    GrayToGAScalar(&dst[i*2], &src[i], count - i);
+}
+
+void GrayToMonoNeon(uint8_t* dst, const uint8_t* src, size_t count) {
+    static const uint8_t weights[16] = {0x80, 0x40, 0x20, 0x10, 8, 4, 2, 1, 0x80, 0x40, 0x20, 0x10, 8, 4, 2, 1};
+    const uint8x16_t w = vld1q_u8(weights);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        // Spread the top bit over the byte, keep this pixel's bit and add up each half.
+        uint8x16_t set = vreinterpretq_u8_s8(vshrq_n_s8(vreinterpretq_s8_u8(vld1q_u8(&src[i])), 7));
+        uint8x16_t bits = vandq_u8(set, w);
+        dst[i / 8] = vaddv_u8(vget_low_u8(bits));
+        dst[i / 8 + 1] = vaddv_u8(vget_high_u8(bits));
+    }
+    GrayToMonoScalar(&dst[i / 8], &src[i], count - i);
+}
+
+void InterleaveRGBNeon(uint8_t* dst, const uint8_t* r, const uint8_t* g, const uint8_t* b, size_t count) {
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        uint8x16x3_t rgb;
+        rgb.val[0] = vld1q_u8(&r[i]);
+        rgb.val[1] = vld1q_u8(&g[i]);
+        rgb.val[2] = vld1q_u8(&b[i]);
+        vst3q_u8(&dst[i*3], rgb);
+    }
+    InterleaveRGBScalar(&dst[i*3], &r[i], &g[i], &b[i], count - i);
+}
+#endif
+
+BlitKernels SelectKernels() {
+#ifdef BLIT_X64
+    if (HasAvx2()) {
+        return {GrayToGAAvx2, MonoToGray, GrayToMonoAvx2, InterleaveRGBAvx2, "avx2"};
+    }
+    return {GrayToGASse2, MonoToGray, GrayToMonoSse2, InterleaveRGBScalar, "sse2"};
+#elif defined(BLIT_NEON)
+    return {GrayToGANeon, MonoToGray, GrayToMonoNeon, InterleaveRGBNeon, "neon"};
+#else
+    return {GrayToGAScalar, MonoToGray, GrayToMonoScalar, InterleaveRGBScalar, "scalar"};
+#endif
+}
+
+}
+
+const BlitKernels& GetBlitKernels() {
+    static const BlitKernels kernels = SelectKernels();
+    return kernels;
+}
+
+void MergeBitsRow(uint8_t* dstRow, size_t dstX, const uint8_t* src, size_t count) {
+    if (count == 0) {
+        return;
+    }
+    const unsigned shift = dstX % 8;
+    const size_t srcBytes = (count + 7) / 8;
+    // Bits past count in the last source byte are padding and may be set.
+    const uint8_t lastMask = (uint8_t)(0xFF << ((8 - count % 8) % 8));
+    auto srcByte = [&](size_t i) -> unsigned {
+        if (i >= srcBytes) {
+            return 0;
+        }
+        return i == srcBytes - 1 ? src[i] & lastMask : src[i];
+    };
+
+    uint8_t* dst = dstRow + dstX / 8;
+    const size_t lastByte = (shift + count - 1) / 8;
+    for (size_t j = 0; j <= lastByte; ++j) {
+        uint8_t bits = (uint8_t)(srcByte(j) >> shift);
+        if (j > 0 && shift != 0) {
+            bits |= (uint8_t)(srcByte(j - 1) << (8 - shift));
+        }
+        if (j == 0 || j == lastByte) {
+            if (bits != 0) {
+                std::atomic_ref<uint8_t>{dst[j]}.fetch_or(bits, std::memory_order_relaxed);
+            }
+        } else {
+            dst[j] |= bits;
+        }
+    }
+}
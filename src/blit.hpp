@@ -0,0 +1,26 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+// Row kernels for copying glyph bitmaps into the atlas. Bits are always MSB first, like
+// FT_PIXEL_MODE_MONO and 1-bit PNG rows.
+struct BlitKernels {
+    // dst[2i] = 0xFF, dst[2i+1] = src[i]: coverage into the alpha of a gray+alpha row.
+    void (*grayToGA)(uint8_t* dst, const uint8_t* src, size_t count);
+    // dst[i] = 0xFF where bit i of src is set, 0 elsewhere.
+    void (*monoToGray)(uint8_t* dst, const uint8_t* src, size_t count);
+    // Sets bit i of dst where src[i] >= 0x80. Writes (count+7)/8 bytes.
+    void (*grayToMono)(uint8_t* dst, const uint8_t* src, size_t count);
+    // dst[3i] = r[i], dst[3i+1] = g[i], dst[3i+2] = b[i]: three channel rows into an RGB row.
+    // Passing the same row three times spreads gray coverage over all subpixels.
+    void (*interleaveRGB)(uint8_t* dst, const uint8_t* r, const uint8_t* g, const uint8_t* b, size_t count);
+    const char* name;
+};
+
+// The fastest kernels the running CPU supports, picked on first use.
+const BlitKernels& GetBlitKernels();
+
+// ORs count bits of src (starting at its first bit) into dstRow starting at bit dstX.
+// The first and last byte can be shared with a neighbouring glyph that another thread is
+// blitting, so those are merged atomically.
+void MergeBitsRow(uint8_t* dstRow, size_t dstX, const uint8_t* src, size_t count);
@@ -0,0 +1,70 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+#include "defer.hpp"
+
+// Fast non-cryptographic 64-bit hash, only used to key caches.
+class Hasher {
+    uint64_t m_hash = 0x9E3779B97F4A7C15ull;
+
+    void Mix(uint64_t word) {
+        m_hash ^= word;
+        m_hash *= 0xFF51AFD7ED558CCDull;
+        m_hash ^= m_hash >> 32;
+    }
+
+public:
+    void Add(const void* data, size_t size) {
+        const uint8_t* bytes = (const uint8_t*)data;
+        size_t i = 0;
+        for (; i + 8 <= size; i += 8) {
+            uint64_t word;
+            memcpy(&word, &bytes[i], 8);
+            Mix(word);
+        }
+        uint64_t tail = 0;
+        memcpy(&tail, &bytes[i], size - i);
+        Mix(tail ^ ((uint64_t)size << 56));
+    }
+
+    template <class T>
+    void Add(const T& value) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        Add(&value, sizeof(value));
+    }
+
+    void Add(std::string_view str) {
+        Add(str.data(), str.size());
+    }
+
+    uint64_t Hash() const { return m_hash; }
+};
+
+inline std::optional<uint64_t> HashFile(const char* path) {
+    FILE* f = fopen(path, "rb");
+    if (!f) {
+        return {};
+    }
+    defer { fclose(f); };
+
+    Hasher hasher;
+    std::vector<uint8_t> chunk;
+    chunk.resize(1 << 20);
+    while (size_t read = fread(chunk.data(), 1, chunk.size(), f)) {
+        hasher.Add(chunk.data(), read);
+    }
+    return hasher.Hash();
+}
+
+inline std::string HexKey(uint64_t key) {
+    char str[17];
+    snprintf(str, sizeof(str), "%016llx", (unsigned long long)key);
+    return str;
+}
@@ -0,0 +1,123 @@
+#pragma once
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Just enough JSON to read map.json and bench results back: objects, arrays, strings
+// without escapes other than \" and \\, integers and true/false/null.
+struct JsonValue {
+    enum Type { Null, Bool, Number, String, Array, Object } type = Null;
+    int64_t number = 0;
+    std::string string;
+    std::vector<JsonValue> items;
+    std::vector<std::pair<std::string, JsonValue>> members;
+
+    const JsonValue* Find(std::string_view key) const {
+        for (auto& member : members) {
+            if (member.first == key) {
+                return &member.second;
+            }
+        }
+        return nullptr;
+    }
+};
+
+class JsonReader {
+    std::string_view m_text;
+    size_t m_pos = 0;
+
+    void SkipSpace() {
+        while (m_pos < m_text.size() && strchr(" \t\r\n", m_text[m_pos])) {
+            ++m_pos;
+        }
+    }
+
+    bool Consume(char ch) {
+        SkipSpace();
+        if (m_pos < m_text.size() && m_text[m_pos] == ch) {
+            ++m_pos;
+            return true;
+        }
+        return false;
+    }
+
+    bool ReadString(std::string& str) {
+        if (!Consume('"')) {
+            return false;
+        }
+        while (m_pos < m_text.size() && m_text[m_pos] != '"') {
+            if (m_text[m_pos] == '\\' && m_pos + 1 < m_text.size()) {
+                ++m_pos;
+            }
+            str += m_text[m_pos++];
+        }
+        return Consume('"');
+    }
+
+public:
+    explicit JsonReader(std::string_view text) : m_text(text) {}
+
+    // Nesting is bounded by the layouts read with it, so the recursion is too.
+    bool Read(JsonValue& value, int depth = 0) {
+        SkipSpace();
+        if (m_pos >= m_text.size() || depth > 8) {
+            return false;
+        }
+        char ch = m_text[m_pos];
+        if (ch == '{') {
+            value.type = JsonValue::Object;
+            ++m_pos;
+            if (Consume('}')) {
+                return true;
+            }
+            do {
+                auto& member = value.members.emplace_back();
+                if (!ReadString(member.first) || !Consume(':') || !Read(member.second, depth + 1)) {
+                    return false;
+                }
+            } while (Consume(','));
+            return Consume('}');
+        } else if (ch == '[') {
+            value.type = JsonValue::Array;
+            ++m_pos;
+            if (Consume(']')) {
+                return true;
+            }
+            do {
+                if (!Read(value.items.emplace_back(), depth + 1)) {
+                    return false;
+                }
+            } while (Consume(','));
+            return Consume(']');
+        } else if (ch == '"') {
+            value.type = JsonValue::String;
+            return ReadString(value.string);
+        } else if (m_text.substr(m_pos, 4) == "true" || m_text.substr(m_pos, 5) == "false") {
+            value.type = JsonValue::Bool;
+            value.number = ch == 't';
+            m_pos += ch == 't' ? 4 : 5;
+            return true;
+        } else if (m_text.substr(m_pos, 4) == "null") {
+            m_pos += 4;
+            return true;
+        }
+        value.type = JsonValue::Number;
+        const char* begin = m_text.data() + m_pos;
+        const char* end = m_text.data() + m_text.size();
+        auto result = std::from_chars(begin, end, value.number);
+        if (result.ec != std::errc{} || result.ptr == begin) {
+            return false;
+        }
+        m_pos += result.ptr - begin;
+        return true;
+    }
+
+    bool AtEnd() {
+        SkipSpace();
+        return m_pos == m_text.size();
+    }
+};
@@ -0,0 +1,307 @@
+#include "kerning.hpp"
+
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <freetype/tttables.h>
+#include <freetype/tttags.h>
+
+// GPOS is read the way shapers apply it to a pair of glyphs: every lookup of the 'kern'
+// feature adds its adjustment, and within a lookup the first subtable that applies wins. Only
+// the XAdvance of the first glyph is used, which is what horizontal kerning sets. Device and
+// variation tables are ignored, so variable fonts get the kerning of their default instance.
+
+namespace {
+
+// Big-endian reads from a font table. Reads past the end give 0, so a broken table ends up
+// as missing kerning instead of a crash.
+class TableReader {
+    const std::vector<uint8_t>& m_data;
+
+public:
+    explicit TableReader(const std::vector<uint8_t>& data) : m_data(data) {}
+
+    uint16_t U16(size_t offset) const {
+        return offset + 2 <= m_data.size() ? (uint16_t)(m_data[offset] << 8 | m_data[offset + 1]) : 0;
+    }
+    int16_t I16(size_t offset) const { return (int16_t)U16(offset); }
+    uint32_t U32(size_t offset) const { return (uint32_t)U16(offset) << 16 | U16(offset + 2); }
+};
+
+bool LoadTable(FT_Face face, FT_ULong tag, std::vector<uint8_t>& data) {
+    FT_ULong length = 0;
+    if (FT_Load_Sfnt_Table(face, tag, 0, nullptr, &length) != FT_Err_Ok || length == 0) {
+        return false;
+    }
+    data.resize(length);
+    return FT_Load_Sfnt_Table(face, tag, 0, data.data(), &length) == FT_Err_Ok;
+}
+
+const uint32_t NOT_PRESENT = UINT32_MAX;
+
+uint64_t PairKey(uint32_t left, uint32_t right) {
+    return (uint64_t)left << 32 | right;
+}
+
+// Calls fn(glyphIndex, coverageIndex) for every glyph of a coverage table.
+template <typename Fn>
+void ForEachCovered(const TableReader& t, size_t offset, Fn&& fn) {
+    const uint16_t format = t.U16(offset);
+    const uint16_t count = t.U16(offset + 2);
+    if (format == 1) {
+        for (uint16_t i = 0; i < count; ++i) {
+            fn((FT_UInt)t.U16(offset + 4 + (size_t)i * 2), (uint32_t)i);
+        }
+    } else if (format == 2) {
+        for (uint16_t i = 0; i < count; ++i) {
+            const size_t at = offset + 4 + (size_t)i * 6;
+            const uint32_t first = t.U16(at);
+            const uint32_t last = t.U16(at + 2);
+            const uint32_t startIndex = t.U16(at + 4);
+            for (uint32_t glyph = first; glyph <= last; ++glyph) {
+                fn((FT_UInt)glyph, startIndex + glyph - first);
+            }
+        }
+    }
+}
+
+// Class of a glyph in a class definition table, 0 for glyphs it doesn't list.
+uint16_t ClassOf(const TableReader& t, size_t offset, FT_UInt glyph) {
+    const uint16_t format = t.U16(offset);
+    if (format == 1) {
+        const uint32_t start = t.U16(offset + 2);
+        const uint32_t count = t.U16(offset + 4);
+        return glyph >= start && glyph - start < count ? t.U16(offset + 6 + (size_t)(glyph - start) * 2) : 0;
+    }
+    if (format == 2) {
+        // Ranges are sorted by glyph.
+        size_t lo = 0, hi = t.U16(offset + 2);
+        while (lo < hi) {
+            const size_t mid = (lo + hi) / 2;
+            const size_t at = offset + 4 + mid * 6;
+            if (glyph < t.U16(at)) {
+                hi = mid;
+            } else if (glyph > t.U16(at + 2)) {
+                lo = mid + 1;
+            } else {
+                return t.U16(at + 4);
+            }
+        }
+    }
+    return 0;
+}
+
+// Bytes of a value record, and the offset of its XAdvance when valueFormat has one.
+size_t ValueSize(uint16_t valueFormat) {
+    size_t bits = 0;
+    for (uint16_t v = valueFormat & 0xFF; v != 0; v >>= 1) {
+        bits += v & 1;
+    }
+    return bits * 2;
+}
+
+size_t XAdvanceOffset(uint16_t valueFormat) {
+    return ValueSize(valueFormat & 0x3);
+}
+
+const uint16_t X_ADVANCE = 0x4;
+
+// Adds the GPOS 'kern' adjustments in font units to units. False if the font has no kern
+// feature.
+bool ReadGpos(const TableReader& t, const std::vector<FT_UInt>& glyphIndices, const std::vector<uint32_t>& present,
+    std::unordered_map<uint64_t, int32_t>& units) {
+    if (t.U16(0) != 1) {
+        return false;
+    }
+    const size_t featureList = t.U16(6);
+    const size_t lookupList = t.U16(8);
+    // Every script and language gets the same kerning, so the lookups of all kern features
+    // are used.
+    std::vector<uint16_t> lookups;
+    for (uint16_t i = 0; i < t.U16(featureList); ++i) {
+        const size_t record = featureList + 2 + (size_t)i * 6;
+        if (t.U32(record) != FT_MAKE_TAG('k', 'e', 'r', 'n')) {
+            continue;
+        }
+        const size_t feature = featureList + t.U16(record + 4);
+        for (uint16_t j = 0; j < t.U16(feature + 2); ++j) {
+            lookups.push_back(t.U16(feature + 4 + (size_t)j * 2));
+        }
+    }
+    if (lookups.empty()) {
+        return false;
+    }
+    // Lookups apply in lookup list order.
+    std::sort(lookups.begin(), lookups.end());
+    lookups.erase(std::unique(lookups.begin(), lookups.end()), lookups.end());
+
+    auto positionOf = [&](FT_UInt glyph) {
+        return glyph < present.size() ? present[glyph] : NOT_PRESENT;
+    };
+    for (uint16_t lookupIndex : lookups) {
+        if (lookupIndex >= t.U16(lookupList)) {
+            continue;
+        }
+        const size_t lookup = lookupList + t.U16(lookupList + 2 + (size_t)lookupIndex * 2);
+        const uint16_t lookupType = t.U16(lookup);
+        // Pairs one of the lookup's subtables applied to, and first glyphs a class subtable
+        // applied to, for which no later subtable of the lookup applies anymore.
+        std::unordered_set<uint64_t> decided;
+        std::vector<bool> firstDecided(glyphIndices.size());
+        for (uint16_t s = 0; s < t.U16(lookup + 4); ++s) {
+            size_t sub = lookup + t.U16(lookup + 6 + (size_t)s * 2);
+            uint16_t type = lookupType;
+            if (type == 9) {
+                // Extension subtables wrap the real one behind a 32-bit offset.
+                type = t.U16(sub + 2);
+                sub += t.U32(sub + 4);
+            }
+            if (type != 2) {
+                continue;
+            }
+            const uint16_t format = t.U16(sub);
+            const size_t coverage = sub + t.U16(sub + 2);
+            const uint16_t valueFormat1 = t.U16(sub + 4);
+            const uint16_t valueFormat2 = t.U16(sub + 6);
+            const size_t valueSize = ValueSize(valueFormat1) + ValueSize(valueFormat2);
+            const size_t xAdvance = XAdvanceOffset(valueFormat1);
+
+            if (format == 1) {
+                // A pair set per covered first glyph, listing its second glyphs.
+                const uint16_t pairSetCount = t.U16(sub + 8);
+                ForEachCovered(t, coverage, [&](FT_UInt first, uint32_t coverageIndex) {
+                    const uint32_t left = positionOf(first);
+                    if (coverageIndex >= pairSetCount || left == NOT_PRESENT || firstDecided[left]) {
+                        return;
+                    }
+                    const size_t pairSet = sub + t.U16(sub + 10 + (size_t)coverageIndex * 2);
+                    for (uint16_t k = 0; k < t.U16(pairSet); ++k) {
+                        const size_t record = pairSet + 2 + k * (2 + valueSize);
+                        const uint32_t right = positionOf(t.U16(record));
+                        if (right == NOT_PRESENT || !decided.insert(PairKey(left, right)).second) {
+                            continue;
+                        }
+                        const int16_t value = valueFormat1 & X_ADVANCE ? t.I16(record + 2 + xAdvance) : 0;
+                        if (value != 0) {
+                            units[PairKey(left, right)] += value;
+                        }
+                    }
+                });
+            } else if (format == 2) {
+                // A value per pair of classes. Every second glyph has a class, so the
+                // subtable applies to every pair of a covered first glyph.
+                const size_t classDef1 = sub + t.U16(sub + 8);
+                const size_t classDef2 = sub + t.U16(sub + 10);
+                const uint16_t class1Count = t.U16(sub + 12);
+                const uint16_t class2Count = t.U16(sub + 14);
+                std::vector<std::vector<uint32_t>> byClass2(class2Count);
+                for (uint32_t right = 0; right < glyphIndices.size(); ++right) {
+                    const uint16_t class2 = ClassOf(t, classDef2, glyphIndices[right]);
+                    if (class2 < class2Count) {
+                        byClass2[class2].push_back(right);
+                    }
+                }
+                ForEachCovered(t, coverage, [&](FT_UInt first, uint32_t) {
+                    const uint32_t left = positionOf(first);
+                    const uint16_t class1 = ClassOf(t, classDef1, first);
+                    if (left == NOT_PRESENT || firstDecided[left] || class1 >= class1Count) {
+                        return;
+                    }
+                    firstDecided[left] = true;
+                    if (!(valueFormat1 & X_ADVANCE)) {
+                        return;
+                    }
+                    for (uint16_t class2 = 0; class2 < class2Count; ++class2) {
+                        const size_t record = sub + 16 + ((size_t)class1 * class2Count + class2) * valueSize;
+                        const int16_t value = t.I16(record + xAdvance);
+                        if (value == 0) {
+                            continue;
+                        }
+                        for (uint32_t right : byClass2[class2]) {
+                            if (!decided.count(PairKey(left, right))) {
+                                units[PairKey(left, right)] += value;
+                            }
+                        }
+                    }
+                });
+            }
+        }
+    }
+    return true;
+}
+
+// Pairs of format 0 subtables of the legacy kern table, the only format FreeType reads.
+void ReadKernPairs(const TableReader& t, size_t size, const std::vector<uint32_t>& present, std::unordered_set<uint64_t>& pairs) {
+    if (t.U16(0) != 0) {
+        return;
+    }
+    auto positionOf = [&](FT_UInt glyph) {
+        return glyph < present.size() ? present[glyph] : NOT_PRESENT;
+    };
+    size_t at = 4;
+    for (uint16_t i = 0; i < t.U16(2) && at < size; ++i) {
+        const uint16_t coverage = t.U16(at + 4);
+        const uint16_t numPairs = t.U16(at + 6);
+        // Horizontal, not cross-stream. The length field overflows in large subtables, so
+        // the pair count decides where the next one starts.
+        if ((coverage >> 8) == 0 && (coverage & 0x5) == 0x1) {
+            for (uint16_t k = 0; k < numPairs; ++k) {
+                const size_t pair = at + 14 + (size_t)k * 6;
+                const uint32_t left = positionOf(t.U16(pair));
+                const uint32_t right = positionOf(t.U16(pair + 2));
+                if (left != NOT_PRESENT && right != NOT_PRESENT) {
+                    pairs.insert(PairKey(left, right));
+                }
+            }
+        }
+        const size_t length = (coverage >> 8) == 0 ? std::max<size_t>(t.U16(at + 2), 14 + (size_t)numPairs * 6) : t.U16(at + 2);
+        if (length == 0) {
+            break;
+        }
+        at += length;
+    }
+}
+
+}
+
+void ReadKerning(FT_Face face, const std::vector<FT_UInt>& glyphIndices, std::vector<GlyphKerning>& pairs) {
+    pairs.clear();
+    if (!FT_IS_SFNT(face) || glyphIndices.empty()) {
+        return;
+    }
+    // Position of every glyph index in glyphIndices.
+    FT_UInt indexEnd = 0;
+    for (FT_UInt glyph : glyphIndices) {
+        indexEnd = std::max(indexEnd, glyph + 1);
+    }
+    std::vector<uint32_t> present(indexEnd, NOT_PRESENT);
+    for (uint32_t i = 0; i < glyphIndices.size(); ++i) {
+        present[glyphIndices[i]] = i;
+    }
+
+    std::vector<uint8_t> data;
+    std::unordered_map<uint64_t, int32_t> units;
+    if (LoadTable(face, TTAG_GPOS, data) && ReadGpos(TableReader{data}, glyphIndices, present, units)) {
+        for (auto [key, value] : units) {
+            FT_Pos scaled = FT_MulFix(value, face->size->metrics.x_scale);
+            if (scaled != 0) {
+                pairs.push_back({(uint32_t)(key >> 32), (uint32_t)key, scaled});
+            }
+        }
+    } else if (FT_HAS_KERNING(face) && LoadTable(face, TTAG_kern, data)) {
+        std::unordered_set<uint64_t> kernPairs;
+        ReadKernPairs(TableReader{data}, data.size(), present, kernPairs);
+        for (uint64_t key : kernPairs) {
+            const uint32_t left = (uint32_t)(key >> 32);
+            const uint32_t right = (uint32_t)key;
+            FT_Vector kerning;
+            if (FT_Get_Kerning(face, glyphIndices[left], glyphIndices[right], FT_KERNING_UNFITTED, &kerning) == FT_Err_Ok && kerning.x != 0) {
+                pairs.push_back({left, right, kerning.x});
+            }
+        }
+    }
+    std::sort(pairs.begin(), pairs.end(), [](const GlyphKerning& a, const GlyphKerning& b) {
+        return a.left != b.left ? a.left < b.left : a.right < b.right;
+    });
+}
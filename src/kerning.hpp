@@ -0,0 +1,19 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+#include <freetype/freetype.h>
+
+// Kerning between two glyphs, given by their position in the list passed to ReadKerning.
+// value is in 26.6 pixels at the current size of the face.
+struct GlyphKerning {
+    uint32_t left;
+    uint32_t right;
+    FT_Pos value;
+};
+
+// Reads the horizontal kerning of every pair of the given glyph indices. Fonts with a GPOS
+// 'kern' feature are read from its pair adjustment lookups (glyph pairs and class pairs),
+// other fonts from their legacy kern table through FT_Get_Kerning. Pairs without kerning
+// are left out, the rest is sorted by left, then right.
+void ReadKerning(FT_Face face, const std::vector<FT_UInt>& glyphIndices, std::vector<GlyphKerning>& pairs);
@@ -1,42 +1,50 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstdint>
+#include <cstring>
+#include <string>
 #include <string_view>
+#include <vector>
 #include <optional>
 #include <filesystem>
-#include <unordered_map>
-#include <map>
-#include <chrono>
+#include <memory>
 #include <fstream>
+#include <iostream>
+#include <iterator>
+#include <iomanip>
+#include <thread>
+#include <algorithm>
 
-#include <freetype/freetype.h>
-#include <freetype/ftmm.h>
 #include <png.h>
+#include <zlib.h>
+#include "atlasgen.hpp"
 #include "defer.hpp"
+#include "hash.hpp"
+#include "png_writer.hpp"
 
-#define STB_RECT_PACK_IMPLEMENTATION
-#include <stb_rect_pack.h>
-
-void CheckFtErr(FT_Error err) {
-    if (err != FT_Err_Ok) {
-        printf("FT_Error %d (%s)\n", err, FT_Error_String(err));
-        exit(-1);
-    }
-}
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
 
 class ArgIter {
-    int m_argc;
-    char** m_argv;
-    int m_index = 1;
+    std::vector<std::string_view> m_args;
+    size_t m_index = 0;
 
 public:
     ArgIter(int argc, char** argv) {
-        this->m_argc = argc;
-        this->m_argv = argv;
+        for (int i = 1; i < argc; ++i) {
+            m_args.push_back(argv[i]);
+        }
     }
 
+    ArgIter(std::vector<std::string_view> args) : m_args(std::move(args)) {}
+
     bool Match(std::string_view str) {
-        if (m_index < m_argc && std::string_view{m_argv[m_index]} == str) {
+        if (m_index < m_args.size() && m_args[m_index] == str) {
             ++m_index;
             return true;
         }
@@ -44,11 +52,11 @@ public:
     }
 
     std::optional<std::string_view> Next() {
-        if (m_index >= m_argc) {
+        if (m_index >= m_args.size()) {
             return {};
         }
         ++m_index;
-        return {std::string_view{m_argv[m_index-1]}};
+        return {m_args[m_index-1]};
     }
 };
 
@@ -104,391 +112,1451 @@ std::optional<T> ParseFloat(std::optional<std::string_view> str_) {
     return (T)num + (T)denom / (T)div;
 }
 
-struct GlyphData {
-    size_t rectIndex;
-    FT_UInt glyphIndex;
-    unsigned int width;
-    unsigned int height;
-    FT_Int leftBearing;
-    FT_Int topBearing;
-    FT_Pos advance;
+// Peak resident memory of this process so far, in bytes.
+size_t GetPeakMemory() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return 0;
+    }
+    return counters.PeakWorkingSetSize;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+#ifdef __APPLE__
+    return (size_t)usage.ru_maxrss;
+#else
+    return (size_t)usage.ru_maxrss * 1024;
+#endif
+#endif
+}
+
+// Which map files a job writes.
+enum class MapFormat {
+    Bin,
+    Json,
+    Both,
+};
+
+// Everything needed to produce one atlas. Parsed from the command line, or from one line of
+// a --batch manifest.
+struct JobOptions : AtlasOptions {
+    std::string outDir;
+    // Compression level and filter. The thread count is set per run instead.
+    PngOptions png;
+    MapFormat map = MapFormat::Bin;
+    // Set with --append. The atlas in this directory is extended instead of built anew.
+    std::string appendDir;
+    // Set with --metrics-only. Only the map is written, without pages or glyph positions.
+    bool metricsOnly = false;
+    // Set with --bundle. The map and pages are also written as one file, see WriteBundle.
+    bool bundle = false;
+    // Set with --precompress. Every output but the PNGs gets a gzipped .gz sibling.
+    bool precompress = false;
+    // Files read by --text, which --watch rebuilds on.
+    std::vector<std::string> textFiles;
+};
+
+enum class FlagResult {
+    Parsed,
+    Unknown,
+    Error,
+};
+
+// Parses a flag that belongs to a single job.
+FlagResult ParseJobFlag(std::string_view flag, ArgIter& args, JobOptions& job) {
+    if (flag == "--out") {
+        auto outDir = args.Next();
+        if (!outDir) {
+            printf("expected --out <path>\n");
+            return FlagResult::Error;
+        }
+        job.outDir = *outDir;
+    } else if (flag == "--size") {
+        std::optional<int> size = ParseInt<int>(args.Next());
+        if (!size) {
+            printf("expected --size <int>\n");
+            return FlagResult::Error;
+        }
+        job.size = size.value();
+    } else if (flag == "--range") {
+        auto first = ParseInt<uint32_t>(args.Next());
+        auto last = ParseInt<uint32_t>(args.Next());
+        if (!first || !last) {
+            printf("expected --range <int> <int>\n");
+            return FlagResult::Error;
+        }
+
+        if (*first >= *last) {
+            printf("Invalid range. Right value must be larger than left value.\n");
+            return FlagResult::Error;
+        }
+        job.cpRanges.push_back({*first, *last});
+    } else if (flag == "--ascii") {
+        job.cpRanges.push_back({32,126});
+    } else if (flag == "--text" || flag == "--text-stdin") {
+        std::string text;
+        std::string source = "stdin";
+        if (flag == "--text") {
+            auto path = args.Next();
+            if (!path) {
+                printf("expected --text <path>\n");
+                return FlagResult::Error;
+            }
+            source = *path;
+            job.textFiles.push_back(source);
+            std::ifstream f{source, std::ios::binary};
+            if (!f.is_open()) {
+                printf("Failed to open %s\n", source.c_str());
+                return FlagResult::Error;
+            }
+            text.assign(std::istreambuf_iterator<char>{f}, std::istreambuf_iterator<char>{});
+        } else {
+            // stdin can only be read once, every job that asks for it gets the same text.
+            static std::optional<std::string> stdinText;
+            if (!stdinText) {
+                stdinText.emplace(std::istreambuf_iterator<char>{std::cin}, std::istreambuf_iterator<char>{});
+            }
+            text = *stdinText;
+        }
+        if (AddTextCodepoints(text, job) == 0) {
+            // An empty range list would mean every codepoint of the font.
+            printf("%s contains no text\n", source.c_str());
+            return FlagResult::Error;
+        }
+    } else if (flag == "--hot") {
+        auto count = ParseInt<size_t>(args.Next());
+        if (!count) {
+            printf("expected --hot <int>\n");
+            return FlagResult::Error;
+        }
+        job.hotGlyphs = *count;
+    } else if (flag == "--axis") {
+        auto name = args.Next();
+        auto value = ParseFloat<double>(args.Next());
+        if (!name || !value) {
+            printf("Expected --axis <name> <float>\n");
+            return FlagResult::Error;
+        }
+        job.axes[std::string{*name}] = (FT_Fixed)(*value * (1<<16));
+    } else if (flag == "--mono") {
+        job.mono = true;
+    } else if (flag == "--dedup") {
+        job.dedup = true;
+    } else if (flag == "--grid") {
+        job.grid = true;
+    } else if (flag == "--kerning") {
+        job.kerning = true;
+    } else if (flag == "--subpixel") {
+        auto phases = ParseInt<int>(args.Next());
+        if (!phases || *phases < 1 || *phases > 8) {
+            printf("expected --subpixel <1-8>\n");
+            return FlagResult::Error;
+        }
+        job.subpixel = *phases;
+    } else if (flag == "--lcd" || flag == "--lcd-v") {
+        job.lcd = flag == "--lcd" ? LcdLayout::Horizontal : LcdLayout::Vertical;
+        job.format = AtlasFormat::RGB8;
+    } else if (flag == "--lcd-filter") {
+        auto filter = args.Next();
+        if (filter == "default") {
+            job.lcdFilter = LcdFilter::Default;
+        } else if (filter == "light") {
+            job.lcdFilter = LcdFilter::Light;
+        } else if (filter == "legacy") {
+            job.lcdFilter = LcdFilter::Legacy;
+        } else if (filter == "none") {
+            job.lcdFilter = LcdFilter::None;
+        } else {
+            printf("expected --lcd-filter <default|light|legacy|none>\n");
+            return FlagResult::Error;
+        }
+    } else if (flag == "--format") {
+        auto format = args.Next();
+        if (format == "ga8") {
+            job.format = AtlasFormat::GA8;
+        } else if (format == "a8") {
+            job.format = AtlasFormat::A8;
+        } else if (format == "a1") {
+            job.format = AtlasFormat::A1;
+        } else {
+            printf("expected --format <ga8|a8|a1>\n");
+            return FlagResult::Error;
+        }
+    } else if (flag == "--png-level") {
+        auto level = ParseInt<int>(args.Next());
+        if (!level || *level < 0 || *level > 9) {
+            printf("expected --png-level <0-9>\n");
+            return FlagResult::Error;
+        }
+        job.png.level = *level;
+    } else if (flag == "--png-filter") {
+        auto filter = args.Next();
+        if (filter == "default") {
+            job.png.filter = PngFilter::Default;
+        } else if (filter == "none") {
+            job.png.filter = PngFilter::None;
+        } else if (filter == "sub") {
+            job.png.filter = PngFilter::Sub;
+        } else if (filter == "up") {
+            job.png.filter = PngFilter::Up;
+        } else if (filter == "avg") {
+            job.png.filter = PngFilter::Average;
+        } else if (filter == "paeth") {
+            job.png.filter = PngFilter::Paeth;
+        } else if (filter == "all") {
+            job.png.filter = PngFilter::All;
+        } else {
+            printf("expected --png-filter <default|none|sub|up|avg|paeth|all>\n");
+            return FlagResult::Error;
+        }
+    } else if (flag == "--max-size") {
+        auto size = args.Next();
+        size_t x = size ? size->find('x') : std::string_view::npos;
+        std::optional<int> w, h;
+        if (x != std::string_view::npos) {
+            w = ParseInt<int>(size->substr(0, x));
+            h = ParseInt<int>(size->substr(x + 1));
+        }
+        if (!w || !h || *w <= 0 || *h <= 0) {
+            printf("expected --max-size <width>x<height>\n");
+            return FlagResult::Error;
+        }
+        job.maxPageW = *w;
+        job.maxPageH = *h;
+    } else if (flag == "--sdf") {
+        job.distanceField = DistanceField::Sdf;
+    } else if (flag == "--msdf") {
+        job.distanceField = DistanceField::Msdf;
+        job.format = AtlasFormat::RGB8;
+    } else if (flag == "--spread") {
+        // FreeType's SDF renderer only supports this range.
+        auto spread = ParseInt<int>(args.Next());
+        if (!spread || *spread < 2 || *spread > 32) {
+            printf("expected --spread <2-32>\n");
+            return FlagResult::Error;
+        }
+        job.spread = *spread;
+    } else if (flag == "--append") {
+        auto appendDir = args.Next();
+        if (!appendDir) {
+            printf("expected --append <path>\n");
+            return FlagResult::Error;
+        }
+        job.appendDir = *appendDir;
+    } else if (flag == "--metrics-only") {
+        job.metricsOnly = true;
+    } else if (flag == "--padding") {
+        auto padding = args.Next();
+        if (padding == "full") {
+            job.padding = PackPadding::Full;
+        } else if (padding == "shared") {
+            job.padding = PackPadding::Shared;
+        } else {
+            printf("expected --padding <full|shared>\n");
+            return FlagResult::Error;
+        }
+    } else if (flag == "--pack") {
+        auto heuristic = args.Next();
+        if (heuristic == "bl") {
+            job.heuristic = PackHeuristic::BottomLeft;
+        } else if (heuristic == "bf") {
+            job.heuristic = PackHeuristic::BestFit;
+        } else if (heuristic == "auto") {
+            job.heuristic = PackHeuristic::Auto;
+        } else {
+            printf("expected --pack <bl|bf|auto>\n");
+            return FlagResult::Error;
+        }
+    } else if (flag == "--map") {
+        auto map = args.Next();
+        if (map == "bin") {
+            job.map = MapFormat::Bin;
+        } else if (map == "json") {
+            job.map = MapFormat::Json;
+        } else if (map == "both") {
+            job.map = MapFormat::Both;
+        } else {
+            printf("expected --map <bin|json|both>\n");
+            return FlagResult::Error;
+        }
+    } else if (flag == "--bundle") {
+        job.bundle = true;
+    } else if (flag == "--precompress") {
+        job.precompress = true;
+    } else {
+        return FlagResult::Unknown;
+    }
+    return FlagResult::Parsed;
+}
+
+// Reads a --batch manifest. Every non-empty line that doesn't start with '#' is one job,
+// written with the same flags as the command line. A job starts from the flags given on the
+// command line; ranges listed on the line replace the command line ranges.
+bool ParseManifest(const char* path, const JobOptions& defaults, std::vector<JobOptions>& jobs) {
+    std::ifstream f{path};
+    if (!f.is_open()) {
+        printf("Failed to open manifest %s\n", path);
+        return false;
+    }
+
+    std::string line;
+    size_t lineNumber = 0;
+    while (std::getline(f, line)) {
+        ++lineNumber;
+        // Split on whitespace, double quotes group a token that contains spaces.
+        std::vector<std::string> tokens;
+        std::string token;
+        bool inToken = false, inQuotes = false;
+        for (char ch : line) {
+            if (ch == '"') {
+                inQuotes = !inQuotes;
+                inToken = true;
+            } else if (!inQuotes && (ch == ' ' || ch == '\t' || ch == '\r')) {
+                if (inToken) {
+                    tokens.push_back(std::move(token));
+                    token.clear();
+                }
+                inToken = false;
+            } else {
+                token += ch;
+                inToken = true;
+            }
+        }
+        if (inToken) {
+            tokens.push_back(std::move(token));
+        }
+        if (tokens.empty() || tokens[0][0] == '#') {
+            continue;
+        }
+
+        JobOptions job = defaults;
+        job.cpRanges.clear();
+        job.cpCounts.clear();
+        ArgIter args{std::vector<std::string_view>{tokens.begin(), tokens.end()}};
+        while (auto flag = args.Next()) {
+            FlagResult result = ParseJobFlag(*flag, args, job);
+            if (result == FlagResult::Unknown) {
+                printf("%s:%zu: Unknown flag: %.*s\n", path, lineNumber, (int)flag->size(), flag->data());
+                return false;
+            } else if (result == FlagResult::Error) {
+                printf("%s:%zu: Invalid job\n", path, lineNumber);
+                return false;
+            }
+        }
+        if (job.cpRanges.empty()) {
+            job.cpRanges = defaults.cpRanges;
+            job.cpCounts = defaults.cpCounts;
+        }
+        if (job.outDir.empty()) {
+            job.outDir = job.appendDir;
+        }
+        if (job.outDir.empty()) {
+            printf("%s:%zu: --out or --append must be set\n", path, lineNumber);
+            return false;
+        }
+        jobs.push_back(std::move(job));
+    }
+    return true;
+}
+
+// Key of everything that affects the output files of a job. The multi-threaded PNG encoder
+// writes different bytes than libpng, so whether it is used is part of the key.
+uint64_t OutputCacheKey(uint64_t fontHash, const JobOptions& job, bool bandedPng) {
+    Hasher hasher;
+    hasher.Add(GlyphCacheKey(fontHash, job, !job.grid));
+    hasher.Add(job.png.level);
+    hasher.Add(job.png.filter);
+    hasher.Add(bandedPng);
+    for (auto range : job.cpRanges) {
+        hasher.Add(range.first);
+        hasher.Add(range.second);
+    }
+    hasher.Add(job.maxPageW);
+    hasher.Add(job.maxPageH);
+    hasher.Add(job.padding);
+    hasher.Add(job.heuristic);
+    hasher.Add(job.grid);
+    hasher.Add(job.format);
+    hasher.Add(job.map);
+    hasher.Add(job.metricsOnly);
+    hasher.Add(job.dedup);
+    hasher.Add(job.kerning);
+    hasher.Add(job.bundle);
+    hasher.Add(job.precompress);
+    // The counts only matter for picking the hot glyphs.
+    hasher.Add(job.hotGlyphs);
+    if (job.hotGlyphs != 0) {
+        for (auto [cp, count] : job.cpCounts) {
+            hasher.Add(cp);
+            hasher.Add(count);
+        }
+    }
+    return hasher.Hash();
+}
+
+// Settings shared by every job of a run.
+struct RunOptions {
+    bool singlePass = false;
+    // Set with --stream. Pages are written band by band instead of being built in memory.
+    bool stream = false;
+    size_t pngThreads = 1;
+    // Set with --cache. Rendered glyphs and finished outputs are kept in cacheDir.
+    bool cache = false;
+    std::string cacheDir;
+    // Set with --face and --named-instance, which font of the file to use.
+    int faceIndex = 0;
+    int namedInstance = 0;
+    uint64_t fontHash = 0;
+    // Set with --stats or --stats-json. Also times every FreeType call.
+    bool stats = false;
 };
 
+// Where --cache keeps its files for a job: --cache-dir if given, otherwise a directory next
+// to the job's --out.
+std::filesystem::path CacheDirFor(const RunOptions& run, const JobOptions& job) {
+    if (!run.cacheDir.empty()) {
+        return run.cacheDir;
+    }
+    auto out = std::filesystem::path{job.outDir}.lexically_normal();
+    if (!out.has_filename()) {
+        out = out.parent_path();
+    }
+    return out.parent_path() / ".atlasgen-cache";
+}
+
+// Copies the outputs of a previous identical build back into place. Returns false on a miss.
+bool RestoreOutputs(const std::filesystem::path& entryDir, const std::filesystem::path& outDir) {
+    std::error_code err;
+    if (!std::filesystem::is_directory(entryDir, err)) {
+        return false;
+    }
+    std::filesystem::create_directories(outDir, err);
+    for (auto& entry : std::filesystem::directory_iterator{entryDir, err}) {
+        std::filesystem::copy_file(entry.path(), outDir / entry.path().filename(), std::filesystem::copy_options::overwrite_existing, err);
+        if (err) {
+            return false;
+        }
+    }
+    return !err;
+}
+
+void StoreOutputs(const std::filesystem::path& entryDir, const std::vector<std::filesystem::path>& outputs) {
+    // Copy into a fresh directory and rename it so a half-written entry is never seen as a hit.
+    std::error_code err;
+    auto tmpDir = entryDir;
+    tmpDir += ".tmp";
+    std::filesystem::remove_all(tmpDir, err);
+    std::filesystem::create_directories(tmpDir, err);
+    for (auto& output : outputs) {
+        std::filesystem::copy_file(output, tmpDir / output.filename(), std::filesystem::copy_options::overwrite_existing, err);
+        if (err) {
+            std::filesystem::remove_all(tmpDir, err);
+            return;
+        }
+    }
+    std::filesystem::remove_all(entryDir, err);
+    std::filesystem::rename(tmpDir, entryDir, err);
+}
+
+// PNG layout of an atlas page.
+void AtlasPngType(AtlasFormat format, int& bitDepth, int& colorType) {
+    bitDepth = format == AtlasFormat::A1 ? 1 : 8;
+    switch (format) {
+    case AtlasFormat::GA8: colorType = PNG_COLOR_TYPE_GRAY_ALPHA; break;
+    case AtlasFormat::A8: colorType = PNG_COLOR_TYPE_GRAY; break;
+    case AtlasFormat::A1: colorType = PNG_COLOR_TYPE_GRAY; break;
+    case AtlasFormat::RGB8: colorType = PNG_COLOR_TYPE_RGB; break;
+    case AtlasFormat::RGBA8: colorType = PNG_COLOR_TYPE_RGBA; break;
+    }
+}
+
+// Writes every page to its PNG file in the job's output directory. A page that arrives
+// whole is compressed with the run's PNG threads, a streamed one goes through libpng a band
+// at a time.
+class PngFileSink : public AtlasPageSink {
+    const std::filesystem::path& m_outDir;
+    const char* m_prefix;
+    PngOptions m_options;
+    std::vector<std::filesystem::path>& m_outputs;
+    std::filesystem::path m_path;
+    int m_width = 0;
+    int m_height = 0;
+    int m_bitDepth = 8;
+    int m_colorType = 0;
+    PngRowWriter m_writer;
+    bool m_streaming = false;
+
+    bool Fail() {
+        printf("Failed to write PNG file %s\n", m_path.string().c_str());
+        return false;
+    }
+
+public:
+    PngFileSink(const std::filesystem::path& outDir, const char* prefix, const PngOptions& options, std::vector<std::filesystem::path>& outputs)
+        : m_outDir(outDir), m_prefix(prefix), m_options(options), m_outputs(outputs) {}
+
+    bool BeginPage(size_t page, int width, int height, AtlasFormat format) override {
+        m_path = m_outDir / PageFileName(m_prefix, page);
+        m_width = width;
+        m_height = height;
+        m_streaming = false;
+        AtlasPngType(format, m_bitDepth, m_colorType);
+        return true;
+    }
+
+    bool WriteRows(const uint8_t* rows, size_t count, size_t pitch) override {
+        if (!m_streaming && count == (size_t)m_height) {
+            if (!WritePng(m_path.string().c_str(), m_width, m_height, m_bitDepth, m_colorType, rows, pitch, m_options)) {
+                return Fail();
+            }
+            m_outputs.push_back(m_path);
+            return true;
+        }
+        if (!m_streaming) {
+            PngOptions options = m_options;
+            options.threads = 1;
+            if (!m_writer.Open(m_path.string().c_str(), m_width, m_height, m_bitDepth, m_colorType, options)) {
+                return Fail();
+            }
+            m_streaming = true;
+        }
+        return m_writer.WriteRows(rows, count, pitch) || Fail();
+    }
+
+    bool EndPage() override {
+        if (!m_streaming) {
+            return true;
+        }
+        m_streaming = false;
+        if (!m_writer.Finish()) {
+            return Fail();
+        }
+        m_outputs.push_back(m_path);
+        return true;
+    }
+};
+
+bool WriteFile(const std::filesystem::path& path, const void* data, size_t size) {
+    std::ofstream f{path, std::ios::binary};
+    if (!f.is_open()) {
+        return false;
+    }
+    f.write((const char*)data, size);
+    return !f.fail();
+}
+
+// Writes name.bin and/or name.json, as the job's --map asks for.
+bool WriteMap(const JobOptions& job, const std::filesystem::path& outDir, const char* name, const MapData& map, std::vector<std::filesystem::path>& outputs) {
+    if (job.map == MapFormat::Bin || job.map == MapFormat::Both) {
+        auto outMap = outDir / (std::string{name} + ".bin");
+        std::vector<uint8_t> data = EncodeMapBin(map);
+        if (!WriteFile(outMap, data.data(), data.size())) {
+            printf("Failed to write map to %s\n", outMap.string().c_str());
+            return false;
+        }
+        outputs.push_back(outMap);
+    }
+    if (job.map == MapFormat::Json || job.map == MapFormat::Both) {
+        auto outMap = outDir / (std::string{name} + ".json");
+        std::string data = EncodeMapJson(map);
+        if (!WriteFile(outMap, data.data(), data.size())) {
+            printf("Failed to write map to %s\n", outMap.string().c_str());
+            return false;
+        }
+        outputs.push_back(outMap);
+    }
+    return true;
+}
+
+bool ReadFile(const std::filesystem::path& path, std::vector<uint8_t>& data) {
+    std::ifstream f{path, std::ios::binary};
+    if (!f.is_open()) {
+        return false;
+    }
+    data.assign(std::istreambuf_iterator<char>{f}, std::istreambuf_iterator<char>{});
+    return !f.bad();
+}
+
+// Writes name.bundle: map.bin and the PNG of every page of the map in one file, so a client
+// fetches one URL that caches as one entry. The map comes first, so it can be decoded while
+// the pages are still downloading, and the pages follow in order. Little-endian, every part
+// starts on a 4-byte boundary:
+//   char magic[4] "AGBN", u32 version, u32 mapOffset, u32 mapSize, u32 pageCount,
+//   u32 reserved, pageCount times {u32 offset, u32 size}, then the map and the pages.
+// The PNGs are read back from outDir, where the page sink wrote them.
+bool WriteBundle(const std::filesystem::path& outDir, const char* name, const MapData& map, std::vector<std::filesystem::path>& outputs) {
+    std::vector<uint8_t> bundle = {'A', 'G', 'B', 'N'};
+    auto u32 = [&](uint32_t value) {
+        for (int i = 0; i < 4; ++i) {
+            bundle.push_back((uint8_t)(value >> (i * 8)));
+        }
+    };
+    auto patchU32 = [&](size_t offset, uint32_t value) {
+        for (int i = 0; i < 4; ++i) {
+            bundle[offset + i] = (uint8_t)(value >> (i * 8));
+        }
+    };
+    auto append = [&](const std::vector<uint8_t>& data) {
+        bundle.resize((bundle.size() + 3) & ~(size_t)3);
+        const size_t offset = bundle.size();
+        bundle.insert(bundle.end(), data.begin(), data.end());
+        return (uint32_t)offset;
+    };
+
+    u32(1);
+    u32(0);
+    u32(0);
+    u32((uint32_t)map.pages.size());
+    u32(0);
+    const size_t pageTable = bundle.size();
+    for (size_t i = 0; i < map.pages.size(); ++i) {
+        u32(0);
+        u32(0);
+    }
+    std::vector<uint8_t> data = EncodeMapBin(map);
+    patchU32(8, append(data));
+    patchU32(12, (uint32_t)data.size());
+    for (size_t i = 0; i < map.pages.size(); ++i) {
+        auto pagePath = outDir / map.pages[i].file;
+        if (!ReadFile(pagePath, data)) {
+            printf("Failed to read PNG file %s\n", pagePath.string().c_str());
+            return false;
+        }
+        patchU32(pageTable + i * 8, append(data));
+        patchU32(pageTable + i * 8 + 4, (uint32_t)data.size());
+    }
+    if (bundle.size() > UINT32_MAX) {
+        printf("%s.bundle would be larger than 4 GB\n", name);
+        return false;
+    }
+
+    auto outBundle = outDir / (std::string{name} + ".bundle");
+    if (!WriteFile(outBundle, bundle.data(), bundle.size())) {
+        printf("Failed to write bundle to %s\n", outBundle.string().c_str());
+        return false;
+    }
+    outputs.push_back(outBundle);
+    return true;
+}
+
+// Writes path.gz next to path for servers that hand out precompressed files, so the CDN
+// doesn't have to compress them on the fly. Compressed at the highest level once here
+// instead of on every request. The gzip header has no time or name, so the same input always
+// gives the same file.
+bool WriteGzip(const std::filesystem::path& path, std::vector<std::filesystem::path>& outputs) {
+    auto outPath = path;
+    outPath += ".gz";
+    auto fail = [&]() {
+        printf("Failed to write %s\n", outPath.string().c_str());
+        return false;
+    };
+    std::vector<uint8_t> data;
+    if (!ReadFile(path, data)) {
+        return fail();
+    }
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    // 16 + 15 window bits writes a gzip header instead of a zlib one.
+    if (deflateInit2(&z, 9, Z_DEFLATED, 16 + 15, 9, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return fail();
+    }
+    defer { deflateEnd(&z); };
+    std::vector<uint8_t> compressed(deflateBound(&z, (uLong)data.size()));
+    z.next_in = data.data();
+    z.avail_in = (uInt)data.size();
+    z.next_out = compressed.data();
+    z.avail_out = (uInt)compressed.size();
+    if (deflate(&z, Z_FINISH) != Z_STREAM_END) {
+        return fail();
+    }
+    if (!WriteFile(outPath, compressed.data(), z.total_out)) {
+        return fail();
+    }
+    outputs.push_back(outPath);
+    return true;
+}
+
+// Writes the gzip siblings of a job's outputs. PNGs are deflated already.
+bool PrecompressOutputs(std::vector<std::filesystem::path>& outputs) {
+    const size_t count = outputs.size();
+    for (size_t i = 0; i < count; ++i) {
+        if (outputs[i].extension() != ".png" && !WriteGzip(std::filesystem::path{outputs[i]}, outputs)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Writes the map of a --metrics-only job. map.json is written as the glyphs come in, map.bin
+// needs all of them to pick its value width and is written at the end.
+class MetricsFileSink : public MetricsSink {
+    const JobOptions& m_job;
+    const std::filesystem::path& m_outDir;
+    std::vector<std::filesystem::path>& m_outputs;
+    MapData m_map;
+    MapJsonEncoder m_encoder;
+    std::filesystem::path m_jsonPath;
+    std::ofstream m_json;
+
+    bool WantsJson() const { return m_job.map == MapFormat::Json || m_job.map == MapFormat::Both; }
+    bool WantsBin() const { return m_job.map == MapFormat::Bin || m_job.map == MapFormat::Both; }
+
+    bool Fail(const std::filesystem::path& path) {
+        printf("Failed to write map to %s\n", path.string().c_str());
+        return false;
+    }
+
+public:
+    MetricsFileSink(const JobOptions& job, const std::filesystem::path& outDir, std::vector<std::filesystem::path>& outputs)
+        : m_job(job), m_outDir(outDir), m_outputs(outputs) {}
+
+    bool Begin(const MapData& map) override {
+        m_map = map;
+        m_map.glyphs.assign(map.fields.size(), {});
+        if (WantsJson()) {
+            m_jsonPath = m_outDir / "map.json";
+            m_json.open(m_jsonPath, std::ios::binary);
+            m_json << m_encoder.Begin(m_map);
+            if (!m_json) {
+                return Fail(m_jsonPath);
+            }
+        }
+        return true;
+    }
+
+    bool WriteGlyphs(const std::vector<std::vector<int32_t>>& columns) override {
+        if (WantsJson()) {
+            m_json << m_encoder.Glyphs(columns);
+            if (!m_json) {
+                return Fail(m_jsonPath);
+            }
+        }
+        if (WantsBin()) {
+            for (size_t field = 0; field < columns.size(); ++field) {
+                m_map.glyphs[field].insert(m_map.glyphs[field].end(), columns[field].begin(), columns[field].end());
+            }
+        }
+        return true;
+    }
+
+    bool End() override {
+        if (WantsJson()) {
+            m_json << m_encoder.End(m_map);
+            m_json.close();
+            if (!m_json) {
+                return Fail(m_jsonPath);
+            }
+            m_outputs.push_back(m_jsonPath);
+        }
+        if (WantsBin()) {
+            auto outMap = m_outDir / "map.bin";
+            std::vector<uint8_t> data = EncodeMapBin(m_map);
+            if (!WriteFile(outMap, data.data(), data.size())) {
+                return Fail(outMap);
+            }
+            m_outputs.push_back(outMap);
+        }
+        return true;
+    }
+};
+
+// Reads the atlas in dir back for --append: map.bin, or map.json when there is none, and
+// every page it lists.
+bool LoadAppendBase(const std::filesystem::path& dir, AtlasAppend& append) {
+    bool bin = std::filesystem::exists(dir / "map.bin");
+    auto mapPath = dir / (bin ? "map.bin" : "map.json");
+    std::ifstream f{mapPath, std::ios::binary};
+    if (!f.is_open()) {
+        printf("Failed to open %s\n", mapPath.string().c_str());
+        return false;
+    }
+    std::string data{std::istreambuf_iterator<char>{f}, std::istreambuf_iterator<char>{}};
+    bool ok = bin ? DecodeMapBin((const uint8_t*)data.data(), data.size(), append.baseMap) : DecodeMapJson(data, append.baseMap);
+    if (!ok) {
+        printf("%s is not a valid map\n", mapPath.string().c_str());
+        return false;
+    }
+
+    for (auto& page : append.baseMap.pages) {
+        auto pagePath = dir / page.file;
+        AtlasBitmap& bmp = append.basePages.emplace_back();
+        int bitDepth = 0, colorType = 0, expectedDepth = 0, expectedType = 0;
+        AtlasPngType(page.format, expectedDepth, expectedType);
+        if (!ReadPng(pagePath.string().c_str(), bmp.width, bmp.height, bitDepth, colorType, bmp.pixels, bmp.pitch)) {
+            printf("Failed to read PNG file %s\n", pagePath.string().c_str());
+            return false;
+        }
+        if (bmp.width != page.width || bmp.height != page.height || bitDepth != expectedDepth || colorType != expectedType) {
+            printf("%s doesn't match the map\n", pagePath.string().c_str());
+            return false;
+        }
+        bmp.format = page.format;
+    }
+    return true;
+}
+
+// Deletes the patch pages an earlier append left in dir, and their .gz siblings, so only the
+// patches of the new delta are next to it.
+void RemovePatchPages(const std::filesystem::path& dir) {
+    auto isPatchPage = [](std::string name) {
+        if (name.ends_with(".gz")) {
+            name.resize(name.size() - 3);
+        }
+        if (name == "patch.png") {
+            return true;
+        }
+        if (!name.starts_with("patch-") || !name.ends_with(".png") || name.size() == 10) {
+            return false;
+        }
+        return std::all_of(name.begin() + 6, name.end() - 4, [](char c) { return c >= '0' && c <= '9'; });
+    };
+    std::error_code err;
+    std::vector<std::filesystem::path> stale;
+    for (auto& entry : std::filesystem::directory_iterator{dir, err}) {
+        if (isPatchPage(entry.path().filename().string())) {
+            stale.push_back(entry.path());
+        }
+    }
+    for (auto& path : stale) {
+        std::filesystem::remove(path, err);
+    }
+}
+
+// Builds one atlas into job.outDir. Every file written is appended to outputs.
+int RunJob(const JobOptions& job, const RunOptions& run, AtlasFont& font, std::vector<std::filesystem::path>& outputs, JobStats& stats) {
+    BuildSettings settings;
+    settings.singlePass = run.singlePass;
+    settings.stream = run.stream;
+    if (run.cache) {
+        settings.glyphCacheDir = CacheDirFor(run, job).string();
+    }
+    settings.fontHash = run.fontHash;
+    settings.stats = run.stats;
+
+    std::filesystem::path outDir{job.outDir};
+    std::filesystem::create_directories(outDir);
+    if (job.metricsOnly) {
+        if (!job.appendDir.empty()) {
+            printf("--metrics-only can't be combined with --append\n");
+            return -1;
+        }
+        if (job.bundle) {
+            printf("--bundle can't be combined with --metrics-only\n");
+            return -1;
+        }
+        MetricsFileSink sink{job, outDir, outputs};
+        if (BuildMetrics(font, settings, job, sink, stats) != AtlasStatus::Ok) {
+            return -1;
+        }
+        stats.times.Lap("map");
+        if (job.precompress) {
+            if (!PrecompressOutputs(outputs)) {
+                return -1;
+            }
+            stats.times.Lap("precompress");
+        }
+        return 0;
+    }
+    PngOptions png = job.png;
+    png.threads = run.stream ? 1 : run.pngThreads;
+    PngFileSink sink{outDir, "atlas", png, outputs};
+    PngFileSink patchSink{outDir, "patch", png, outputs};
+    // Read before anything is written, the base may be in outDir itself.
+    std::unique_ptr<AtlasAppend> append;
+    if (!job.appendDir.empty()) {
+        append = std::make_unique<AtlasAppend>();
+        if (!LoadAppendBase(job.appendDir, *append)) {
+            return -1;
+        }
+        append->patchSink = &patchSink;
+        RemovePatchPages(outDir);
+        stats.times.Lap("appendLoad");
+    }
+    MapData map;
+    if (BuildAtlas(font, settings, job, sink, map, stats, append.get()) != AtlasStatus::Ok) {
+        return -1;
+    }
+
+    if (!WriteMap(job, outDir, "map", map, outputs) || (append && !WriteMap(job, outDir, "delta", append->delta, outputs))) {
+        return -1;
+    }
+    stats.times.Lap("map");
+    if (job.bundle) {
+        // An append bundles the patches with the delta, for clients that already have the atlas.
+        if (!WriteBundle(outDir, "atlas", map, outputs) || (append && !WriteBundle(outDir, "delta", append->delta, outputs))) {
+            return -1;
+        }
+        stats.times.Lap("bundle");
+    }
+    if (job.precompress) {
+        if (!PrecompressOutputs(outputs)) {
+            return -1;
+        }
+        stats.times.Lap("precompress");
+    }
+    return 0;
+}
+
+void PrintJobStats(const JobStats& stats) {
+    printf("Stats for %s%s:\n", stats.outDir.c_str(), stats.upToDate ? " (up to date)" : "");
+    for (auto& [name, ms] : stats.times.stages) {
+        printf("  %-12s %10.3f ms\n", name.c_str(), ms);
+    }
+    if (stats.upToDate) {
+        return;
+    }
+    printf("  FT_Load_Glyph %.3f ms, FT_Render_Glyph %.3f ms (summed over workers)\n", stats.glyphTimes.loadMs, stats.glyphTimes.renderMs);
+    printf("  %zu codepoints (%zu unmapped), %zu unique glyphs (%zu cached, %zu rendered)\n",
+        stats.codepoints, stats.unmappedCodepoints, stats.uniqueGlyphs, stats.cachedGlyphs, stats.renderedGlyphs);
+    printf("  %zu rects in %zu packing pass(es) onto %zu page(s), %.0f of %.0f pixels used (%.1f%%)\n",
+        stats.packedRects, stats.packPasses, stats.pages, stats.rectArea, stats.atlasArea,
+        stats.atlasArea > 0 ? stats.rectArea / stats.atlasArea * 100.0 : 0.0);
+    if (stats.colorGlyphs != 0) {
+        printf("  %zu color glyphs\n", stats.colorGlyphs);
+    }
+    if (stats.hotGlyphs != 0) {
+        printf("  %zu hot glyphs\n", stats.hotGlyphs);
+    }
+    if (stats.dedupedGlyphs != 0) {
+        printf("  %zu deduplicated glyphs, %.0f pixels saved\n", stats.dedupedGlyphs, stats.dedupedArea);
+    }
+    for (auto& [name, bytes] : stats.outputBytes) {
+        printf("  %-12s %10ju bytes\n", name.c_str(), bytes);
+    }
+}
+
+void WriteJsonString(std::ostream& f, std::string_view str) {
+    f << '"';
+    for (char c : str) {
+        if (c == '"' || c == '\\') {
+            f << '\\' << c;
+        } else if ((unsigned char)c < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            f << escaped;
+        } else {
+            f << c;
+        }
+    }
+    f << '"';
+}
+
+void WriteJsonStages(std::ostream& f, const std::vector<std::pair<std::string, double>>& stages) {
+    f << '{';
+    for (size_t i = 0; i < stages.size(); ++i) {
+        f << (i == 0 ? "" : ",");
+        WriteJsonString(f, stages[i].first);
+        f << ':' << stages[i].second;
+    }
+    f << '}';
+}
+
+// Machine readable copy of --stats. Times are in milliseconds, sizes in bytes.
+bool WriteStatsJson(const char* path, const std::vector<std::pair<std::string, double>>& runStages, const std::vector<JobStats>& jobs, double totalMs, size_t peakMemory) {
+    std::fstream f{path, std::ios::out};
+    if (!f.is_open()) {
+        return false;
+    }
+    f << std::fixed << std::setprecision(3);
+    f << "{\"version\":1,";
+    f << "\"totalMs\":" << totalMs << ',';
+    f << "\"peakMemory\":" << peakMemory << ',';
+    f << "\"stages\":";
+    WriteJsonStages(f, runStages);
+    f << ",\"jobs\":[";
+    for (size_t i = 0; i < jobs.size(); ++i) {
+        auto& job = jobs[i];
+        f << (i == 0 ? "" : ",") << "{\"out\":";
+        WriteJsonString(f, job.outDir);
+        f << ",\"upToDate\":" << (job.upToDate ? "true" : "false");
+        f << ",\"stages\":";
+        WriteJsonStages(f, job.times.stages);
+        f << ",\"loadGlyphMs\":" << job.glyphTimes.loadMs;
+        f << ",\"renderGlyphMs\":" << job.glyphTimes.renderMs;
+        f << ",\"codepoints\":" << job.codepoints;
+        f << ",\"unmappedCodepoints\":" << job.unmappedCodepoints;
+        f << ",\"uniqueGlyphs\":" << job.uniqueGlyphs;
+        f << ",\"cachedGlyphs\":" << job.cachedGlyphs;
+        f << ",\"renderedGlyphs\":" << job.renderedGlyphs;
+        f << ",\"packedRects\":" << job.packedRects;
+        f << ",\"colorGlyphs\":" << job.colorGlyphs;
+        f << ",\"hotGlyphs\":" << job.hotGlyphs;
+        f << ",\"dedupedGlyphs\":" << job.dedupedGlyphs;
+        f << ",\"packPasses\":" << job.packPasses;
+        f << ",\"pages\":" << job.pages;
+        f << std::setprecision(0);
+        f << ",\"rectArea\":" << job.rectArea;
+        f << ",\"atlasArea\":" << job.atlasArea;
+        f << ",\"dedupedArea\":" << job.dedupedArea;
+        f << std::setprecision(3);
+        f << ",\"outputs\":{";
+        for (size_t j = 0; j < job.outputBytes.size(); ++j) {
+            f << (j == 0 ? "" : ",");
+            WriteJsonString(f, job.outputBytes[j].first);
+            f << ':' << job.outputBytes[j].second;
+        }
+        f << "}}";
+    }
+    f << "]}";
+    f.close();
+    return !f.fail();
+}
+
 void PrintHelp() {
     printf(
         "atlasgen --font <file> --out <folder>\n"
+        "atlasgen --font <file> --batch <manifest>\n"
         "Optional:\n"
         "  --size <pixels>     = Set font height. Default is 16.\n"
         "  --mono              = Render 1-bit black & white with no anti-aliasing\n"
+        "  --subpixel <1-8>    = Render every glyph at this many horizontal subpixel positions, so\n"
+        "                        small text can be drawn at fractional x. Each one is packed as a\n"
+        "                        glyph of its own, with a record per position in the map.\n"
+        "  --lcd               = Render for LCD screens with side by side R, G, B subpixels, into\n"
+        "                        an RGB atlas that holds the coverage of each subpixel.\n"
+        "  --lcd-v             = Same as --lcd for screens with the subpixels stacked vertically.\n"
+        "  --lcd-filter <name> = FreeType filter against color fringes for --lcd: default, light,\n"
+        "                        legacy or none.\n"
+        "  --dedup             = Pack glyphs whose bitmaps are pixel for pixel the same only once.\n"
+        "                        They share x, y and page in the map but keep their own metrics.\n"
         "  --range <int> <int> = Instead of rendering all codepoints, render this range.\n"
         "                        Multiple --range flags can be used.\n"
         "  --ascii             = Same as --range 32 126\n"
+        "  --text <file>       = Render exactly the codepoints of this UTF-8 text. Can be combined\n"
+        "                        with --range and other --text flags.\n"
+        "  --text-stdin        = Same as --text, reading the text from stdin.\n"
+        "  --hot <count>       = Pack the <count> glyphs that occur most often in the --text onto\n"
+        "                        pages of their own, before every other page, so clients can load\n"
+        "                        the common glyphs first.\n"
+        "  --axis <name> <float> = Set a variation axis of the font.\n"
+        "  --face <int>        = Which font of a collection (.ttc, .otc) to use. Default is 0.\n"
+        "  --named-instance <int> = Start from this named instance of a variable font, 1 is the\n"
+        "                        first. --axis overrides single axes of it. Default is 0, none.\n"
+        "  --format <name>     = Pixel format of the atlas images:\n"
+        "                          ga8 = gray + alpha, coverage in alpha (default)\n"
+        "                          a8  = 8-bit grayscale, coverage in gray\n"
+        "                          a1  = 1-bit grayscale, requires --mono\n"
+        "  --map <name>        = Which glyph map to write: bin (map.bin, default), json (map.json)\n"
+        "                        or both.\n"
+        "  --bundle            = Also write atlas.bundle: map.bin followed by every atlas image, in\n"
+        "                        one file that a client fetches with a single request.\n"
+        "  --precompress       = Also write a gzipped .gz copy of every output but the PNGs, for\n"
+        "                        servers that hand out precompressed files.\n"
+        "  --kerning           = Also write the kerning between every pair of glyphs in the atlas\n"
+        "                        to the map, from the GPOS kern feature or the kern table.\n"
+        "  --metrics-only      = Only measure the glyphs and write the map, without x and y and\n"
+        "                        without atlas images. Much faster than a full build. With\n"
+        "                        --stream, map.json is written while the glyphs are measured.\n"
+        "  --append <folder>   = Add the glyphs to the atlas in this folder instead of building a\n"
+        "                        new one. Glyphs already in it keep their id and position, new ones\n"
+        "                        go into free space and onto new pages. Also writes the changed\n"
+        "                        rects as patch.png, patch-1.png, ... and the new glyphs as\n"
+        "                        delta.bin/delta.json. --out defaults to the same folder.\n"
+        "  --sdf               = Render signed distance fields instead of coverage, for text that\n"
+        "                        is drawn at other sizes than --size. Use with --format a8.\n"
+        "  --msdf              = Render multi-channel distance fields into an RGB atlas, which keep\n"
+        "                        corners sharp. The shape is the median of the three channels.\n"
+        "  --spread <2-32>     = Distance in pixels a distance field covers on either side of the\n"
+        "                        outline. Default is 4.\n"
+        "  --png-level <0-9>   = zlib compression level of the atlas images. Default is 6.\n"
+        "  --png-filter <name> = PNG row filter: default, none, sub, up, avg, paeth or all.\n"
+        "  --png-threads <int> = Compress the atlas images on this many threads. 0 uses every core.\n"
+        "                        Any count above 1 gives the same file, but not the same as 1.\n"
+        "  --max-size <w>x<h>  = Largest size of one atlas image. Glyphs that don't fit are put\n"
+        "                        into more images (atlas-1.png, atlas-2.png, ...).\n"
+        "  --padding <name>    = Empty space between glyphs: full gives every glyph a gutter on all\n"
+        "                        four sides (default), shared lets neighbours share one gutter and\n"
+        "                        adds one along the right and bottom page edge. Both keep glyphs\n"
+        "                        from bleeding into each other.\n"
+        "  --pack <name>       = Packing heuristic: bl packs rects as low as possible (default), bf\n"
+        "                        where they waste the least space, auto tries both with several\n"
+        "                        page widths on the --jobs threads and keeps the smallest atlas.\n"
+        "  --grid              = Instead of packing, give every glyph a cell of a fixed grid sized\n"
+        "                        for the largest glyph, in glyph id order. The map has no x, y\n"
+        "                        and page, clients compute them from the glyph id. All pages have\n"
+        "                        the same size, which --max-size sets.\n"
+        "  --single-pass       = Render each glyph once and keep its bitmap in memory until it is\n"
+        "                        copied into the atlas. Faster, but uses more memory.\n"
+        "  --stream            = Write the atlas images a band of rows at a time instead of building\n"
+        "                        them in memory. Ignores --png-threads.\n"
+        "  --jobs <int>        = Number of threads used for rendering. 0 uses every core. Default is 1.\n"
+        "  --batch <file>      = Build several atlases from one font. Each line of the file is one\n"
+        "                        atlas, given as --out plus any of --size, --mono, --subpixel,\n"
+        "                        --lcd, --lcd-v, --lcd-filter, --dedup, --range, --ascii, --text,\n"
+        "                        --text-stdin, --hot, --axis, --format, --max-size, --padding,\n"
+        "                        --pack, --grid, --map, --bundle, --precompress, --kerning,\n"
+        "                        --metrics-only, --append, --sdf, --msdf, --spread and --png-*.\n"
+        "                        Flags on the command line apply to every line.\n"
+        "  --cache             = Keep rendered glyphs and finished atlases in a .atlasgen-cache\n"
+        "                        directory next to --out. Unchanged atlases are copied from the\n"
+        "                        cache and only glyphs that weren't rendered before get rendered.\n"
+        "  --cache-dir <path>  = Use this directory for --cache instead.\n"
+        "  --watch             = Keep running and rebuild whenever the font, the --batch manifest or\n"
+        "                        a --text file changes. Only atlases whose inputs changed are built\n"
+        "                        again, with the font kept open. Turns on --cache.\n"
+        "  --stats             = Print the time spent in every stage, glyph and packing counts,\n"
+        "                        and the size of every output.\n"
+        "  --stats-json <file> = Write the same numbers to a JSON file.\n"
     );
 };
 
-int main(int argc, char** argv) {
-    auto timeBegin = std::chrono::high_resolution_clock::now();
-
-    FT_Library ft;
-    CheckFtErr(FT_Init_FreeType(&ft));
-    defer { FT_Done_FreeType(ft); };
+// Everything the command line sets. --watch parses it again whenever an input changes.
+struct CommandLine {
+    std::optional<std::string_view> fontPath, manifestPath;
+    JobOptions defaultJob;
+    RunOptions run;
+    size_t numJobs = 1;
+    bool printStats = false;
+    std::optional<std::string_view> statsPath;
+    bool watch = false;
+    bool help = false;
+    std::vector<JobOptions> jobs;
+};
 
+// Parses the command line and reads the manifest into cmd.jobs. False if anything is
+// invalid, the error has been printed then.
+bool ParseCommandLine(int argc, char** argv, CommandLine& cmd) {
     ArgIter args{argc, argv};
-    std::optional<std::string_view> fontPath, outDir;
-    int desiredSize = 16;
-    // Array of first-last codepoint ranges.
-    std::vector<std::pair<uint32_t, uint32_t>> cpRanges;
-    std::unordered_map<std::string, FT_Fixed> axes;
-    bool mono = false;
+    JobOptions& defaultJob = cmd.defaultJob;
+    RunOptions& run = cmd.run;
 
     size_t numFlags = 0;
     while (auto flag = args.Next()) {
         ++numFlags;
+        FlagResult result = ParseJobFlag(*flag, args, defaultJob);
+        if (result == FlagResult::Error) {
+            return false;
+        } else if (result == FlagResult::Parsed) {
+            continue;
+        }
+
         if (flag == "--font") {
-            fontPath = args.Next();
-            if (!fontPath) {
+            cmd.fontPath = args.Next();
+            if (!cmd.fontPath) {
                 printf("expected --font <path>\n");
-                return -1;
+                return false;
             }
-        } else if (flag == "--out") {
-            outDir = args.Next();
-            if (!outDir) {
-                printf("expected --out <path>\n");
-                return -1;
+        } else if (flag == "--face") {
+            auto face = ParseInt<int>(args.Next());
+            if (!face) {
+                printf("expected --face <int>\n");
+                return false;
             }
-        } else if (flag == "--size") {
-            std::optional<int> size = ParseInt<int>(args.Next());
-            if (!size) {
-                printf("expected --size <int>\n");
-                return -1;
+            run.faceIndex = *face;
+        } else if (flag == "--named-instance") {
+            auto instance = ParseInt<int>(args.Next());
+            if (!instance) {
+                printf("expected --named-instance <int>\n");
+                return false;
             }
-            desiredSize = size.value();
-        } else if (flag == "--range") {
-            auto first = ParseInt<uint32_t>(args.Next());
-            auto last = ParseInt<uint32_t>(args.Next());
-            if (!first || !last) {
-                printf("expected --range <int> <int>\n");
-                return -1;
+            run.namedInstance = *instance;
+        } else if (flag == "--batch") {
+            cmd.manifestPath = args.Next();
+            if (!cmd.manifestPath) {
+                printf("expected --batch <path>\n");
+                return false;
             }
-
-            if (*first >= *last) {
-                printf("Invalid range. Right value must be larger than left value.\n");
-                return -1;
+        } else if (flag == "--single-pass") {
+            run.singlePass = true;
+        } else if (flag == "--stream") {
+            run.stream = true;
+        } else if (flag == "--png-threads") {
+            auto threads = ParseInt<size_t>(args.Next());
+            if (!threads) {
+                printf("expected --png-threads <int>\n");
+                return false;
             }
-            cpRanges.push_back({*first, *last});
-        } else if (flag == "--ascii") {
-            cpRanges.push_back({32,126});
-        } else if (flag == "--axis") {
-            auto name = args.Next();
-            auto value = ParseFloat<double>(args.Next());
-            if (!name || !value) {
-                printf("Expected --axis <name> <float>\n");
-                return -1;
+            run.pngThreads = *threads;
+            if (run.pngThreads == 0) {
+                run.pngThreads = std::max(1u, std::thread::hardware_concurrency());
             }
-            axes.emplace(*name, (FT_Fixed)(*value * (1<<16)));
-        } else if (flag == "--mono") {
-            mono = true;
+        } else if (flag == "--cache") {
+            run.cache = true;
+        } else if (flag == "--cache-dir") {
+            auto cacheDir = args.Next();
+            if (!cacheDir) {
+                printf("expected --cache-dir <path>\n");
+                return false;
+            }
+            run.cache = true;
+            run.cacheDir = *cacheDir;
+        } else if (flag == "--watch") {
+            // Rebuilds reuse the glyphs rendered before.
+            cmd.watch = true;
+            run.cache = true;
+        } else if (flag == "--jobs") {
+            auto jobs = ParseInt<size_t>(args.Next());
+            if (!jobs) {
+                printf("expected --jobs <int>\n");
+                return false;
+            }
+            cmd.numJobs = *jobs;
+            if (cmd.numJobs == 0) {
+                cmd.numJobs = std::max(1u, std::thread::hardware_concurrency());
+            }
+        } else if (flag == "--stats") {
+            cmd.printStats = true;
+            run.stats = true;
+        } else if (flag == "--stats-json") {
+            cmd.statsPath = args.Next();
+            if (!cmd.statsPath) {
+                printf("expected --stats-json <path>\n");
+                return false;
+            }
+            run.stats = true;
         } else if (flag == "--help") {
-            PrintHelp();
-            return 0;
+            cmd.help = true;
+            return true;
         } else {
             printf("Unknown flag: %s\n", flag->data());
-            return -1;
+            return false;
         }
     }
 
     if (numFlags == 0) {
+        cmd.help = true;
+        return true;
+    }
+    if (defaultJob.outDir.empty() && !cmd.manifestPath) {
+        defaultJob.outDir = defaultJob.appendDir;
+    }
+    if (!cmd.fontPath || (defaultJob.outDir.empty() && !cmd.manifestPath)) {
+        printf("--font and --out (or --append or --batch) must be set\n");
         PrintHelp();
-        return 0;
-    } else if (!fontPath || !outDir) {
-        printf("--font and --out must be set\n");
-        PrintHelp();
-        return -1;
+        return false;
     }
+    if (cmd.manifestPath) {
+        return ParseManifest(std::string{*cmd.manifestPath}.c_str(), defaultJob, cmd.jobs);
+    }
+    cmd.jobs.push_back(defaultJob);
+    return true;
+}
 
-    FT_Face face;
-    CheckFtErr(FT_New_Face(ft, fontPath->data(), 0, &face));
-    defer { FT_Done_Face(face); };
-    CheckFtErr(FT_Set_Pixel_Sizes(face, 0, desiredSize));
+// Last write time and size of a file, to notice when it changes. Empty if it is missing.
+using FileStamp = std::optional<std::pair<std::filesystem::file_time_type, uintmax_t>>;
 
-    if (!axes.empty()) {
-        FT_MM_Var* master;
-        CheckFtErr(FT_Get_MM_Var(face, &master));
-        defer { FT_Done_MM_Var(ft, master); };
+FileStamp StampFile(const std::filesystem::path& path) {
+    std::error_code err;
+    auto writeTime = std::filesystem::last_write_time(path, err);
+    if (err) {
+        return {};
+    }
+    auto size = std::filesystem::file_size(path, err);
+    if (err) {
+        return {};
+    }
+    return std::pair{writeTime, size};
+}
 
-        if (master->num_axis == 0) {
-            printf("This font has no axes\n");
-            return -1;
-        }
+// The files --watch rebuilds on: the font, the manifest and every --text file.
+std::vector<std::pair<std::string, FileStamp>> WatchedInputs(const CommandLine& cmd) {
+    std::vector<std::string> paths;
+    paths.push_back(std::string{*cmd.fontPath});
+    if (cmd.manifestPath) {
+        paths.push_back(std::string{*cmd.manifestPath});
+    }
+    paths.insert(paths.end(), cmd.defaultJob.textFiles.begin(), cmd.defaultJob.textFiles.end());
+    for (auto& job : cmd.jobs) {
+        paths.insert(paths.end(), job.textFiles.begin(), job.textFiles.end());
+    }
+    std::sort(paths.begin(), paths.end());
+    paths.erase(std::unique(paths.begin(), paths.end()), paths.end());
 
-        std::vector<FT_Fixed> coords;
-        coords.reserve(master->num_axis);
-        for (FT_UInt i = 0; i < master->num_axis; ++i) {
-            const FT_Var_Axis& axis = master->axis[i];
-            FT_Fixed coord = axis.def;
-            auto it = axes.find(axis.name);
-            if (it != axes.end()) {
-                coord = it->second;
-                axes.erase(it);
-            }
+    std::vector<std::pair<std::string, FileStamp>> inputs;
+    for (auto& path : paths) {
+        inputs.push_back({path, StampFile(path)});
+    }
+    return inputs;
+}
 
-            if (coord < axis.minimum || coord > axis.maximum) {
-                printf("Axis %s must be %f <= x <= %f\n", axis.name, (double)axis.minimum / (1 << 16), (double)axis.maximum / (1 << 16));
-                return -1;
-            }
-            coords.push_back(coord);
-        }
+int main(int argc, char** argv) {
+    auto timeBegin = Clock::now();
 
-        if (!axes.empty()) {
-            printf("The provided axis/axes do not exist in this font:");
-            for (auto it = axes.begin(); it != axes.end(); ++it) {
-                printf("%s%s", it == axes.begin() ? " " : ", ", it->first.c_str());
-            }
-            printf("\nValid axes are:");
-            for (FT_UInt i = 0; i < master->num_axis; ++i) {
-                printf("%s%s", i == 0 ? " " : ", ", master->axis[i].name);
-            }
-            printf("\n");
-            return -1;
-        }
+    FT_Library ft;
+    if (FT_Error err = FT_Init_FreeType(&ft)) {
+        printf("FT_Error %d (%s)\n", err, FT_Error_String(err));
+        return -1;
+    }
+    defer { FT_Done_FreeType(ft); };
 
-        CheckFtErr(FT_Set_Var_Design_Coordinates(face, coords.size(), coords.data()));
+    CommandLine cmd;
+    if (!ParseCommandLine(argc, argv, cmd)) {
+        return -1;
+    }
+    if (cmd.help) {
+        PrintHelp();
+        return 0;
     }
 
-    if (cpRanges.empty()) {
-        FT_UInt glyphIndex;
-        FT_ULong firstChar = FT_Get_First_Char(face, &glyphIndex);
-        FT_ULong lastChar = firstChar;
-        if (firstChar == 0) {
-            printf("Font has no charmap\n");
-            return -1;
-        }
+    // Worker 0 uses the main library, see AtlasFont. The font is only opened once a job
+    // actually needs it, a fully cached run never touches FreeType. With --watch the cache
+    // keeps the faces open between builds and only opens the font again when it changed.
+    AtlasFontCache fonts{ft, cmd.numJobs};
+    // Output cache key of what every output directory holds now, so --watch only rebuilds
+    // the jobs whose inputs changed.
+    std::unordered_map<std::string, uint64_t> builtKeys;
 
-        while (FT_ULong nextChar = FT_Get_Next_Char(face, lastChar, &glyphIndex)) {
-            if (nextChar != lastChar+1) {
-                cpRanges.push_back({firstChar, lastChar});
-                firstChar = nextChar;
-            }
-            lastChar = nextChar;
-        }
-
-        cpRanges.push_back({firstChar, lastChar});
-    }
-    
-    std::map<FT_UInt, GlyphData> glyphs;
-    std::vector<stbrp_rect> rects;
-    uint32_t totalW = 0, totalH = 0;
-
-    const uint32_t RECT_PAD = 1;
-    for (auto range : cpRanges) {
-        for (uint32_t cp = range.first; cp <= range.second; ++cp) {
-            FT_UInt glyphIndex = FT_Get_Char_Index(face, cp);
-    
-            auto insertion = glyphs.try_emplace(glyphIndex, GlyphData{});
-            if (!insertion.second) {
-                continue; // We already store this glyph
-            }
-            CheckFtErr(FT_Load_Glyph(face, glyphIndex, FT_LOAD_DEFAULT));
-            auto& glyph = insertion.first->second;
-            glyph.rectIndex = (size_t)-1;
-            glyph.glyphIndex = glyphIndex;
-            glyph.width = face->glyph->bitmap.width;
-            glyph.height = face->glyph->bitmap.rows;
-            glyph.leftBearing = face->glyph->bitmap_left;
-            glyph.topBearing = face->glyph->bitmap_top;
-            glyph.advance = face->glyph->advance.x;
-
-            if (glyph.width * glyph.height != 0) {
-                totalW += glyph.width;
-                totalH += glyph.height;
-                stbrp_rect rect;
-                memset(&rect, 0, sizeof(rect));
-                rect.w = glyph.width + RECT_PAD*2;
-                rect.h = glyph.height + RECT_PAD*2;
-                rects.push_back(rect);
-                glyph.rectIndex = rects.size()-1;
-            }
-        }
-    }
-
-    
-    int atlasW = 0;
-    int atlasH = 0;
-    {
-        stbrp_context rpc;
-        const float RP_GROWTH = 1.2f;
-        int targetW = sqrt(totalW);
-        int targetH = sqrt(totalH);
-        std::vector<stbrp_node> rpNodes{(size_t)targetW * 2};
-        while (true) {
-            stbrp_init_target(&rpc, targetW, targetH, rpNodes.data(), rpNodes.size());
-            if (stbrp_pack_rects(&rpc, rects.data(), rects.size())) {
-                break;
-            }
-            targetW *= RP_GROWTH;
-            targetH *= RP_GROWTH;
-            rpNodes.resize(targetW);
-        }
-        for (auto& rect : rects) {
-            if (rect.x + rect.w > atlasW)
-                atlasW = rect.x + rect.w;
-            if (rect.y + rect.h > atlasH)
-                atlasH = rect.y + rect.h;
-        }
-    }
-
-
-    std::vector<uint8_t> atlasBmp;
-    const size_t atlasChannels = 2;
-    const size_t atlasPitch = atlasW * atlasChannels;
-    atlasBmp.resize(atlasW * atlasH * atlasChannels);
-    memset(atlasBmp.data(), 0xFF, atlasBmp.size());
-    for (auto& pair : glyphs) {
-        auto& glyph = pair.second;
-        if (glyph.rectIndex == (size_t)-1) {
-            continue;
+    // Builds every job of cmd. False if one of them failed.
+    auto build = [&]() {
+        RunOptions& run = cmd.run;
+        const std::vector<JobOptions>& jobs = cmd.jobs;
+        // Stages that are shared by every job.
+        std::vector<std::pair<std::string, double>> runStages;
+        std::vector<JobStats> jobStats;
+
+        if (run.cache) {
+            auto hashBegin = Clock::now();
+            auto fontHash = HashFile(cmd.fontPath->data());
+            if (!fontHash) {
+                printf("Failed to read %s\n", cmd.fontPath->data());
+                return false;
+            }
+            // Every font of a collection shares the file.
+            Hasher hasher;
+            hasher.Add(*fontHash);
+            hasher.Add(run.faceIndex);
+            hasher.Add(run.namedInstance);
+            run.fontHash = hasher.Hash();
+            runStages.push_back({"fontHash", MsSince(hashBegin)});
         }
 
-        CheckFtErr(FT_Load_Glyph(face, glyph.glyphIndex, FT_LOAD_DEFAULT));
-        if (face->glyph->format != FT_GLYPH_FORMAT_BITMAP) {
-            CheckFtErr(FT_Render_Glyph(face->glyph, mono ? FT_RENDER_MODE_MONO : FT_RENDER_MODE_LIGHT));
-        }
-
-        stbrp_rect& rect = rects[glyph.rectIndex];
-        // Remove padding
-        rect.x += RECT_PAD, rect.y += RECT_PAD;
-        rect.w -= RECT_PAD*2, rect.h -= RECT_PAD*2;
-
-        int channels = 0;
-        const unsigned char* buffer = face->glyph->bitmap.buffer;
-        switch (face->glyph->bitmap.pixel_mode) {
-        case FT_PIXEL_MODE_GRAY: {
-            // Convert to GA
-            int src_channels = 1;
-            int src_pitch = abs(face->glyph->bitmap.pitch);
-            for (unsigned int y = 0; y < face->glyph->bitmap.rows; ++y) {
-                for (unsigned int x = 0; x < face->glyph->bitmap.width; ++x) {
-                    const unsigned char* src = &buffer[x*src_channels + y*src_pitch];
-                    unsigned char* dst = &atlasBmp[(x + rect.x)*atlasChannels + (y+rect.y)*atlasPitch];
-                    dst[1] = src[0];
+        std::shared_ptr<AtlasFont> font;
+        auto openFont = [&]() {
+            if (font) {
+                return true;
+            }
+            auto openBegin = Clock::now();
+            if (fonts.GetFile(cmd.fontPath->data(), run.faceIndex, run.namedInstance, font) != AtlasStatus::Ok) {
+                return false;
+            }
+            runStages.push_back({"fontOpen", MsSince(openBegin)});
+            return true;
+        };
+
+        for (const JobOptions& job : jobs) {
+            auto jobBegin = Clock::now();
+            const uint64_t outputKey = OutputCacheKey(run.fontHash, job, run.pngThreads > 1 && !run.stream);
+            if (cmd.watch) {
+                auto built = builtKeys.find(job.outDir);
+                if (built != builtKeys.end() && built->second == outputKey) {
+                    printf("%s is unchanged\n", job.outDir.c_str());
+                    continue;
                 }
+                builtKeys.erase(job.outDir);
             }
-            break;
-        }
-        case FT_PIXEL_MODE_MONO: {
-            int src_pitch = abs(face->glyph->bitmap.pitch);
-            for (unsigned int y = 0; y < face->glyph->bitmap.rows; ++y) {
-                for (unsigned int x = 0; x < face->glyph->bitmap.width; ++x) {
-                    const unsigned char* src = &buffer[(x/8) + y*src_pitch];
-                    unsigned char* dst = &atlasBmp[(x + rect.x)*atlasChannels + (y+rect.y)*atlasPitch];
-                    dst[1] = ((src[0] >> (7 - (x%8))) & 1) * 0xFF;
+            JobStats& stats = jobStats.emplace_back();
+            stats.outDir = job.outDir;
+            std::filesystem::path cacheEntry;
+            // The output of an append depends on the atlas it extends, which isn't part of the key.
+            bool cacheOutputs = run.cache && job.appendDir.empty();
+            if (cacheOutputs) {
+                cacheEntry = CacheDirFor(run, job) / HexKey(outputKey);
+                stats.upToDate = RestoreOutputs(cacheEntry, job.outDir);
+                stats.times.Lap("cacheRestore");
+                if (stats.upToDate) {
+                    printf("%s is up to date\n", job.outDir.c_str());
+                    if (cmd.printStats) {
+                        PrintJobStats(stats);
+                    }
+                    builtKeys[job.outDir] = outputKey;
+                    continue;
                 }
             }
-            break;
-        }
-        case FT_PIXEL_MODE_BGRA:
-        case FT_PIXEL_MODE_NONE:
-        case FT_PIXEL_MODE_LCD:
-        case FT_PIXEL_MODE_LCD_V:
-        case FT_PIXEL_MODE_GRAY2:
-        case FT_PIXEL_MODE_GRAY4:
-            printf("Unsupported FT_Pixel_Mode %d\n", face->glyph->bitmap.pixel_mode);
-            return -1;
-        default:
-            printf("Unknown FT_Pixel_Mode %d\n", face->glyph->bitmap.pixel_mode);
-            return -1;
+
+            if (!openFont()) {
+                return false;
+            }
+            // The font is opened by the first job that needs it, don't count that against the job.
+            stats.times.Skip();
+            std::vector<std::filesystem::path> outputs;
+            if (RunJob(job, run, *font, outputs, stats) != 0) {
+                return false;
+            }
+            builtKeys[job.outDir] = outputKey;
+            if (cacheOutputs) {
+                StoreOutputs(cacheEntry, outputs);
+                stats.times.Lap("cacheStore");
+            }
+            if (run.stats) {
+                for (auto& output : outputs) {
+                    std::error_code err;
+                    stats.outputBytes.push_back({output.filename().string(), std::filesystem::file_size(output, err)});
+                }
+            }
+            if (cmd.printStats) {
+                PrintJobStats(stats);
+            }
+            if (jobs.size() > 1) {
+                printf("Wrote %s in %f ms\n", job.outDir.c_str(), MsSince(jobBegin));
+            }
         }
-    }
 
-    std::filesystem::create_directory(*outDir);
-    auto outAtlas = std::filesystem::path{*outDir} / "atlas.png";
-    auto outMap = std::filesystem::path{*outDir} / "map.json";
+        double totalMs = MsSince(timeBegin);
+        size_t peakMemory = GetPeakMemory();
+        printf("Completed in %f ms\n", totalMs);
+        printf("Peak memory: %.2f MB\n", (double)peakMemory / (1024.0 * 1024.0));
+        if (cmd.statsPath && !WriteStatsJson(std::string{*cmd.statsPath}.c_str(), runStages, jobStats, totalMs, peakMemory)) {
+            printf("Failed to write stats to %s\n", cmd.statsPath->data());
+            return false;
+        }
+        return true;
+    };
 
-    png_image png;
-    memset(&png, 0, sizeof(png));
-    png.version = PNG_IMAGE_VERSION;
-    png.width = atlasW;
-    png.height = atlasH;
-    png.format = PNG_FORMAT_GA;
-    int code = png_image_write_to_file(&png, outAtlas.string().c_str(), 0, atlasBmp.data(), atlasPitch, nullptr);
-    if (code != 1) {
-        printf("Failed to write PNG file (%d)\n", code);
-        return -1;
+    // The inputs are stamped before every build, so a save while it runs still counts as a
+    // change on the next poll.
+    std::vector<std::pair<std::string, FileStamp>> inputs;
+    if (cmd.watch) {
+        inputs = WatchedInputs(cmd);
     }
-
-    std::fstream f{outMap, std::ios::out};
-    if (!f.is_open()) {
-        printf("Failed to write map to %s\n", outMap.string().c_str());
+    if (!build() && !cmd.watch) {
         return -1;
     }
-    
-    f << '{';
-    f << "\"version\":1,";
-    f << "\"glyphs\":[";
-    std::unordered_map<FT_UInt, size_t> glyphIdToJsonId;
-    {
-        size_t nextJsonId = 0;
-        GlyphData prevGlyph;
-        int prevRectX = 0, prevRectY = 0;
-        memset(&prevGlyph, 0, sizeof(prevGlyph));
-        // Glyph structs flattened into one number array and delta-encoded.
-        // Will be parsed as `{width, height, leftBearing, topBearing, advance, x, y}`
-        for (auto& pair : glyphs) {
-            if (nextJsonId != 0) {
-                f << ',';
-            }
-            auto& glyph = pair.second;
-            glyphIdToJsonId[glyph.glyphIndex] = nextJsonId;
-            f << (int64_t)glyph.width - (int64_t)prevGlyph.width << ',';
-            f << (int64_t)glyph.height - (int64_t)prevGlyph.height << ',';
-            f << (int64_t)glyph.leftBearing - (int64_t)prevGlyph.leftBearing << ',';
-            f << (int64_t)glyph.topBearing - (int64_t)prevGlyph.topBearing << ',';
-            f << (((int64_t)glyph.advance - (int64_t)prevGlyph.advance) >> 6) << ',';
-            int rectX = 0, rectY = 0;
-            if (glyph.rectIndex != (size_t)-1) {
-                auto& rect = rects[glyph.rectIndex];
-                rectX = rect.x, rectY = rect.y;
-            }
-            f << (rectX - prevRectX) << ',';
-            f << (rectY - prevRectY);
-            prevGlyph = glyph;
-            prevRectX = rectX;
-            prevRectY = rectY;
-            ++nextJsonId;
-        }
-    }
-    f << "],\"codepoints\":[";
-    // Pairs of [codepoint, glyphJsonId] flattened into one number array and delta-encoded.
-    {
-        size_t i = 0;
-        uint32_t lastCp = 0;
-        uint32_t lastGlyphJsonId = 0;
-        for (auto cpRange : cpRanges) {
-            for (uint32_t cp = cpRange.first; cp <= cpRange.second; ++cp, ++i) {
-                FT_UInt glyphIndex = FT_Get_Char_Index(face, cp);
-                if (glyphIndex == 0) {
-                    continue;
-                }
-                size_t glyphJsonId = glyphIdToJsonId[glyphIndex];
-                if (i != 0) {
-                    f << ',';
+    if (!cmd.watch) {
+        return 0;
+    }
+
+    // Polls the inputs and rebuilds once one of them changed. A failed build or an invalid
+    // manifest keeps watching, the next save is likely to fix it.
+    const auto POLL_INTERVAL = std::chrono::milliseconds{100};
+    // Editors write files in several steps, the build waits for them to settle.
+    const auto SETTLE_TIME = std::chrono::milliseconds{50};
+    printf("Watching %zu file(s) for changes\n", inputs.size());
+    while (true) {
+        // The output may be piped into another tool that shows progress.
+        fflush(stdout);
+        std::this_thread::sleep_for(POLL_INTERVAL);
+        bool changed = false;
+        for (auto& [path, stamp] : inputs) {
+            FileStamp current = StampFile(path);
+            changed |= current != stamp;
+            stamp = current;
+        }
+        if (!changed) {
+            continue;
+        }
+        std::this_thread::sleep_for(SETTLE_TIME);
+        timeBegin = Clock::now();
+        CommandLine next;
+        if (ParseCommandLine(argc, argv, next)) {
+            // The font cache was made for the first --jobs.
+            next.numJobs = cmd.numJobs;
+            cmd = std::move(next);
+            // Files the new command line adds are stamped now, the others keep the stamp
+            // from before the settle time.
+            auto watched = WatchedInputs(cmd);
+            for (auto& [path, stamp] : watched) {
+                auto it = std::find_if(inputs.begin(), inputs.end(), [&](auto& input) { return input.first == path; });
+                if (it != inputs.end()) {
+                    stamp = it->second;
                 }
-                f << (int64_t)cp - (int64_t)lastCp << ',' << (int64_t)glyphJsonId - (int64_t)lastGlyphJsonId;
-                lastGlyphJsonId = glyphJsonId;
-                lastCp = cp;
+            }
+            inputs = std::move(watched);
+            if (!build()) {
+                printf("Build failed, waiting for changes\n");
             }
         }
     }
-    f << "],\"metrics\":{";
-    f << "\"ascender\":" << (face->size->metrics.ascender >> 6) << ",";
-    f << "\"descender\":" << (face->size->metrics.descender >> 6) << ",";
-    f << "\"height\":" << (face->size->metrics.height >> 6);
-    f << "}";
-    f << '}';
-    f.close();
-
-    auto timeEnd = std::chrono::high_resolution_clock::now();
-    printf("Completed in %f ms\n", (double)std::chrono::duration_cast<std::chrono::microseconds>(timeEnd-timeBegin).count() / 1000.0);
-
-    return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,108 @@
+#include "mapped_file.hpp"
+
+#include <filesystem>
+#include <mutex>
+#include <unordered_map>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "defer.hpp"
+
+MappedFile::~MappedFile() {
+    if (!m_data) {
+        return;
+    }
+#ifdef _WIN32
+    UnmapViewOfFile(m_data);
+    CloseHandle(m_mapping);
+#else
+    munmap((void*)m_data, m_size);
+#endif
+}
+
+std::shared_ptr<const MappedFile> MappedFile::Open(const char* path) {
+    std::shared_ptr<MappedFile> file{new MappedFile};
+#ifdef _WIN32
+    HANDLE handle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (handle == INVALID_HANDLE_VALUE) {
+        return nullptr;
+    }
+    // The mapping keeps the file open on its own.
+    defer { CloseHandle(handle); };
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(handle, &size) || size.QuadPart == 0) {
+        return nullptr;
+    }
+    file->m_mapping = CreateFileMappingA(handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!file->m_mapping) {
+        return nullptr;
+    }
+    file->m_data = (const uint8_t*)MapViewOfFile(file->m_mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!file->m_data) {
+        CloseHandle(file->m_mapping);
+        return nullptr;
+    }
+    file->m_size = (size_t)size.QuadPart;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return nullptr;
+    }
+    // The mapping stays valid after the descriptor is closed.
+    defer { close(fd); };
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        return nullptr;
+    }
+    void* data = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        return nullptr;
+    }
+    file->m_data = (const uint8_t*)data;
+    file->m_size = (size_t)st.st_size;
+#endif
+    return file;
+}
+
+std::shared_ptr<const MappedFile> MapFileShared(const char* path) {
+    struct Entry {
+        std::weak_ptr<const MappedFile> file;
+        std::filesystem::file_time_type writeTime;
+        uintmax_t size;
+    };
+    static std::mutex mutex;
+    static std::unordered_map<std::string, Entry> files;
+
+    std::error_code err;
+    auto canonical = std::filesystem::weakly_canonical(path, err);
+    std::string key = err ? std::string{path} : canonical.string();
+    auto writeTime = std::filesystem::last_write_time(key, err);
+    auto size = std::filesystem::file_size(key, err);
+
+    std::lock_guard<std::mutex> lock{mutex};
+    auto it = files.find(key);
+    if (it != files.end() && !err && it->second.writeTime == writeTime && it->second.size == size) {
+        if (auto file = it->second.file.lock()) {
+            return file;
+        }
+    }
+    auto file = MappedFile::Open(path);
+    if (file && !err) {
+        files[key] = {file, writeTime, size};
+    } else {
+        files.erase(key);
+    }
+    // Don't let entries of files nobody uses anymore pile up.
+    for (auto entry = files.begin(); entry != files.end();) {
+        entry = entry->second.file.expired() ? files.erase(entry) : std::next(entry);
+    }
+    return file;
+}
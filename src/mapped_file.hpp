@@ -0,0 +1,33 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+// A file mapped read-only into memory. The pages are only read in when something touches
+// them, and every mapping of the same file shares them with the OS file cache.
+class MappedFile {
+    const uint8_t* m_data = nullptr;
+    size_t m_size = 0;
+#ifdef _WIN32
+    void* m_mapping = nullptr;
+#endif
+
+    MappedFile() = default;
+
+public:
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile();
+
+    // Null if the file can't be opened or mapped, like an empty file or a pipe.
+    static std::shared_ptr<const MappedFile> Open(const char* path);
+
+    const uint8_t* Data() const { return m_data; }
+    size_t Size() const { return m_size; }
+};
+
+// Same as MappedFile::Open, except that a file that is already mapped somewhere in the
+// process is not mapped again. The mapping is dropped once the last user lets go of it,
+// and a file that changed on disk since it was mapped gets a fresh one. Thread safe.
+std::shared_ptr<const MappedFile> MapFileShared(const char* path);
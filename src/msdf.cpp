@@ -0,0 +1,341 @@
+#include "msdf.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+#include <freetype/ftoutln.h>
+
+// Follows the approach of Viktor Chlumsky's msdfgen: the edges of every contour are split
+// into runs between corners, neighbouring runs get different channel pairs, and every
+// channel stores the pseudo-distance to the nearest edge of its colour. Curves are
+// flattened to short line segments first, which keeps the distance math simple. Pixels
+// where the median ends up on the wrong side of the outline, which happens around
+// overlapping contours, fall back to the plain signed distance in all three channels.
+
+namespace {
+
+struct Vec2 {
+    double x = 0;
+    double y = 0;
+};
+
+Vec2 operator+(Vec2 a, Vec2 b) { return {a.x + b.x, a.y + b.y}; }
+Vec2 operator-(Vec2 a, Vec2 b) { return {a.x - b.x, a.y - b.y}; }
+Vec2 operator*(Vec2 a, double s) { return {a.x * s, a.y * s}; }
+double Dot(Vec2 a, Vec2 b) { return a.x * b.x + a.y * b.y; }
+double Cross(Vec2 a, Vec2 b) { return a.x * b.y - a.y * b.x; }
+double Length(Vec2 a) { return sqrt(Dot(a, a)); }
+
+Vec2 Normalize(Vec2 a) {
+    double len = Length(a);
+    return len > 0 ? a * (1.0 / len) : Vec2{0, 1};
+}
+
+enum Channel : uint8_t {
+    RED = 1,
+    GREEN = 2,
+    BLUE = 4,
+    WHITE = RED | GREEN | BLUE,
+    CYAN = GREEN | BLUE,
+    MAGENTA = RED | BLUE,
+    YELLOW = RED | GREEN,
+};
+
+// One outline edge: a line, a conic or a cubic with degree+1 points.
+struct Edge {
+    int degree;
+    Vec2 p[4];
+    uint8_t color = WHITE;
+
+    Vec2 Point(double t) const {
+        double s = 1 - t;
+        switch (degree) {
+        case 1: return p[0] * s + p[1] * t;
+        case 2: return p[0] * (s * s) + p[1] * (2 * s * t) + p[2] * (t * t);
+        default: return p[0] * (s * s * s) + p[1] * (3 * s * s * t) + p[2] * (3 * s * t * t) + p[3] * (t * t * t);
+        }
+    }
+
+    // Tangent directions at the start and end, skipping coincident control points.
+    Vec2 StartDir() const {
+        for (int i = 1; i <= degree; ++i) {
+            if (p[i].x != p[0].x || p[i].y != p[0].y) {
+                return p[i] - p[0];
+            }
+        }
+        return {0, 0};
+    }
+    Vec2 EndDir() const {
+        for (int i = degree - 1; i >= 0; --i) {
+            if (p[i].x != p[degree].x || p[i].y != p[degree].y) {
+                return p[degree] - p[i];
+            }
+        }
+        return {0, 0};
+    }
+};
+
+struct Contour {
+    std::vector<Edge> edges;
+};
+
+struct Decomposer {
+    std::vector<Contour> contours;
+    Vec2 last;
+
+    static Vec2 ToVec(const FT_Vector* v) {
+        return {v->x / 64.0, v->y / 64.0};
+    }
+    void Add(int degree, Vec2 p1, Vec2 p2, Vec2 p3) {
+        Edge edge;
+        edge.degree = degree;
+        edge.p[0] = last;
+        edge.p[1] = p1;
+        edge.p[2] = p2;
+        edge.p[3] = p3;
+        last = degree == 1 ? p1 : degree == 2 ? p2 : p3;
+        if (Length(edge.EndDir()) > 0) {
+            contours.back().edges.push_back(edge);
+        }
+    }
+
+    static int MoveTo(const FT_Vector* to, void* user) {
+        auto self = (Decomposer*)user;
+        self->contours.emplace_back();
+        self->last = ToVec(to);
+        return 0;
+    }
+    static int LineTo(const FT_Vector* to, void* user) {
+        ((Decomposer*)user)->Add(1, ToVec(to), {}, {});
+        return 0;
+    }
+    static int ConicTo(const FT_Vector* control, const FT_Vector* to, void* user) {
+        ((Decomposer*)user)->Add(2, ToVec(control), ToVec(to), {});
+        return 0;
+    }
+    static int CubicTo(const FT_Vector* control1, const FT_Vector* control2, const FT_Vector* to, void* user) {
+        ((Decomposer*)user)->Add(3, ToVec(control1), ToVec(control2), ToVec(to));
+        return 0;
+    }
+};
+
+bool IsCorner(Vec2 a, Vec2 b) {
+    // Anything sharper than about 3 radians between the tangents.
+    const double CROSS_THRESHOLD = sin(3.0);
+    a = Normalize(a);
+    b = Normalize(b);
+    return Dot(a, b) <= 0 || fabs(Cross(a, b)) > CROSS_THRESHOLD;
+}
+
+void ColorEdges(std::vector<Contour>& contours) {
+    for (auto& contour : contours) {
+        auto& edges = contour.edges;
+        std::vector<size_t> corners;
+        for (size_t i = 0; i < edges.size(); ++i) {
+            const Edge& prev = edges[(i + edges.size() - 1) % edges.size()];
+            if (IsCorner(prev.EndDir(), edges[i].StartDir())) {
+                corners.push_back(i);
+            }
+        }
+
+        if (corners.empty()) {
+            // Smooth contour, nothing to keep sharp.
+            continue;
+        }
+        const size_t m = edges.size();
+        if (corners.size() == 1) {
+            // Teardrop: spread three colours over the edges starting at the only corner.
+            if (m < 3) {
+                continue;
+            }
+            const uint8_t colors[3] = {MAGENTA, WHITE, YELLOW};
+            for (size_t i = 0; i < m; ++i) {
+                int c = (int)(3 + 2.875 * i / (m - 1) - 1.4375 + 0.5) - 2;
+                edges[(corners[0] + i) % m].color = colors[std::clamp(c, 0, 2)];
+            }
+            continue;
+        }
+
+        // Cycle through the colours at every corner. The last run touches the first one,
+        // so it must not end up with the same colour.
+        const uint8_t cycle[3] = {CYAN, MAGENTA, YELLOW};
+        const size_t runs = corners.size();
+        for (size_t run = 0; run < runs; ++run) {
+            uint8_t color = cycle[run % 3];
+            if (run == runs - 1 && run % 3 == 0) {
+                color = MAGENTA;
+            }
+            size_t i = corners[run];
+            const size_t end = corners[(run + 1) % runs];
+            do {
+                edges[i].color = color;
+                i = (i + 1) % m;
+            } while (i != end);
+        }
+    }
+}
+
+// A flattened piece of an edge. Pseudo-distances only extend past the real ends of an edge.
+struct Segment {
+    Vec2 a;
+    Vec2 b;
+    uint8_t color;
+    bool edgeStart;
+    bool edgeEnd;
+};
+
+void Flatten(const std::vector<Contour>& contours, std::vector<Segment>& segments) {
+    // Chords of at most about a pixel keep the flattening error well below a pixel.
+    const double SEGMENT_LENGTH = 1.0;
+    for (auto& contour : contours) {
+        for (auto& edge : contour.edges) {
+            double hull = 0;
+            for (int i = 0; i < edge.degree; ++i) {
+                hull += Length(edge.p[i + 1] - edge.p[i]);
+            }
+            int steps = edge.degree == 1 ? 1 : std::clamp((int)ceil(hull / SEGMENT_LENGTH), 2, 64);
+            Vec2 prev = edge.p[0];
+            for (int i = 1; i <= steps; ++i) {
+                Vec2 next = i == steps ? edge.p[edge.degree] : edge.Point((double)i / steps);
+                segments.push_back({prev, next, edge.color, i == 1, i == steps});
+                prev = next;
+            }
+        }
+    }
+}
+
+struct Nearest {
+    double distance = INFINITY;
+    // How far from perpendicular the nearest point is seen, breaks ties at shared vertices.
+    double dot = 1;
+    const Segment* segment = nullptr;
+    double t = 0;
+};
+
+uint8_t Encode(double distance, int spread) {
+    return (uint8_t)std::clamp((int)lround(128.0 + distance * 128.0 / spread), 0, 255);
+}
+
+double Median(double a, double b, double c) {
+    return std::max(std::min(a, b), std::min(std::max(a, b), c));
+}
+
+}
+
+void RenderMsdf(const FT_Outline& outline, int spread, MsdfBitmap& bitmap) {
+    bitmap = MsdfBitmap{};
+    if (outline.n_points == 0) {
+        return;
+    }
+
+    Decomposer decomposer;
+    FT_Outline_Funcs funcs = {Decomposer::MoveTo, Decomposer::LineTo, Decomposer::ConicTo, Decomposer::CubicTo, 0, 0};
+    if (FT_Outline_Decompose((FT_Outline*)&outline, &funcs, &decomposer) != 0) {
+        return;
+    }
+    ColorEdges(decomposer.contours);
+    std::vector<Segment> segments;
+    Flatten(decomposer.contours, segments);
+    if (segments.empty()) {
+        return;
+    }
+
+    // TrueType outlines are clockwise, so their inside is to the right of every edge.
+    const double orientation = FT_Outline_Get_Orientation((FT_Outline*)&outline) == FT_ORIENTATION_POSTSCRIPT ? -1.0 : 1.0;
+    const bool evenOdd = (outline.flags & FT_OUTLINE_EVEN_ODD_FILL) != 0;
+
+    FT_BBox box;
+    FT_Outline_Get_CBox(&outline, &box);
+    bitmap.left = (int)floor(box.xMin / 64.0) - spread;
+    bitmap.top = (int)ceil(box.yMax / 64.0) + spread;
+    bitmap.width = (int)ceil(box.xMax / 64.0) + spread - bitmap.left;
+    bitmap.height = bitmap.top - ((int)floor(box.yMin / 64.0) - spread);
+    bitmap.rgb.resize((size_t)bitmap.width * bitmap.height * 3);
+
+    const uint8_t channels[3] = {RED, GREEN, BLUE};
+    for (int y = 0; y < bitmap.height; ++y) {
+        for (int x = 0; x < bitmap.width; ++x) {
+            const Vec2 p{bitmap.left + x + 0.5, bitmap.top - y - 0.5};
+            Nearest nearest[3];
+            double trueDistance = INFINITY;
+            int winding = 0;
+
+            for (const Segment& segment : segments) {
+                Vec2 ab = segment.b - segment.a;
+                Vec2 aq = p - segment.a;
+                double t = Dot(aq, ab) / Dot(ab, ab);
+                double distance, dot = 0;
+                if (t < 0) {
+                    distance = Length(aq);
+                    dot = fabs(Dot(Normalize(ab), Normalize(aq)));
+                } else if (t > 1) {
+                    Vec2 bq = p - segment.b;
+                    distance = Length(bq);
+                    dot = fabs(Dot(Normalize(ab), Normalize(bq)));
+                } else {
+                    distance = fabs(Cross(aq, ab)) / Length(ab);
+                }
+                trueDistance = std::min(trueDistance, distance);
+                for (int c = 0; c < 3; ++c) {
+                    if (!(segment.color & channels[c])) {
+                        continue;
+                    }
+                    Nearest& n = nearest[c];
+                    if (distance < n.distance - 1e-9 || (distance < n.distance + 1e-9 && dot < n.dot)) {
+                        n = {distance, dot, &segment, t};
+                    }
+                }
+
+                // Crossings of a ray towards +x decide what is inside.
+                if ((segment.a.y > p.y) != (segment.b.y > p.y)) {
+                    double crossX = segment.a.x + (p.y - segment.a.y) * ab.x / ab.y;
+                    if (crossX > p.x) {
+                        winding += segment.b.y > segment.a.y ? 1 : -1;
+                    }
+                }
+            }
+
+            const bool inside = evenOdd ? (winding & 1) != 0 : winding != 0;
+            const double signedTrue = inside ? trueDistance : -trueDistance;
+            double values[3];
+            for (int c = 0; c < 3; ++c) {
+                const Nearest& n = nearest[c];
+                if (!n.segment) {
+                    values[c] = signedTrue;
+                    continue;
+                }
+                const Segment& s = *n.segment;
+                Vec2 dir = Normalize(s.b - s.a);
+                double value = n.distance * (Cross(p - s.a, dir) * orientation >= 0 ? 1 : -1);
+                // Past the end of an edge, use the distance to its tangent line instead. This
+                // is what keeps the corners in the median sharp.
+                if (n.t < 0 && s.edgeStart) {
+                    Vec2 aq = p - s.a;
+                    if (Dot(aq, dir) < 0) {
+                        double pseudo = Cross(aq, dir) * orientation;
+                        if (fabs(pseudo) <= fabs(value)) {
+                            value = pseudo;
+                        }
+                    }
+                } else if (n.t > 1 && s.edgeEnd) {
+                    Vec2 bq = p - s.b;
+                    if (Dot(bq, dir) > 0) {
+                        double pseudo = Cross(bq, dir) * orientation;
+                        if (fabs(pseudo) <= fabs(value)) {
+                            value = pseudo;
+                        }
+                    }
+                }
+                values[c] = value;
+            }
+            if ((Median(values[0], values[1], values[2]) > 0) != inside) {
+                values[0] = values[1] = values[2] = signedTrue;
+            }
+
+            uint8_t* out = &bitmap.rgb[((size_t)y * bitmap.width + x) * 3];
+            for (int c = 0; c < 3; ++c) {
+                out[c] = Encode(values[c], spread);
+            }
+        }
+    }
+}
@@ -0,0 +1,22 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+#include <freetype/freetype.h>
+
+// Multi-channel signed distance field of a glyph outline, three bytes (R, G, B) per pixel.
+// Each channel is stored like FT_RENDER_MODE_SDF stores its single one: 128 is on the edge,
+// higher is inside, and 0/255 are spread pixels out/in. The shape is the median of the
+// three channels, which keeps corners sharp when the field is scaled up.
+struct MsdfBitmap {
+    int width = 0;
+    int height = 0;
+    // Offset of the top left pixel from the glyph origin, like bitmap_left/bitmap_top.
+    int left = 0;
+    int top = 0;
+    std::vector<uint8_t> rgb;
+};
+
+// Renders the field with spread pixels of margin on every side. The outline is in 26.6
+// pixels, as loaded by FT_Load_Glyph.
+void RenderMsdf(const FT_Outline& outline, int spread, MsdfBitmap& bitmap);
@@ -0,0 +1,94 @@
+#pragma once
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Runs fn(workerIndex, itemIndex) for every item in [0, count) on numWorkers threads.
+// The calling thread is worker 0. Items are split into one contiguous range per worker;
+// a worker that runs out of items steals the back half of the largest remaining range,
+// so a few expensive items don't leave the other threads idle.
+template <class Fn>
+void ParallelFor(size_t numWorkers, size_t count, Fn&& fn) {
+    if (numWorkers <= 1 || count <= 1) {
+        for (size_t i = 0; i < count; ++i) {
+            fn((size_t)0, i);
+        }
+        return;
+    }
+    if (numWorkers > count) {
+        numWorkers = count;
+    }
+
+    struct Range {
+        std::mutex mutex;
+        size_t begin;
+        size_t end;
+    };
+    std::unique_ptr<Range[]> ranges{new Range[numWorkers]};
+    for (size_t w = 0; w < numWorkers; ++w) {
+        ranges[w].begin = count * w / numWorkers;
+        ranges[w].end = count * (w+1) / numWorkers;
+    }
+
+    auto work = [&](size_t worker) {
+        Range& own = ranges[worker];
+        while (true) {
+            size_t item = 0;
+            bool haveItem = false;
+            {
+                std::lock_guard<std::mutex> lock{own.mutex};
+                if (own.begin < own.end) {
+                    item = own.begin++;
+                    haveItem = true;
+                }
+            }
+            if (haveItem) {
+                fn(worker, item);
+                continue;
+            }
+
+            // Pick the victim with the most work left. It may drain before we get to lock it
+            // again, in which case we just look for another one.
+            size_t victim = worker;
+            size_t victimSize = 0;
+            for (size_t w = 0; w < numWorkers; ++w) {
+                std::lock_guard<std::mutex> lock{ranges[w].mutex};
+                size_t size = ranges[w].end - ranges[w].begin;
+                if (size > victimSize) {
+                    victim = w;
+                    victimSize = size;
+                }
+            }
+            if (victimSize == 0) {
+                return;
+            }
+
+            size_t stolenBegin, stolenEnd;
+            {
+                std::lock_guard<std::mutex> lock{ranges[victim].mutex};
+                Range& other = ranges[victim];
+                if (other.begin >= other.end) {
+                    continue;
+                }
+                stolenEnd = other.end;
+                stolenBegin = other.begin + (other.end - other.begin) / 2;
+                other.end = stolenBegin;
+            }
+            std::lock_guard<std::mutex> lock{own.mutex};
+            own.begin = stolenBegin;
+            own.end = stolenEnd;
+        }
+    };
+
+    std::vector<std::thread> threads;
+    threads.reserve(numWorkers - 1);
+    for (size_t w = 1; w < numWorkers; ++w) {
+        threads.emplace_back(work, w);
+    }
+    work(0);
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
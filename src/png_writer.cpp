@@ -0,0 +1,378 @@
+#include "png_writer.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <csetjmp>
+#include <vector>
+
+#include <png.h>
+#include <zlib.h>
+#include "defer.hpp"
+#include "parallel.hpp"
+
+namespace {
+
+int ChannelCount(int colorType) {
+    switch (colorType) {
+    case PNG_COLOR_TYPE_GRAY: return 1;
+    case PNG_COLOR_TYPE_GRAY_ALPHA: return 2;
+    case PNG_COLOR_TYPE_RGB: return 3;
+    case PNG_COLOR_TYPE_RGB_ALPHA: return 4;
+    }
+    return 0;
+}
+
+bool WritePngLibpng(FILE* file, int width, int height, int bitDepth, int colorType, const uint8_t* data, size_t pitch, const PngOptions& options) {
+    PngRowWriter writer;
+    return writer.Open(nullptr, width, height, bitDepth, colorType, options, file) &&
+        writer.WriteRows(data, height, pitch) && writer.Finish();
+}
+
+// Written without branches so the compiler can vectorize the filter loop.
+inline uint8_t Paeth(int a, int b, int c) {
+    int pa = abs(b - c);
+    int pb = abs(a - c);
+    int pc = abs(a + b - 2*c);
+    int bc = pb <= pc ? b : c;
+    return (uint8_t)(pa <= pb && pa <= pc ? a : bc);
+}
+
+// Filters bytes [begin, end) of a row into out. prev is a row of zeros for the first row.
+void FilterBytes(int filter, const uint8_t* row, const uint8_t* prev, size_t bpp, uint8_t* out, size_t begin, size_t end) {
+    size_t head = std::min(std::max(begin, bpp), end);
+    switch (filter) {
+    case 0:
+        memcpy(out + begin, row + begin, end - begin);
+        break;
+    case 1:
+        for (size_t i = begin; i < head; ++i) {
+            out[i] = row[i];
+        }
+        for (size_t i = head; i < end; ++i) {
+            out[i] = (uint8_t)(row[i] - row[i - bpp]);
+        }
+        break;
+    case 2:
+        for (size_t i = begin; i < end; ++i) {
+            out[i] = (uint8_t)(row[i] - prev[i]);
+        }
+        break;
+    case 3:
+        for (size_t i = begin; i < head; ++i) {
+            out[i] = (uint8_t)(row[i] - (prev[i] >> 1));
+        }
+        for (size_t i = head; i < end; ++i) {
+            out[i] = (uint8_t)(row[i] - ((row[i - bpp] + prev[i]) >> 1));
+        }
+        break;
+    case 4:
+        for (size_t i = begin; i < head; ++i) {
+            out[i] = (uint8_t)(row[i] - prev[i]);
+        }
+        for (size_t i = head; i < end; ++i) {
+            out[i] = (uint8_t)(row[i] - Paeth(row[i - bpp], prev[i], prev[i - bpp]));
+        }
+        break;
+    }
+}
+
+// Writes filter byte + filtered row to dst.
+void FilterRow(int filter, const uint8_t* row, const uint8_t* prev, size_t rowBytes, size_t bpp, uint8_t* dst) {
+    dst[0] = (uint8_t)filter;
+    FilterBytes(filter, row, prev, bpp, dst + 1, 0, rowBytes);
+}
+
+// Same heuristic as libpng: the filter with the smallest sum of absolute signed bytes wins.
+// A candidate is abandoned as soon as its running sum can't win anymore.
+void FilterRowAdaptive(const uint8_t* row, const uint8_t* prev, size_t rowBytes, size_t bpp, uint8_t* dst, std::vector<uint8_t>& scratch) {
+    const size_t BLOCK = 1024;
+    scratch.resize(rowBytes + 1);
+    uint64_t bestSum = UINT64_MAX;
+    for (int filter = 0; filter <= 4; ++filter) {
+        uint8_t* candidate = filter == 0 ? dst : scratch.data();
+        candidate[0] = (uint8_t)filter;
+        uint64_t sum = 0;
+        for (size_t begin = 0; begin < rowBytes && sum < bestSum; begin += BLOCK) {
+            size_t end = std::min(rowBytes, begin + BLOCK);
+            FilterBytes(filter, row, prev, bpp, candidate + 1, begin, end);
+            for (size_t i = begin + 1; i <= end; ++i) {
+                sum += candidate[i] < 128 ? candidate[i] : 256 - candidate[i];
+            }
+        }
+        if (sum < bestSum) {
+            bestSum = sum;
+            if (candidate != dst) {
+                memcpy(dst, candidate, rowBytes + 1);
+            }
+        }
+    }
+}
+
+void WriteChunk(FILE* file, const char* type, const uint8_t* data, size_t size, bool& ok) {
+    uint8_t header[8] = {
+        (uint8_t)(size >> 24), (uint8_t)(size >> 16), (uint8_t)(size >> 8), (uint8_t)size,
+        (uint8_t)type[0], (uint8_t)type[1], (uint8_t)type[2], (uint8_t)type[3],
+    };
+    uLong crc = crc32(0, header + 4, 4);
+    if (size != 0) {
+        crc = crc32(crc, data, (uInt)size);
+    }
+    uint8_t footer[4] = {(uint8_t)(crc >> 24), (uint8_t)(crc >> 16), (uint8_t)(crc >> 8), (uint8_t)crc};
+    ok = ok && fwrite(header, 1, 8, file) == 8;
+    ok = ok && (size == 0 || fwrite(data, 1, size, file) == size);
+    ok = ok && fwrite(footer, 1, 4, file) == 4;
+}
+
+// pigz-style encode. The filtered image is cut into bands of whole rows, each band is raw
+// deflated on its own thread with the previous band's last 32 KiB as dictionary, and the
+// deflate streams are joined behind one zlib header. Every band but the last ends with a
+// sync flush so the streams line up on byte boundaries. Each band becomes one IDAT chunk.
+bool WritePngBanded(FILE* file, int width, int height, int bitDepth, int colorType, const uint8_t* data, size_t pitch, const PngOptions& options) {
+    const size_t channels = ChannelCount(colorType);
+    const size_t rowBytes = ((size_t)width * channels * bitDepth + 7) / 8;
+    const size_t bpp = std::max<size_t>(1, channels * bitDepth / 8);
+    const size_t filteredRow = rowBytes + 1;
+    // Bands depend only on the image, never on the thread count, so the output doesn't either.
+    const size_t BAND_BYTES = 256 * 1024;
+    const size_t DICT_BYTES = 32 * 1024;
+    const size_t bandRows = std::max<size_t>(1, BAND_BYTES / filteredRow);
+    const size_t numBands = ((size_t)height + bandRows - 1) / bandRows;
+    const int level = options.level >= 0 ? options.level : Z_DEFAULT_COMPRESSION;
+
+    PngFilter filter = options.filter;
+    if (filter == PngFilter::Default) {
+        filter = bitDepth < 8 ? PngFilter::None : PngFilter::All;
+    }
+
+    std::vector<uint8_t> filtered;
+    filtered.resize(filteredRow * height);
+    std::vector<uint8_t> zeroRow(rowBytes, 0);
+    std::vector<std::vector<uint8_t>> scratch{options.threads};
+    ParallelFor(options.threads, height, [&](size_t worker, size_t y) {
+        const uint8_t* row = data + y*pitch;
+        const uint8_t* prev = y == 0 ? zeroRow.data() : data + (y-1)*pitch;
+        uint8_t* dst = &filtered[y * filteredRow];
+        switch (filter) {
+        case PngFilter::None: FilterRow(0, row, prev, rowBytes, bpp, dst); break;
+        case PngFilter::Sub: FilterRow(1, row, prev, rowBytes, bpp, dst); break;
+        case PngFilter::Up: FilterRow(2, row, prev, rowBytes, bpp, dst); break;
+        case PngFilter::Average: FilterRow(3, row, prev, rowBytes, bpp, dst); break;
+        case PngFilter::Paeth: FilterRow(4, row, prev, rowBytes, bpp, dst); break;
+        case PngFilter::Default:
+        case PngFilter::All: FilterRowAdaptive(row, prev, rowBytes, bpp, dst, scratch[worker]); break;
+        }
+    });
+
+    std::vector<std::vector<uint8_t>> compressed{numBands};
+    std::vector<uLong> adlers(numBands);
+    std::vector<char> failed(numBands, 0);
+    ParallelFor(options.threads, numBands, [&](size_t, size_t band) {
+        size_t begin = band * bandRows * filteredRow;
+        size_t end = std::min(filtered.size(), (band + 1) * bandRows * filteredRow);
+        bool last = band + 1 == numBands;
+
+        z_stream strm;
+        memset(&strm, 0, sizeof(strm));
+        if (deflateInit2(&strm, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            failed[band] = 1;
+            return;
+        }
+        defer { deflateEnd(&strm); };
+        if (begin != 0) {
+            size_t dictSize = std::min(begin, DICT_BYTES);
+            deflateSetDictionary(&strm, &filtered[begin - dictSize], (uInt)dictSize);
+        }
+
+        auto& out = compressed[band];
+        out.resize(deflateBound(&strm, (uLong)(end - begin)) + 16);
+        strm.next_in = &filtered[begin];
+        strm.avail_in = (uInt)(end - begin);
+        strm.next_out = out.data();
+        strm.avail_out = (uInt)out.size();
+        int result = deflate(&strm, last ? Z_FINISH : Z_SYNC_FLUSH);
+        if ((last && result != Z_STREAM_END) || (!last && result != Z_OK) || strm.avail_in != 0) {
+            failed[band] = 1;
+            return;
+        }
+        out.resize(out.size() - strm.avail_out);
+        adlers[band] = adler32(adler32(0, nullptr, 0), &filtered[begin], (uInt)(end - begin));
+    });
+    for (char bandFailed : failed) {
+        if (bandFailed) {
+            return false;
+        }
+    }
+
+    uLong adler = adler32(0, nullptr, 0);
+    for (size_t band = 0; band < numBands; ++band) {
+        size_t begin = band * bandRows * filteredRow;
+        size_t end = std::min(filtered.size(), (band + 1) * bandRows * filteredRow);
+        adler = adler32_combine(adler, adlers[band], (z_off_t)(end - begin));
+    }
+
+    bool ok = true;
+    static const uint8_t SIGNATURE[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    ok = fwrite(SIGNATURE, 1, 8, file) == 8;
+
+    uint8_t ihdr[13] = {
+        (uint8_t)(width >> 24), (uint8_t)(width >> 16), (uint8_t)(width >> 8), (uint8_t)width,
+        (uint8_t)(height >> 24), (uint8_t)(height >> 16), (uint8_t)(height >> 8), (uint8_t)height,
+        (uint8_t)bitDepth, (uint8_t)colorType, 0, 0, 0,
+    };
+    WriteChunk(file, "IHDR", ihdr, sizeof(ihdr), ok);
+    uint8_t srgb = PNG_sRGB_INTENT_PERCEPTUAL;
+    WriteChunk(file, "sRGB", &srgb, 1, ok);
+
+    // zlib header: deflate with a 32K window, FLEVEL from the compression level, and FCHECK
+    // making the 16-bit value a multiple of 31.
+    int flevel = level == Z_DEFAULT_COMPRESSION ? 2 : level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3;
+    uint8_t zhead[2] = {0x78, (uint8_t)(flevel << 6)};
+    zhead[1] += 31 - ((zhead[0] << 8) + zhead[1]) % 31;
+    compressed[0].insert(compressed[0].begin(), zhead, zhead + 2);
+    uint8_t ztail[4] = {(uint8_t)(adler >> 24), (uint8_t)(adler >> 16), (uint8_t)(adler >> 8), (uint8_t)adler};
+    compressed.back().insert(compressed.back().end(), ztail, ztail + 4);
+
+    for (auto& band : compressed) {
+        WriteChunk(file, "IDAT", band.data(), band.size(), ok);
+    }
+    WriteChunk(file, "IEND", nullptr, 0, ok);
+    return ok;
+}
+
+}
+
+PngRowWriter::~PngRowWriter() {
+    if (m_png) {
+        png_destroy_write_struct(&m_png, &m_info);
+    }
+    if (m_file) {
+        fclose(m_file);
+    }
+}
+
+bool PngRowWriter::Open(const char* path, int width, int height, int bitDepth, int colorType, const PngOptions& options, FILE* file) {
+    if (!file) {
+        m_file = fopen(path, "wb");
+        if (!m_file) {
+            return false;
+        }
+    }
+    m_png = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+    if (!m_png) {
+        return false;
+    }
+    m_info = png_create_info_struct(m_png);
+    if (!m_info) {
+        return false;
+    }
+    // Setting the stream can't fail. Doing it before setjmp leaves no local that a longjmp
+    // could clobber.
+    png_init_io(m_png, file ? file : m_file);
+    if (setjmp(png_jmpbuf(m_png))) {
+        return false;
+    }
+
+    if (options.level >= 0) {
+        png_set_compression_level(m_png, options.level);
+    }
+    switch (options.filter) {
+    case PngFilter::Default: break;
+    case PngFilter::None: png_set_filter(m_png, 0, PNG_FILTER_NONE); break;
+    case PngFilter::Sub: png_set_filter(m_png, 0, PNG_FILTER_SUB); break;
+    case PngFilter::Up: png_set_filter(m_png, 0, PNG_FILTER_UP); break;
+    case PngFilter::Average: png_set_filter(m_png, 0, PNG_FILTER_AVG); break;
+    case PngFilter::Paeth: png_set_filter(m_png, 0, PNG_FILTER_PAETH); break;
+    case PngFilter::All: png_set_filter(m_png, 0, PNG_ALL_FILTERS); break;
+    }
+    png_set_IHDR(m_png, m_info, width, height, bitDepth, colorType, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    // Same as the simplified API wrote before, keeps old and new files identical.
+    png_set_sRGB(m_png, m_info, PNG_sRGB_INTENT_PERCEPTUAL);
+    png_write_info(m_png, m_info);
+    m_rowsLeft = height;
+    return true;
+}
+
+bool PngRowWriter::WriteRows(const uint8_t* rows, size_t count, size_t pitch) {
+    if (!m_png || count > (size_t)m_rowsLeft) {
+        return false;
+    }
+    if (setjmp(png_jmpbuf(m_png))) {
+        return false;
+    }
+    for (size_t y = 0; y < count; ++y) {
+        png_write_row(m_png, rows + y*pitch);
+    }
+    m_rowsLeft -= (int)count;
+    return true;
+}
+
+bool PngRowWriter::Finish() {
+    if (!m_png || m_rowsLeft != 0) {
+        return false;
+    }
+    if (setjmp(png_jmpbuf(m_png))) {
+        return false;
+    }
+    png_write_end(m_png, m_info);
+    png_destroy_write_struct(&m_png, &m_info);
+    m_png = nullptr;
+    if (m_file) {
+        FILE* file = m_file;
+        m_file = nullptr;
+        return fclose(file) == 0;
+    }
+    return true;
+}
+
+bool WritePng(const char* path, int width, int height, int bitDepth, int colorType, const uint8_t* data, size_t pitch, const PngOptions& options) {
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+        return false;
+    }
+    bool ok;
+    if (options.threads > 1 && height > 0) {
+        ok = WritePngBanded(file, width, height, bitDepth, colorType, data, pitch, options);
+    } else {
+        ok = WritePngLibpng(file, width, height, bitDepth, colorType, data, pitch, options);
+    }
+    return fclose(file) == 0 && ok;
+}
+
+bool ReadPng(const char* path, int& width, int& height, int& bitDepth, int& colorType, std::vector<uint8_t>& data, size_t& pitch) {
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        return false;
+    }
+    defer { fclose(file); };
+    png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+    if (!png) {
+        return false;
+    }
+    png_infop info = png_create_info_struct(png);
+    defer { png_destroy_read_struct(&png, info ? &info : nullptr, nullptr); };
+    if (!info) {
+        return false;
+    }
+    if (setjmp(png_jmpbuf(png))) {
+        return false;
+    }
+
+    png_init_io(png, file);
+    png_read_info(png, info);
+    if (png_get_interlace_type(png, info) != PNG_INTERLACE_NONE) {
+        return false;
+    }
+    width = (int)png_get_image_width(png, info);
+    height = (int)png_get_image_height(png, info);
+    bitDepth = png_get_bit_depth(png, info);
+    colorType = png_get_color_type(png, info);
+    pitch = png_get_rowbytes(png, info);
+    data.assign(pitch * height, 0);
+    for (int y = 0; y < height; ++y) {
+        png_read_row(png, &data[y * pitch], nullptr);
+    }
+    png_read_end(png, nullptr);
+    return true;
+}
@@ -0,0 +1,61 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+struct png_struct_def;
+struct png_info_def;
+
+enum class PngFilter {
+    // Whatever libpng picks: adaptive for 8-bit images, none below 8 bits.
+    Default,
+    None,
+    Sub,
+    Up,
+    Average,
+    Paeth,
+    // Try every filter on every row and keep the one that compresses best.
+    All,
+};
+
+struct PngOptions {
+    // zlib level 0-9, -1 uses the zlib default.
+    int level = -1;
+    PngFilter filter = PngFilter::Default;
+    // More than one thread deflates bands of rows in parallel and stitches them into one
+    // zlib stream. The output is the same for any thread count above one, but differs
+    // from the single threaded libpng output.
+    size_t threads = 1;
+};
+
+// Writes an 8-bit or 1-bit grayscale (PNG_COLOR_TYPE_GRAY) or gray+alpha
+// (PNG_COLOR_TYPE_GRAY_ALPHA) image. Rows are pitch bytes apart in data.
+bool WritePng(const char* path, int width, int height, int bitDepth, int colorType, const uint8_t* data, size_t pitch, const PngOptions& options);
+
+// Reads a non-interlaced image back as it is stored, without any conversion, like the
+// ones WritePng writes. Rows are pitch bytes apart in data.
+bool ReadPng(const char* path, int& width, int& height, int& bitDepth, int& colorType, std::vector<uint8_t>& data, size_t& pitch);
+
+// Writes an image with libpng a few rows at a time, so the caller never needs the whole
+// image in memory. The file is the same as WritePng with one thread writes.
+class PngRowWriter {
+    FILE* m_file = nullptr;
+    png_struct_def* m_png = nullptr;
+    png_info_def* m_info = nullptr;
+    int m_rowsLeft = 0;
+
+public:
+    PngRowWriter() = default;
+    PngRowWriter(const PngRowWriter&) = delete;
+    PngRowWriter& operator=(const PngRowWriter&) = delete;
+    ~PngRowWriter();
+
+    // Creates the file and writes the header. file can be passed instead of a path to
+    // write to an already open file, which is then not closed.
+    bool Open(const char* path, int width, int height, int bitDepth, int colorType, const PngOptions& options, FILE* file = nullptr);
+    // Writes the next count rows, pitch bytes apart.
+    bool WriteRows(const uint8_t* rows, size_t count, size_t pitch);
+    // Ends the image once every row has been written.
+    bool Finish();
+};